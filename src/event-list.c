@@ -58,6 +58,19 @@ void event_list_remove(struct event_list_type *event_list,
 	return clear_bit(event, event_list->mask);
 }
 
+void event_list_from_u32(struct event_list_type *event_list,
+					const u32 *words, int word_count)
+{
+	int event;
+	
+	event_list_clear(event_list);
+	
+	for(event = 0; event < word_count * 32 && event < EVENT_LIST_TYPE_MAX_EVENTS; event ++) {
+		if(words[event / 32] & (1U << (event % 32)))
+			__set_bit(event, event_list->mask);
+	}
+}
+
 int event_list_extract_one(struct event_list_type *event_list)
 {
 	int ret = find_first_bit(event_list->mask, EVENT_LIST_TYPE_MAX_EVENTS);
@@ -74,96 +87,141 @@ int event_list_extract_one(struct event_list_type *event_list)
 
 void event_dispatch_list_init(struct event_dispatch_list *list)
 {
+	BUILD_BUG_ON(EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS > 32);
+	
 	memset(list, 0, sizeof(struct event_dispatch_list));
 }
 
+/* Return the slot of the subscriber or a negative value if not found. */
+static int find_slot(struct event_dispatch_list *list, void *subscriber)
+{
+	int i;
+	
+	for(i = 0; i < EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS; i ++) {
+		if(list->subs[i] == subscriber)
+			return i;
+	}
+	
+	return -1;
+}
+
+/* Clears the subscription of the slot 'i' to the 'event' if set. */
+static void remove_from_slot(struct event_dispatch_list *list, int i, int event)
+{
+	u32 bit = 1U << i;
+	
+	if(!(list->event_subs[event] & bit))
+		return;
+	
+	list->event_subs[event] &= ~bit;
+	if(list->event_subs[event] == 0) {
+		/* nobody uses the event anymore */
+		event_list_remove(&list->all_events, event);
+	}
+	
+	list->subs_event_count[i] --;
+	if(list->subs_event_count[i] == 0) {
+		/* no more events, the slot is free */
+		list->subs[i] = NULL;
+	}
+}
+
 int event_dispatch_list_add(struct event_dispatch_list *list, void *subscriber, int event)
 {
 	int i;
-	void **event_subs;
+	u32 bit;
 	
 	if(event < 0 || event >= EVENT_LIST_TYPE_MAX_EVENTS) return -EINVAL;
 	
-	event_subs = &list->subs[event][0];
+	i = find_slot(list, subscriber);
+	if(i < 0) {
+		/* a new subscriber, take a free slot */
+		i = find_slot(list, NULL);
+		if(i < 0) 
+			return -ENOMEM;
+		list->subs[i] = subscriber;
+	}
 	
-	for(i = 0; i < EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS; i ++) {
-		if(event_subs[i] == NULL) {
-			/* add to the list and finish */
-			event_subs[i] = subscriber;
-			return 0;
-		} else {
-			/* already added? finish then. */
-			if(event_subs[i] == subscriber) 
-				return 0;
-		}
+	bit = 1U << i;
+	
+	/* already added? finish then. */
+	if(list->event_subs[event] & bit)
+		return 0;
+	
+	if(list->event_subs[event] == 0) {
+		/* the first subscriber of the event */
+		event_list_add(&list->all_events, event);
 	}
 	
-	return -ENOMEM;
+	list->event_subs[event] |= bit;
+	list->subs_event_count[i] ++;
+	
+	return 0;
 }
 
 void event_dispatch_list_remove(
 			struct event_dispatch_list *list, void *subscriber, int event)
 {
 	int i;
-	void **event_subs;
 	
 	if(event < 0 || event >= EVENT_LIST_TYPE_MAX_EVENTS) return;
 	
-	event_subs = &list->subs[event][0];
+	i = find_slot(list, subscriber);
+	if(i < 0) return;
 	
-	for(i = 0; i < EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS; i ++) {
-		if(event_subs[i] == NULL) break; /* no more */
-		if(event_subs[i] == subscriber) {
-			/* move all by 1 so the entry is overwritten */
-			memmove(event_subs + i, event_subs + i + 1, 
-				(EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS - i - 1) * sizeof(void *));
-			/* the last is surely emtpy now: set to NULL */
-			event_subs[EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS - 1] = NULL;
-			break;
-		}
-	}
+	remove_from_slot(list, i, event);
 }
 
 void event_dispatch_list_remove_all(
 			struct event_dispatch_list *list, void *subscriber)
 {
 	int ievent;
+	int i = find_slot(list, subscriber);
 	
-	for(ievent = 0; ievent < EVENT_LIST_TYPE_MAX_EVENTS; ievent ++) {
-		event_dispatch_list_remove(list, subscriber, ievent);
+	if(i < 0) return;
+	
+	for(ievent = 0; ievent < EVENT_LIST_TYPE_MAX_EVENTS && list->subs[i] != NULL; ievent ++) {
+		remove_from_slot(list, i, ievent);
 	}
 }
 
 void event_dispatch_list_add_subscribed_events(struct event_dispatch_list *list,
 				struct event_list_type *all_events)
+{
+	bitmap_or(all_events->mask, all_events->mask, list->all_events.mask, 
+			EVENT_LIST_TYPE_MAX_EVENTS);
+}
+
+void event_dispatch_list_subscriber_events(struct event_dispatch_list *list,
+				void *subscriber, struct event_list_type *events)
 {
 	int ievent;
+	int i = find_slot(list, subscriber);
+	
+	event_list_clear(events);
+	
+	if(i < 0) return;
 	
 	for(ievent = 0; ievent < EVENT_LIST_TYPE_MAX_EVENTS; ievent ++) {
-		if(list->subs[ievent][0] != NULL) {
-			/* the event is used by at least one */
-			event_list_add(all_events, ievent);
-		}
+		if(list->event_subs[ievent] & (1U << i))
+			event_list_add(events, ievent);
 	}
 }
 
 void event_dispatch_list_for_all_subscribers(struct event_dispatch_list *list, 
 			int event, event_dispatch_list_callback callback, void *arg)
 {
-	void **event_subs;
-	int i;
+	u32 mask;
 	
 	if(event < 0 || event >= EVENT_LIST_TYPE_MAX_EVENTS) return;
 	
-	event_subs = &list->subs[event][0];
+	mask = list->event_subs[event];
 	
-	for(i = 0; i < EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS; i ++) {
-		if(event_subs[i] == NULL) {
-			/* no more */
-			break;
-		} else {
-			callback(event_subs[i], arg);
-		}
+	while(mask != 0) {
+		int i = __ffs(mask);
+		
+		mask &= mask - 1; /* clear the lowest bit */
+		callback(list->subs[i], arg);
 	}
 }
 
@@ -171,21 +229,15 @@ int event_dispatch_list_dbg(struct event_dispatch_list *list,
 							char *buf, size_t count, void *subscriber)
 {
 	int ievent;
-	void **event_subs;
 	ssize_t n = 0;
-	int i;
+	int i = find_slot(list, subscriber);
 	
 	n += scnprintf(buf + n, count - n, "subs[");
 	
-	for(ievent = 0; ievent < EVENT_LIST_TYPE_MAX_EVENTS; ievent ++) {
-
-		event_subs = &list->subs[ievent][0];
-		
-		for(i = 0; i < EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS; i ++) {
-			if(event_subs[i] == NULL) break; /* no more */
-			if(event_subs[i] == subscriber) {
+	if(i >= 0) {
+		for(ievent = 0; ievent < EVENT_LIST_TYPE_MAX_EVENTS; ievent ++) {
+			if(list->event_subs[ievent] & (1U << i)) {
 				n += scnprintf(buf + n, count - n, "%d ", ievent);
-				break;
 			}
 		}
 	}
@@ -193,8 +245,3 @@ int event_dispatch_list_dbg(struct event_dispatch_list *list,
 	
 	return n;
 }
-
-
-
-
-
@@ -14,14 +14,14 @@
 
 /* ----------------------- event list type ------------------------ */
  
-/* Must be divisible by sizeof(unsigned long). */
+/* Must be divisible by BITS_PER_LONG. */
 #define EVENT_LIST_TYPE_MAX_EVENTS 512
 
 struct event_list_type {
 	/*
 	 * Up to EVENT_LIST_TYPE_MAX_EVENTS event codes can be subscribed to.
 	 */
-	unsigned long mask[EVENT_LIST_TYPE_MAX_EVENTS / sizeof(unsigned long)];
+	unsigned long mask[BITS_TO_LONGS(EVENT_LIST_TYPE_MAX_EVENTS)];
 };
 
 
@@ -40,6 +40,13 @@ void event_list_remove(
 int event_list_is_empty(
 		const struct event_list_type *event_list);
 
+/* 
+ * Sets the list from an array of 32-bit words, the event 'e' being the bit
+ * (e % 32) of the word (e / 32).
+ */
+void event_list_from_u32(
+		struct event_list_type *event_list, const u32 *words, int word_count);
+
 /* return a negative value if none found */
 int event_list_extract_one(
 		struct event_list_type *event_list);
@@ -50,12 +57,25 @@ int event_list_extract_one(
 /* ----------------------- event dispatch list ---------------------- */
  
 /* 
- * Should match MAX_VIRT_DEVS_PER_MNG_DEV.
+ * Should match MAX_VIRT_DEVS_PER_MNG_DEV. Must not exceed 32 (the width
+ * of the per event subscriber mask).
  */
 #define EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS 31
 
 struct event_dispatch_list {
-	void *subs[EVENT_LIST_TYPE_MAX_EVENTS][EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS];
+	/* 
+	 * Bit 'i' set in the event_subs[event] means the subs[i] is subscribed
+	 * to the 'event'.
+	 */
+	u32 event_subs[EVENT_LIST_TYPE_MAX_EVENTS];
+	
+	/* The subscriber slots, NULL if free. */
+	void *subs[EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS];
+	/* The number of the events subscribed to per slot; 0 frees the slot. */
+	u16 subs_event_count[EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS];
+	
+	/* The union of all subscribed events, kept up to date incrementally. */
+	struct event_list_type all_events;
 };
 
 
@@ -78,6 +98,11 @@ void event_dispatch_list_remove_all(
 void event_dispatch_list_add_subscribed_events(
 		struct event_dispatch_list *list, struct event_list_type *all_events);
 
+/* Sets 'events' to the events the 'subscriber' is subscribed to. */
+void event_dispatch_list_subscriber_events(
+		struct event_dispatch_list *list, void *subscriber, 
+		struct event_list_type *events);
+
 void event_dispatch_list_for_all_subscribers(
 		struct event_dispatch_list *list, int event, 
 		event_dispatch_list_callback callback, void *arg);
@@ -120,12 +120,83 @@ static ssize_t show_map_ram_bits(struct modac_hw_support_data *hw_support_data,
  * FRAC_DIV=\<0xNNNNNNNN\>
  * MapRam[0],bit=127:\<LIST_OF_ADDRESSES_WITH_1\>
  * MapRam[1],bit=127:\<LIST_OF_ADDRESSES_WITH_1\>
+ * MapRamFlush: count=\<N\> mmio_writes=\<N\>
+ * ShadowRegs: hits=\<N\> misses=\<N\> drifts=\<N\>
+ * FifoDrain: until_code0=\<N\> irqs=\<N\> events=\<N\> mmio_reads=\<N\> last_events=\<N\> last_reads=\<N\> max_events=\<N\>
+ * DataBufRead: block=\<N\> count=\<N\> words=\<N\> ns_total=\<N\> ns_last=\<N\> ns_max=\<N\>
  * </pre>
  * 
+ * A MapRam flush only writes the entries that the inactive bank is missing.
+ * Rewriting the whole bank every time would take 1025 MMIO writes per flush.
+ * 
+ * The ShadowRegs counts the register reads served from the driver's shadow
+ * (see the shadow_regs module parameter) and the ones that went to the HW.
+ * The drifts are the shadow mismatches found with shadow_regs=2. The 
+ * register fields above are read through the shadow, too.
+ * 
+ * The FifoDrain counts the MMIO reads the ISR needed to drain the event FIFO
+ * (see the fifo_drain module parameter). The mmio_reads include the IRQFLAG
+ * read at the start of each IRQ.
+ * 
+ * The DataBufRead tells how long the ISR spent copying the DataBuf messages
+ * (without the checksum errors), counted only while the dbuf_read_timing 
+ * module parameter is set. The copy is done with one block read if
+ * the dbuf_block_read module parameter is set; the parameter can be changed
+ * at runtime to compare both ways on the same HW.
+ * 
  * ### Writing
  * 
- * Writing to this device is supported only for the simulation and can
- * generate virtual event interrupts.
+ * Writing "shadow_resync" drops the register shadow; the registers
+ * are read from the HW (or the simulation) again.
+ * 
+ * Otherwise, writing to this device is supported only for the simulation
+ * and can generate virtual event interrupts.
+ * 
+ * The simulation models the EVR registers the driver uses (CTRL, IRQFLAG
+ * with write 1 to clear, IRQEN, both MapRam banks, the event FIFO, the 
+ * DataBuf, the pulsegens and the output maps), so the driver runs the same
+ * code as with the HW. It also has an event generator that drives the whole
+ * ISR path from a timer (in the hard IRQ context, the same as a real EVR):
+ * 
+ * <pre>
+ * gen add \<CODE\> \<RATE_HZ\> [\<BURST\> [\<DBUF_BYTES\>]]
+ * gen jitter \<NS\>
+ * gen csum_err \<N\>
+ * gen start
+ * gen stop
+ * gen clear
+ * </pre>
+ * 
+ * Each 'add' defines a stream (up to 8): BURST events with the CODE each 
+ * 1/RATE_HZ s, each burst followed by a DataBuf of DBUF_BYTES if not 0.
+ * The CODE 0 means the DataBuf only. The jitter (+/- NS) applies to each 
+ * period. Every N-th DataBuf gets the checksum error if 'csum_err' is not 0.
+ * The streams can be changed only while the generator is stopped.
+ * 
+ * As with the HW, an event gets to the FIFO only if the active MapRam bank
+ * saves it (a VEVR subscribed to it) and a DataBuf is received only while
+ * the DataBuf is armed; the rest is counted as unmapped and dbuf_drops.
+ * The interrupt is raised only for the IRQFLAG bits enabled in the IRQEN.
+ * For example, 360 Hz fiducials with a DataBuf plus a beam code:
+ * 
+ * <pre>
+ * gen add 1 360 1 64
+ * gen add 140 120
+ * gen start
+ * </pre>
+ * 
+ * For the simulation, reading prints the generator state first:
+ * 
+ * <pre>
+ * Generator: running=\<N\> jitter_ns=\<N\> csum_err=\<N\> ticks=\<N\> events=\<N\> unmapped=\<N\> fifo_drops=\<N\> dbufs=\<N\> dbuf_drops=\<N\>
+ * Stream[\<I\>]: code=\<N\> period_ns=\<N\> burst=\<N\> dbuf_bytes=\<N\>
+ * Mmio: reads=\<N\> writes=\<N\> isr_calls=\<N\> isr_last_reads=\<N\> isr_last_writes=\<N\> isr_max_reads=\<N\> isr_max_writes=\<N\>
+ * </pre>
+ * 
+ * The Mmio counts all the register accesses of the driver and the ones in
+ * the ISR called by the generator. The difference of the totals before and
+ * after an ioctl gives the accesses of that ioctl (the counters are read 
+ * before the rest of this output is). 'gen clear' zeroes them.
  * 
  * 
  * @}
@@ -139,8 +210,9 @@ ssize_t hw_support_evr_show_dbg(struct modac_hw_support_data *hw_support_data,
 	ssize_t n = 0;
 	u32 rval;
 
+	// first, so that its MMIO counters do not include the reads below
 	if(hw_data->sim != NULL) {
-		return n;
+		n += evr_sim_show_dbg(hw_data, buf + n, count - n);
 	}
 	
 	rval = evr_read32(hw_support_data, EVR_REG_CTRL);
@@ -199,6 +271,28 @@ ssize_t hw_support_evr_show_dbg(struct modac_hw_support_data *hw_support_data,
 	n += show_map_ram_bits(hw_support_data, buf + n, count - n, 0, EVR_REG_MAPRAM_EVENT_BIT_SAVE_EVENT_IN_FIFO);
 	n += show_map_ram_bits(hw_support_data, buf + n, count - n, 1, EVR_REG_MAPRAM_EVENT_BIT_SAVE_EVENT_IN_FIFO);
 	
+	n += scnprintf(buf + n, count - n, "MapRamFlush: count=%u mmio_writes=%u\n", 
+				  hw_data->map_ram_flushes, hw_data->map_ram_writes);
+	
+	n += scnprintf(buf + n, count - n, "ShadowRegs: hits=%u misses=%u drifts=%u\n", 
+				  hw_data->shadow.hits, hw_data->shadow.misses,
+				  hw_data->shadow.drifts);
+	
+	n += scnprintf(buf + n, count - n, "FifoDrain: until_code0=%d irqs=%u events=%llu "
+				  "mmio_reads=%llu last_events=%u last_reads=%u max_events=%u\n",
+				  evr_fifo_drain_until_code0(hw_data), hw_data->fifo_irqs,
+				  (unsigned long long)hw_data->fifo_events,
+				  (unsigned long long)hw_data->fifo_reads,
+				  hw_data->fifo_last_events, hw_data->fifo_last_reads,
+				  hw_data->fifo_max_events);
+	
+	n += scnprintf(buf + n, count - n, "DataBufRead: block=%d count=%u words=%llu "
+				  "ns_total=%llu ns_last=%u ns_max=%u\n",
+				  evr_dbuf_block_read(hw_support_data), hw_data->dbuf_reads,
+				  (unsigned long long)hw_data->dbuf_read_words,
+				  (unsigned long long)hw_data->dbuf_read_ns_total,
+				  hw_data->dbuf_read_ns_last, hw_data->dbuf_read_ns_max);
+	
 	return n;
 }
 
@@ -207,6 +301,11 @@ ssize_t hw_support_evr_store_dbg(struct modac_hw_support_data *hw_support_data,
 {
 	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
 	
+	if(count >= 13 && strncmp(buf, "shadow_resync", 13) == 0) {
+		evr_shadow_invalidate_all(hw_data);
+		return count;
+	}
+	
 	if(hw_data->sim != NULL) {
 		return evr_sim_dbg(hw_data, buf, count);
 	}
@@ -259,12 +358,6 @@ ssize_t hw_support_evr_dbg_res(struct modac_hw_support_data *hw_support_data,
 
 	ssize_t n = 0;
 	
-	if(hw_data->sim != NULL) {
-		return evr_sim_dbg_res(hw_data, buf, count, res_type, res_index);
-	}
-	
-	// the real EVR, not the simulation
-	
 	if(res_type == EVR_RES_TYPE_PULSEGEN) {
 		if(res_index < 0 || res_index >= hw_data->evr_type_data.pulsegen_count) {
 			n += scnprintf(buf + n, count - n, "invalid");
@@ -377,15 +470,9 @@ ssize_t hw_support_evr_dbg_regs(struct modac_hw_support_data *hw_support_data,
 						u32 regs_offset, u32 regs_length,
 						char *buf, size_t count)
 {
-	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
-
 	ssize_t n = 0;
 	
-	if(hw_data->sim != NULL) {
-		n += scnprintf(buf + n, count - n, "no_regs");
-	} else {
-		n += print_regs(hw_support_data, buf + n, count - n, regs_offset, regs_length);
-	}
+	n += print_regs(hw_support_data, buf + n, count - n, regs_offset, regs_length);
 	
 	return n;
 }
@@ -397,23 +484,19 @@ ssize_t hw_support_evr_dbg_info(struct modac_hw_support_data *hw_support_data,
 
 	ssize_t n = 0;
 	
-	if(hw_data->sim != NULL) {
-		n += scnprintf(buf + n, count - n, "simulation");
-	} else {
-		n += scnprintf(buf + n, count - n, "%s", hw_data->evr_type_data.name);
-		n += scnprintf(buf + n, count - n, ", fw_ver=0x%08X", evr_read32(hw_support_data, EVR_REG_FW_VERSION));
-/*		if(evr_card_is_slac(hw_data->fw_version)) {
-			n += scnprintf(buf + n, count - n, ", SLAC fw_ver=0x%08X", 
-			               swab32(evr_read32(hw_support_data, EVR_REG_FW_VERSION_SLAC)));
-		} */
-		n += scnprintf(buf + n, count - n, ", hw_support_hint1=%d", hw_support_data->mngdev_des->hw_support_hint1);
-		if(evr_card_is_slac(hw_data->fw_version)) {
-			n += scnprintf(buf + n, count - n, ", temperature_reg=0x%03x",
-			               swab32(evr_read32(hw_support_data, AXIXADC_REG_TEMPERATURE)) >> 4 & 0xfff);
-
-			n += scnprintf(buf + n, count - n, ", max_temperature_reg=0x%03x",
-			               swab32(evr_read32(hw_support_data, AXIXADC_REG_MAXTEMPERATURE)) >> 4 & 0xfff);
-		}
+	n += scnprintf(buf + n, count - n, "%s", hw_data->evr_type_data.name);
+	n += scnprintf(buf + n, count - n, ", fw_ver=0x%08X", evr_read32(hw_support_data, EVR_REG_FW_VERSION));
+/*	if(evr_card_is_slac(hw_data->fw_version)) {
+		n += scnprintf(buf + n, count - n, ", SLAC fw_ver=0x%08X", 
+		               swab32(evr_read32(hw_support_data, EVR_REG_FW_VERSION_SLAC)));
+	} */
+	n += scnprintf(buf + n, count - n, ", hw_support_hint1=%d", hw_support_data->mngdev_des->hw_support_hint1);
+	if(evr_card_is_slac(hw_data->fw_version)) {
+		n += scnprintf(buf + n, count - n, ", temperature_reg=0x%03x",
+		               swab32(evr_read32(hw_support_data, AXIXADC_REG_TEMPERATURE)) >> 4 & 0xfff);
+
+		n += scnprintf(buf + n, count - n, ", max_temperature_reg=0x%03x",
+		               swab32(evr_read32(hw_support_data, AXIXADC_REG_MAXTEMPERATURE)) >> 4 & 0xfff);
 	}
 	return n;
 }
@@ -11,6 +11,7 @@
 #define EVRMA_INTERNAL_H_
 
 #include <linux/irqreturn.h>
+#include <linux/spinlock.h>
 
 #include "internal.h"
 
@@ -25,6 +26,14 @@
 
 #define OUTPUT_REG_MAPPING_FORCE_LOW 63
 
+/*
+ * The CTRL bits that trigger an action and always read back as 0.
+ */
+#define EVR_CTRL_STROBE_BITS ((1 << C_EVR_CTRL_RESET_EVENTFIFO) | \
+			(1 << C_EVR_CTRL_LATCH_TIMESTAMP) | \
+			(1 << C_EVR_CTRL_RESET_TIMESTAMP) | \
+			(1 << C_EVR_CTRL_SRST))
+
 struct evr_pulsegen_bit_info {
 	int prescaler_bits;
 	int delay_bits;
@@ -82,15 +91,78 @@ struct evr_hw_data_out_cfg {
 	u32 evr_map_reg_start;
 };
 
+#define EVR_DBUF_RING_MAX_SLOTS 64
+
+/*
+ * The shadow of the IRQEN, FW_VERSION, the pulse generators and the output
+ * mappings. The evrManager can write them through the MNG_DEV mmap, so the
+ * shadow is off by default (see shadow_regs and evr_read32).
+ */
+#define EVR_SHADOW32_WORDS ((EVR_REG_PULSES + \
+			EVR_MAX_PULSEGEN_COUNT * EVR_REG_PULSE_SLOT_SIZE) / 4)
+#define EVR_SHADOW16_FIRST EVR_REG_FIRST_OUTPUT_FP_TTL
+#define EVR_SHADOW16_COUNT 128
+
+struct evr_shadow_regs {
+	u32 val32[EVR_SHADOW32_WORDS];
+	u16 val16[EVR_SHADOW16_COUNT];
+	DECLARE_BITMAP(valid32, EVR_SHADOW32_WORDS);
+	DECLARE_BITMAP(valid16, EVR_SHADOW16_COUNT);
+	
+	// reads served from the shadow, reads that went to the HW
+	u32 hits;
+	u32 misses;
+	// mismatches found in the verify mode
+	u32 drifts;
+};
+
+/*
+ * The VEVR configuration staged between the VEVR_IOC_CONFIG_BEGIN and
+ * VEVR_IOC_CONFIG_COMMIT. Only the pulsegens that the owner changed are
+ * staged; the bitmasks tell which ones.
+ */
+struct evr_config_txn {
+	
+	// the VIRT_DEV that opened the transaction
+	struct modac_vdev_des *owner;
+	
+	u32 param_staged;
+	u32 pctrl_staged;
+	u32 map_staged;
+	
+	struct {
+		u32 prescaler;
+		u32 delay;
+		u32 width;
+		u32 pctrl;
+	} pulsegen[EVR_MAX_PULSEGEN_COUNT];
+	
+	// the EVR_PULSE_CFG_BIT_... bits for each pulsegen and event code
+	u8 map[EVR_MAX_PULSEGEN_COUNT][EVR_MAPRAM_EVENT_CODES];
+};
+
 struct evr_hw_data {
 	
-	u8 mmap_mem[sizeof(struct vevr_mmap_data) + PAGE_SIZE];
+	// the page aligned struct vevr_mmap_data followed by the DataBuf ring
 	u8 *mmap_p;
 	// after aligning to PAGE_SIZE we may obtain a larger memory than
 	// actually needed. We have to keep this because from mmap command we
 	// may also obtain a request for bigger memory.
 	int mmap_p_final_size;
 	
+	int dbuf_ring_slot_count;
+	u32 dbuf_ring_sequence;
+	
+	/*
+	 * For the evr_time_ns of struct evr_data_fifo_event_ext: the last 
+	 * FIFO seconds and timestamp, the number of timestamp wraps within
+	 * these seconds and the USEC_DIV (re-read when the seconds change).
+	 */
+	u32 ts_last_seconds;
+	u32 ts_last_timestamp;
+	u32 ts_wraps;
+	u32 usec_div;
+	
 	struct modac_hw_support_data *hw_support_data;
 	
 	// a (possibly modified) copy of one of the documented_evr_type_data_table
@@ -106,10 +178,59 @@ struct evr_hw_data {
 	// MapRam itself, but there were some problems with copy from one to
 	// the other MapRam bank.
 	struct evr_map_ram_item_struct map_ram[EVR_MAPRAM_EVENT_CODES];
+	/*
+	 * The map_ram entries that are not yet written to the HW MapRam bank
+	 * 0 (EVR_REG_MAPRAM1) and 1 (EVR_REG_MAPRAM2). The banks alternate, so
+	 * each of them gets only the entries it is missing on a flush.
+	 */
+	DECLARE_BITMAP(map_ram_dirty[2], EVR_MAPRAM_EVENT_CODES);
+	/* the number of flushes and the MMIO writes they did */
+	u32 map_ram_flushes;
+	u32 map_ram_writes;
+	
+	struct evr_shadow_regs shadow;
+	
+	/*
+	 * Serializes the read-modify-write of the EVR_REG_CTRL between the IRQ
+	 * handler and the rest, see evr_ctrl_modify.
+	 */
+	spinlock_t ctrl_lock;
+	
+	/*
+	 * The event FIFO drain statistics: the IRQs with the EVENT flag, the 
+	 * events drained and the MMIO reads done for them (in total, in the last 
+	 * IRQ, the max. events in one IRQ).
+	 */
+	u32 fifo_irqs;
+	u64 fifo_events;
+	u64 fifo_reads;
+	u32 fifo_last_events;
+	u32 fifo_last_reads;
+	u32 fifo_max_events;
+	
+	/* the DataBuf copy statistics: copies, words, the time they took */
+	u32 dbuf_reads;
+	u64 dbuf_read_words;
+	u64 dbuf_read_ns_total;
+	u32 dbuf_read_ns_last;
+	u32 dbuf_read_ns_max;
+	
+	// the open configuration transaction, NULL if none
+	struct evr_config_txn *txn;
 	
 	void *sim;
 };
 
+/* 
+ * Must be called after the map_ram entry of the 'event' was changed, 
+ * before the evr_ram_map_change_flush.
+ */
+static inline void evr_map_ram_dirty(struct evr_hw_data *hw_data, int event)
+{
+	__set_bit(event, hw_data->map_ram_dirty[0]);
+	__set_bit(event, hw_data->map_ram_dirty[1]);
+}
+
 ssize_t hw_support_evr_store_dbg(struct modac_hw_support_data *hw_support_data, 
 						const char *buf, size_t count);
 ssize_t hw_support_evr_show_dbg(struct modac_hw_support_data *hw_support_data, 
@@ -122,6 +243,8 @@ ssize_t hw_support_evr_dbg_regs(struct modac_hw_support_data *hw_support_data,
 						char *buf, size_t count);
 ssize_t hw_support_evr_dbg_info(struct modac_hw_support_data *hw_support_data, 
 						char *buf, size_t count);
+int evr_fifo_drain_until_code0(struct evr_hw_data *hw_data);
+int evr_dbuf_block_read(struct modac_hw_support_data *hw_support_data);
 irqreturn_t hw_support_evr_isr(struct modac_hw_support_data *hw_support_data, 
 							   void *data);
 int hw_support_evr_on_subscribe_change(struct modac_hw_support_data *hw_support_data,
@@ -133,10 +256,15 @@ void evr_ram_map_change_flush(
 int internal_evr_get_out_map(struct modac_hw_support_data *hw_support_data, 
 						int res_output_index);
 
+void evr_shadow_invalidate(struct evr_hw_data *hw_data, int reg);
+void evr_shadow_invalidate_all(struct evr_hw_data *hw_data);
+
 u16 evr_read16(struct modac_hw_support_data *hw_support_data, int reg);
 void evr_write16(struct modac_hw_support_data *hw_support_data, int reg, u16 val);
 u32 evr_read32(struct modac_hw_support_data *hw_support_data, int reg);
 void evr_write32(struct modac_hw_support_data *hw_support_data, int reg, u32 val);
+u32 evr_ctrl_modify(struct modac_hw_support_data *hw_support_data, 
+		u32 clear, u32 set);
 
 
 #endif /* EVRMA_INTERNAL_H_ */
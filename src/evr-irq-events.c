@@ -17,6 +17,8 @@
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 #include <linux/pci.h>
 
@@ -25,36 +27,175 @@
 #include "evr-sim.h"
 #include "linux-evrma.h"
 
-#ifdef DBG_MEASURE_TIME_FROM_IRQ_TO_USER
+static int fifo_drain = -1;
+module_param(fifo_drain, int, 0644);
+MODULE_PARM_DESC(fifo_drain, "How the ISR knows the event FIFO is empty "
+		"(-1 = auto: 1 for MRF, 0 for SLAC firmware; "
+		"0 = IRQFLAG read after each event; 1 = event code 0 read).");
+
+/*
+ * The event code 0 is never stored in the FIFO; it is what the FIFO_EVENT
+ * reads when the FIFO is empty. Stopping on it saves the IRQFLAG read
+ * after each event (4 -> 3 MMIO reads per event).
+ */
+int evr_fifo_drain_until_code0(struct evr_hw_data *hw_data)
+{
+	if(fifo_drain >= 0) {
+		return fifo_drain;
+	}
+	
+	// not verified on the SLAC firmware, keep the IRQFLAG polling there
+	return !evr_card_is_slac(hw_data->fw_version);
+}
+
+static int dbuf_block_read = 1;
+module_param(dbuf_block_read, int, 0644);
+MODULE_PARM_DESC(dbuf_block_read, "Copy the DataBuf with one block read "
+		"instead of a register read per word (1 = yes, 0 = no).");
 
-u32 dbg_get_time(struct modac_hw_support_data *hw_support_data)
+/* Tells if the DataBuf is copied with one block read. */
+int evr_dbuf_block_read(struct modac_hw_support_data *hw_support_data)
 {
-	u32 val;
+	return dbuf_block_read && 
+			hw_support_data->mngdev_des->io_rw->read_block_u32 != NULL;
+}
+
+static int dbuf_read_timing = 0;
+module_param(dbuf_read_timing, int, 0644);
+MODULE_PARM_DESC(dbuf_read_timing, "Measure how long the ISR copies the "
+		"DataBuf, see the DataBufRead in the dbg attribute (1 = yes, 0 = no).");
+
+/* Reads the received DataBuf message into the 'slot'. */
+static void evr_dbuf_read(struct modac_hw_support_data *hw_support_data,
+						  struct evr_data_buff_slot_data *slot, u32 databuf_sts)
+{
+	struct modac_mngdev_des *devdes = hw_support_data->mngdev_des;
+	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
+	
+	if(!(databuf_sts & (1<<C_EVR_DATABUF_CHECKSUM))) {
+		/* If no checksum error, grab the buffer too. */
+		u32 *dd   = slot->data;
+		int i;
+		/* the clock is not read on this path unless measuring */
+		int timing = READ_ONCE(dbuf_read_timing);
+		u64 t0 = timing ? ktime_to_ns(ktime_get()) : 0;
+		u32 dt;
+		
+		// the number of u32, hence >> 2
+		slot->size32 = ((databuf_sts >> C_EVR_DATABUF_RXSIZE) & C_EVR_DATABUF_RXSIZE_MASK) >> 2;
+
+		if(evr_dbuf_block_read(hw_support_data)) {
+			
+			devdes->io_rw->read_block_u32(devdes, EVR_REG_DATA_BUF, 
+										  dd, slot->size32);
+			
+			// the endianness fix of evr_read32, in one pass
+			for (i = 0;  i < slot->size32;  i++) {
+				be32_to_cpus(&dd[i]);
+			}
+			
+		} else {
+			for (i = 0;  i < slot->size32;  i++) {
+				dd[i] = evr_read32(hw_support_data, EVR_REG_DATA_BUF + (i << 2));
+			}
+		}
+
+		if(timing) {
+			dt = (u32)(ktime_to_ns(ktime_get()) - t0);
+			hw_data->dbuf_reads ++;
+			hw_data->dbuf_read_words += slot->size32;
+			hw_data->dbuf_read_ns_total += dt;
+			hw_data->dbuf_read_ns_last = dt;
+			if(dt > hw_data->dbuf_read_ns_max) {
+				hw_data->dbuf_read_ns_max = dt;
+			}
+		}
+
+		slot->status = databuf_sts;
+		
+	} else {
+		slot->size32 = 0;
+		slot->status = databuf_sts;
+	}
+}
+
+/* 
+ * Reads the received DataBuf message into the next DataBuf ring slot. The
+ * single 'data_buff' slot is not written in this mode; the message is read
+ * from the HW once, straight into its final place.
+ */
+static void evr_dbuf_read_to_ring(struct modac_hw_support_data *hw_support_data,
+						  struct vevr_mmap_data *mmap_data, u32 databuf_sts,
+						  struct evr_data_dbuf_event *dbuf_event)
+{
+	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
+	struct evr_data_buff_ring_slot *ring_slot;
+	u32 seq;
+	
+	seq = hw_data->dbuf_ring_sequence + 1;
+	if(seq == 0) {
+		/* 0 means 'never written' */
+		seq = 1;
+	}
+	
+	dbuf_event->slot = seq % hw_data->dbuf_ring_slot_count;
+	dbuf_event->sequence = seq;
+	
+	ring_slot = &mmap_data->dbuf_ring[dbuf_event->slot];
 	
-	val = evr_read32(hw_support_data, EVR_REG_CTRL);
-	val |= (1 << C_EVR_CTRL_LATCH_TIMESTAMP);
-	evr_write32(hw_support_data, EVR_REG_CTRL, val);
+	WRITE_ONCE(ring_slot->seq_begin, seq);
+	smp_wmb();
 	
-	return evr_read32(hw_support_data, EVR_REG_TIMESTAMP_LATCH);
+	evr_dbuf_read(hw_support_data, &ring_slot->data, databuf_sts);
+	
+	smp_wmb();
+	WRITE_ONCE(ring_slot->seq_end, seq);
+	
+	hw_data->dbuf_ring_sequence = seq;
+	WRITE_ONCE(mmap_data->dbuf_ring_sequence, seq);
 }
 
-#endif
+/*
+ * Converts the FIFO seconds and timestamp to ns, see the evr_time_ns of
+ * struct evr_data_fifo_event_ext.
+ */
+static u64 evr_fifo_time_ns(struct modac_hw_support_data *hw_support_data,
+		u32 seconds, u32 timestamp)
+{
+	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
+	u64 ticks;
+	
+	if(seconds != hw_data->ts_last_seconds) {
+		hw_data->ts_last_seconds = seconds;
+		hw_data->ts_wraps = 0;
+		/* The event clock may be reconfigured. Read once per second only. */
+		hw_data->usec_div = evr_read32(hw_support_data, EVR_REG_USEC_DIV);
+	} else if(timestamp < hw_data->ts_last_timestamp) {
+		hw_data->ts_wraps ++;
+	}
+	hw_data->ts_last_timestamp = timestamp;
+	
+	if(hw_data->usec_div == 0)
+		return 0;
+	
+	ticks = ((u64)hw_data->ts_wraps << 32) | timestamp;
+	
+	return (u64)seconds * NSEC_PER_SEC + 
+			div_u64(ticks * NSEC_PER_USEC, hw_data->usec_div);
+}
 
 irqreturn_t hw_support_evr_isr(struct modac_hw_support_data *hw_support_data, void *data)
 {
 	struct modac_mngdev_des *devdes = hw_support_data->mngdev_des;
 	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
 	
-#ifdef DBG_MEASURE_TIME_FROM_IRQ_TO_USER
-	u32 arrival_time = dbg_get_time(hw_support_data);
-#endif
-			
 	/*
 	At this point we examine and process the registers and create events.
 	The events are dispatched by calling modac_mngdev_notify/modac_device_put_event.
 	*/
 	
 	u32 irq_flags;
+	u64 irq_ktime_ns = ktime_to_ns(ktime_get());
 	
 	irq_flags = evr_read32(hw_support_data, EVR_REG_IRQFLAG);
 	
@@ -82,28 +223,14 @@ irqreturn_t hw_support_evr_isr(struct modac_hw_support_data *hw_support_data, vo
 		
 		int databuf_sts = evr_read32(hw_support_data, EVR_REG_DATA_BUF_CTRL);
 		
-		struct evr_data_buff_slot_data *slot;
+		struct evr_data_dbuf_event dbuf_event;
 		
-		// one slot only is used
-		slot = &mmap_data->data_buff;
-
-		if(!(databuf_sts & (1<<C_EVR_DATABUF_CHECKSUM))) {
-			/* If no checksum error, grab the buffer too. */
-			u32 *dd   = slot->data;
-			int i;
-			
-			// the number of u32, hence >> 2
-			slot->size32 = ((databuf_sts >> C_EVR_DATABUF_RXSIZE) & C_EVR_DATABUF_RXSIZE_MASK) >> 2;
-
-			for (i = 0;  i < slot->size32;  i++) {
-				dd[i] = evr_read32(hw_support_data, EVR_REG_DATA_BUF + (i << 2));
-			}
-
-			slot->status = databuf_sts;
-			
+		if(hw_data->dbuf_ring_slot_count > 0) {
+			evr_dbuf_read_to_ring(hw_support_data, mmap_data, databuf_sts, 
+								  &dbuf_event);
 		} else {
-			slot->size32 = 0;
-			slot->status = databuf_sts;
+			// one slot only is used
+			evr_dbuf_read(hw_support_data, &mmap_data->data_buff, databuf_sts);
 		}
 		
 		{
@@ -113,24 +240,16 @@ irqreturn_t hw_support_evr_isr(struct modac_hw_support_data *hw_support_data, vo
 									dbctl | (1 << C_EVR_DATABUF_LOAD));
 		}
 		
-#ifdef DBG_MEASURE_TIME_FROM_IRQ_TO_USER
-		{
-			struct evr_data_fifo_event et_data;
-			
-			et_data.seconds = 0;
-			// store the time spent in the DataBuff
-			et_data.timestamp = dbg_get_time(hw_support_data) - arrival_time; // + 5000 * 119;
-			et_data.dbg_timestamp[0] = arrival_time;
-			
-			modac_mngdev_put_event(devdes, EVRMA_EVENT_DBUF_DATA, &et_data, sizeof(et_data));
+		if(hw_data->dbuf_ring_slot_count > 0) {
+			modac_mngdev_put_event(devdes, EVRMA_EVENT_DBUF_DATA, 
+								   &dbuf_event, sizeof(dbuf_event));
+		} else {
+			/* DataBuf event, despite having no data attached,
+			 * is sent to the queue instead of being a notifying
+			 * event. That is to preserve the order of arrival.
+			 */
+			modac_mngdev_put_event(devdes, EVRMA_EVENT_DBUF_DATA, NULL, 0);
 		}
-#else
-		/* DataBuf event, despite having no data attached,
-		 * is sent to the queue instead of being a notifying
-		 * event. That is to preserve the order of arrival.
-		 */
-		modac_mngdev_put_event(devdes, EVRMA_EVENT_DBUF_DATA, NULL, 0);
-#endif
 
 		evr_write32(hw_support_data, EVR_REG_IRQFLAG, EVR_IRQFLAG_DATABUF);
 		evr_write32(hw_support_data, EVR_REG_IRQFLAG, 0); 
@@ -140,24 +259,46 @@ irqreturn_t hw_support_evr_isr(struct modac_hw_support_data *hw_support_data, vo
 	if(irq_flags & EVR_IRQFLAG_EVENT) {
 		
 		int ilim = EVR_FIFO_EVENT_LIMIT;
+		int until_code0 = evr_fifo_drain_until_code0(hw_data);
+		u32 events = 0;
+		// including the IRQFLAG read above
+		u32 reads = 1;
 		
 		while(ilim --) {
 			
 			u32 stat;
-
-			struct evr_data_fifo_event et_data;
+			/* 
+			 * The VIRT_DEVs with the regular entries get only the 
+			 * struct evr_data_fifo_event at its beginning.
+			 */
+			struct evr_data_fifo_event_ext et_data;
 
 			int event = evr_read32(hw_support_data, EVR_REG_FIFO_EVENT) & 0xFF;
+			reads ++;
+			
+			if(until_code0 && event == 0) {
+				// the FIFO is empty
+				break;
+			}
+			
 			et_data.seconds = evr_read32(hw_support_data, EVR_REG_FIFO_SECONDS);
 			et_data.timestamp = evr_read32(hw_support_data, EVR_REG_FIFO_TIMESTAMP);
+			reads += 2;
 
-#ifdef DBG_MEASURE_TIME_FROM_IRQ_TO_USER
-			et_data.dbg_timestamp[0] = arrival_time;
-#endif
+			et_data.evr_time_ns = evr_fifo_time_ns(hw_support_data, 
+					et_data.seconds, et_data.timestamp);
+			et_data.irq_ktime_ns = irq_ktime_ns;
 
-			modac_mngdev_put_event(devdes, event, &et_data, sizeof(et_data));
+			modac_mngdev_put_event_ext(devdes, event, &et_data, 
+					sizeof(struct evr_data_fifo_event), sizeof(et_data));
+			events ++;
+			
+			if(until_code0) {
+				continue;
+			}
 			
 			stat = evr_read32(hw_support_data, EVR_REG_IRQFLAG);
+			reads ++;
 			
 			if(!(stat & EVR_IRQFLAG_EVENT)) break;
 		}
@@ -165,6 +306,15 @@ irqreturn_t hw_support_evr_isr(struct modac_hw_support_data *hw_support_data, vo
 		if(ilim < 1) {
 			printk(KERN_WARNING "EVR FIFO event max. read count reached.");
 		}
+		
+		hw_data->fifo_irqs ++;
+		hw_data->fifo_events += events;
+		hw_data->fifo_reads += reads;
+		hw_data->fifo_last_events = events;
+		hw_data->fifo_last_reads = reads;
+		if(events > hw_data->fifo_max_events) {
+			hw_data->fifo_max_events = events;
+		}
 
 		evr_write32(hw_support_data, EVR_REG_IRQFLAG, EVR_IRQFLAG_EVENT);
 	}
@@ -172,9 +322,7 @@ irqreturn_t hw_support_evr_isr(struct modac_hw_support_data *hw_support_data, vo
 	if(irq_flags & EVR_IRQFLAG_FIFOFULL) {
 		
 		// reset the FIFO and start from scratch
-		u32 ctrl = evr_read32(hw_support_data, EVR_REG_CTRL);
-		ctrl |= (1 << C_EVR_CTRL_RESET_EVENTFIFO);
-		evr_write32(hw_support_data, EVR_REG_CTRL, ctrl);
+		evr_ctrl_modify(hw_support_data, 0, 1 << C_EVR_CTRL_RESET_EVENTFIFO);
 
 		evr_write32(hw_support_data, EVR_REG_IRQFLAG, EVR_IRQFLAG_FIFOFULL);
 		
@@ -207,15 +355,13 @@ int hw_support_evr_on_subscribe_change(struct modac_hw_support_data *hw_support_
 	u32 irq_enable;
 	int interrupts_needed;
 
-	if(hw_data->sim != NULL) {
-		return 0;
-	}
-	
 	interrupts_needed = !event_list_is_empty(subscriptions);
 
 	// first inform the lower system level about enabled interrupts;
 	if(devdes->irq_set != NULL) {
 		devdes->irq_set(devdes, interrupts_needed);
+		// the lower level may have changed the IRQEN[PCIEE] by itself
+		evr_shadow_invalidate(hw_data, EVR_REG_IRQEN);
 	}
 	
 	irq_enable_prev = evr_read32(hw_support_data, EVR_REG_IRQEN);
@@ -238,8 +384,10 @@ int hw_support_evr_on_subscribe_change(struct modac_hw_support_data *hw_support_
 		for(ievent = EVRMA_FIFO_MIN_EVENT_CODE; ievent <= EVRMA_FIFO_MAX_EVENT_CODE; ievent ++) {
 			
 			u32 *func32;
+			u32 func32_old;
 					
 			func32 = &hw_data->map_ram[ievent].int_event;
+			func32_old = *func32;
 			
 			// only save subscribed Event FIFO events
 			evst = event_list_test(subscriptions, ievent);
@@ -250,6 +398,9 @@ int hw_support_evr_on_subscribe_change(struct modac_hw_support_data *hw_support_
 			} else {
 				*func32 &= (~mask_save_event_in_fifo);
 			}
+			
+			if(*func32 != func32_old)
+				evr_map_ram_dirty(hw_data, ievent);
 		}
 		
 		evr_ram_map_change_flush(hw_support_data);
@@ -16,7 +16,14 @@
 #include <linux/wait.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/version.h>
 
 #include "internal.h"
 #include "evr-sim.h"
@@ -25,254 +32,691 @@
 #define EVRSIM_PULSEGEN_COUNT 16
 #define EVRSIM_OUTPUT_COUNT 10 // this is debug only
 
-struct pulsegen_params {
-	u32 prescaler;
-	u32 delay;
-	u32 width;
+// the size of the simulated event FIFO, must be a power of 2
+#define EVRSIM_FIFO_SIZE 512
+#define EVRSIM_DBUF_WORDS 512
+// the simulated event clock is ~119 MHz
+#define EVRSIM_USEC_DIV 119
+// not a real form factor, so that no HW specific code is triggered
+#define EVRSIM_FW_VERSION 0xFE000001
+
+/* The simulated register space ends with the second MapRam bank. */
+#define EVRSIM_REGS_SIZE (EVR_REG_MAPRAM2 + \
+			EVR_MAPRAM_EVENT_CODES * EVR_REG_MAPRAM_SLOT_SIZE)
+
+#define EVRSIM_GEN_MAX_STREAMS 8
+#define EVRSIM_GEN_MIN_PERIOD_NS 1000
+// the max. periods of a stream generated at once when the timer is late
+#define EVRSIM_GEN_MAX_CATCHUP 64
+
+#define EVRSIM_PULSEGEN(PRESCALER_BITS) {PRESCALER_BITS, 32, 32}
+
+/*
+ * The simulated EVR as seen by the driver. The different prescaler lengths
+ * are there to test the allocation.
+ */
+const struct evr_type_data evr_sim_type_data = {
+	"simulation",
+	EVRSIM_PULSEGEN_COUNT,
+	{
+		EVRSIM_PULSEGEN(16), EVRSIM_PULSEGEN(16),
+		EVRSIM_PULSEGEN(32), EVRSIM_PULSEGEN(32),
+		EVRSIM_PULSEGEN(8), EVRSIM_PULSEGEN(8),
+		EVRSIM_PULSEGEN(8), EVRSIM_PULSEGEN(8),
+		EVRSIM_PULSEGEN(0), EVRSIM_PULSEGEN(0),
+		EVRSIM_PULSEGEN(0), EVRSIM_PULSEGEN(0),
+		EVRSIM_PULSEGEN(0), EVRSIM_PULSEGEN(0),
+		EVRSIM_PULSEGEN(0), EVRSIM_PULSEGEN(0),
+	},
+	0, EVRSIM_OUTPUT_COUNT, 0, 0, 0, 0, 0, 0, 0, 3, 32
+};
+
+struct sim_fifo_entry {
+	u32 code;
+	u32 seconds;
+	u32 timestamp;
+};
+
+/*
+ * One stream of the event generator: 'burst' events with the 'code' every
+ * 'period_ns' (+ the jitter), each burst with a DataBuf of 'dbuf_bytes' if
+ * not 0. The code 0 means the DataBuf only.
+ */
+struct sim_gen_stream {
+	u32 code;
+	u32 period_ns;
+	u32 burst;
+	u32 dbuf_bytes;
+	u64 next_ns;
 };
 
 struct hw_data {
 	
-	int pulsegen_prescaler_lengths[EVRSIM_PULSEGEN_COUNT];
-	struct pulsegen_params pulsegen_params[EVRSIM_PULSEGEN_COUNT];
-	int output_src[EVRSIM_OUTPUT_COUNT];
+	struct modac_mngdev_des *devdes;
+	
+	/*
+	 * The register file. The generator changes it in the timer, the driver
+	 * through the evr_sim_rw_plugin (the ISR included).
+	 */
+	spinlock_t lock;
+	
+	/*
+	 * The registers without a behaviour (MapRams, pulsegens, outputs, ...)
+	 * plus the DataBuf and the latches. Kept in the bus byte order so
+	 * that the 16 and 32 bit accesses see the same bytes.
+	 */
+	u32 regs[EVRSIM_REGS_SIZE / 4];
+	
+	struct sim_fifo_entry fifo[EVRSIM_FIFO_SIZE];
+	u32 fifo_head;
+	u32 fifo_tail;
+	// the IRQFLAG; the EVENT flag is not here, it is set while the FIFO is not empty
+	u32 irq_flags;
+	// the DataBuf receiver is armed by LOAD, a message disarms it
+	int dbuf_armed;
+	// DATA_BUF_CTRL without the RECEIVING bit
+	u32 dbuf_ctrl;
+	
+	// the MMIO accesses, in total and in the ISRs called by the generator
+	u64 mmio_reads;
+	u64 mmio_writes;
+	u32 isr_calls;
+	u32 isr_last_reads;
+	u32 isr_last_writes;
+	u32 isr_max_reads;
+	u32 isr_max_writes;
+	
+	// the event generator
+	struct hrtimer gen_timer;
+	int gen_running;
+	u32 gen_jitter_ns;
+	// every N-th DataBuf gets the checksum error, 0 = none
+	u32 gen_csum_err;
+	int gen_stream_count;
+	struct sim_gen_stream gen_streams[EVRSIM_GEN_MAX_STREAMS];
+	u32 gen_ticks;
+	u64 gen_events;
+	// events not saved in the FIFO by the MapRam
+	u64 gen_unmapped;
+	u32 gen_fifo_drops;
+	u32 gen_dbufs;
+	// DataBuf messages received while not armed
+	u32 gen_dbuf_drops;
 };
 
-static u32 modac_read_u32(struct modac_mngdev_des *devdes, u32 offset)
+static inline u32 reg_get(struct hw_data *hw_data, u32 offset)
 {
-	// a simple simulation of events arriving
-	
-	if(offset == EVR_REG_FIFO_SECONDS) {
-		static u32 secs = 10;
-		secs ++;
-		return secs;
-	} else if(offset == EVR_REG_FIFO_TIMESTAMP) {
-		static u32 ec = 300;
-		ec ++;
-		return ec;
-	} else if(offset == EVR_REG_FIFO_EVENT) {
-		return 1;
-	} else if(offset == EVR_REG_IRQFLAG) {
-		static u32 count = 0;
-		count ++;
-		return count % 4 != 0 ? EVR_IRQFLAG_EVENT : 0;
-	} else {
-		return 0;
-	}
+	return be32_to_cpu(hw_data->regs[offset >> 2]);
 }
 
-static void modac_write_u32(struct modac_mngdev_des *devdes, u32 offset, u32 value)
+static inline void reg_set(struct hw_data *hw_data, u32 offset, u32 value)
 {
+	hw_data->regs[offset >> 2] = cpu_to_be32(value);
 }
 
-static u16 modac_read_u16(struct modac_mngdev_des *devdes, u32 offset)
+static void sim_time(u64 now_ns, u32 *seconds, u32 *timestamp)
 {
-	return 0; // dummy
+	u32 rem_ns;
+	
+	*seconds = (u32)div_u64_rem(now_ns, NSEC_PER_SEC, &rem_ns);
+	*timestamp = (u32)div_u64((u64)rem_ns * EVRSIM_USEC_DIV, NSEC_PER_USEC);
 }
 
-static void modac_write_u16(struct modac_mngdev_des *devdes, u32 offset, u16 value)
+static void sim_latch_time(struct hw_data *hw_data, u32 seconds, u32 timestamp)
 {
+	reg_set(hw_data, EVR_REG_SECONDS_LATCH, seconds);
+	reg_set(hw_data, EVR_REG_TIMESTAMP_LATCH, timestamp);
 }
 
-struct modac_io_rw_plugin evr_sim_rw_plugin = {
-	write_u16: modac_write_u16,
-	read_u16: modac_read_u16,
-	write_u32: modac_write_u32,
-	read_u32: modac_read_u32,
-};
-
-
-static int pulsegen_suits(struct modac_rm_data *rm_data, int index, int *arg_filters)
+/*
+ * The pulsegen registers only keep as many bits as the pulsegen has.
+ * A 0-bit property still has 1 bit, the same as the driver assumes.
+ */
+static u32 sim_reg_mask(u32 offset)
 {
-	const struct modac_hw_support_data *hw_support_data = rm_data->hw_support_data;
-	struct evr_hw_data *evr_hw_data = (struct evr_hw_data *)hw_support_data->priv;
-	struct hw_data *hw_data = (struct hw_data *)evr_hw_data->sim;
+	const struct evr_pulsegen_bit_info *bit_info;
+	int bits;
+	u32 rel;
+	
+	if(offset < EVR_REG_PULSES ||
+			offset >= EVR_REG_PULSES + EVRSIM_PULSEGEN_COUNT * EVR_REG_PULSE_SLOT_SIZE) {
+		return ~0;
+	}
 	
-	// 'arg_filter' means the length of a prescaler in bits. Simply ignore
-	// the delay and width here.
-	int prescaler_length = arg_filters[0];
+	bit_info = &evr_sim_type_data.pulsegen_data[
+				(offset - EVR_REG_PULSES) / EVR_REG_PULSE_SLOT_SIZE];
+	rel = (offset - EVR_REG_PULSES) % EVR_REG_PULSE_SLOT_SIZE;
 	
-	if(index < 0 || index >= EVRSIM_PULSEGEN_COUNT) return 0;
+	if(rel == EVR_REG_PULSE_PRESC_OFFSET) {
+		bits = bit_info->prescaler_bits;
+	} else if(rel == EVR_REG_PULSE_DELAY_OFFSET) {
+		bits = bit_info->delay_bits;
+	} else if(rel == EVR_REG_PULSE_WIDTH_OFFSET) {
+		bits = bit_info->width_bits;
+	} else {
+		return ~0;
+	}
 	
-	// For too short prescaler resources return 0.
-	if(hw_data->pulsegen_prescaler_lengths[index] < prescaler_length) return 0;
+	if(bits == 0) {
+		return 1;
+	}
 	
-	// The shortest prescaler possible is wanted, so:
-	// - Return the largest number 33 for exact match.
-	// - For instance, in case of no prescaler pulsegen wanted but we only
-	// have the 32-bit one, the returned value will be the minimal 1.
-	return 32 + prescaler_length - hw_data->pulsegen_prescaler_lengths[index] + 1;
+	return bits >= 32 ? ~0 : (1U << bits) - 1;
 }
 
-static int output_suits(struct modac_rm_data *rm_data, int index, int *arg_filters)
+/* Must be called with the lock held. */
+static u32 sim_reg_read(struct hw_data *hw_data, u32 offset)
 {
-	// the outputs MUST be allocated by a fixed index so this will not be called
-	// anyway; if it is called we have to make sure nothing is actually
-	// allowed to be allocated.
-	// 'arg_filter' means nothing.
-	return 0;
+	switch(offset) {
+	case EVR_REG_STATUS:
+		return 1 << C_EVR_REG_STATUS_LINK;
+	case EVR_REG_IRQFLAG:
+		if(hw_data->fifo_tail != hw_data->fifo_head) {
+			return hw_data->irq_flags | EVR_IRQFLAG_EVENT;
+		}
+		return hw_data->irq_flags;
+	case EVR_REG_DATA_BUF_CTRL:
+		return hw_data->dbuf_ctrl | (hw_data->dbuf_armed << C_EVR_DATABUF_RECEIVING);
+	case EVR_REG_FIFO_EVENT:
+		if(hw_data->fifo_tail != hw_data->fifo_head) {
+			struct sim_fifo_entry *e =
+				&hw_data->fifo[hw_data->fifo_tail % EVRSIM_FIFO_SIZE];
+			// the FIFO_SECONDS and FIFO_TIMESTAMP are latched by this read
+			reg_set(hw_data, EVR_REG_FIFO_SECONDS, e->seconds);
+			reg_set(hw_data, EVR_REG_FIFO_TIMESTAMP, e->timestamp);
+			hw_data->fifo_tail ++;
+			return e->code;
+		}
+		// the code 0 means the FIFO is empty, the same as with the HW
+		return 0;
+	}
+	
+	return reg_get(hw_data, offset);
+}
+
+/* Must be called with the lock held. */
+static void sim_reg_write(struct hw_data *hw_data, u32 offset, u32 value)
+{
+	switch(offset) {
+	case EVR_REG_STATUS:
+	case EVR_REG_FW_VERSION:
+	case EVR_REG_USEC_DIV:
+	case EVR_REG_SECONDS_LATCH:
+	case EVR_REG_TIMESTAMP_LATCH:
+	case EVR_REG_FIFO_SECONDS:
+	case EVR_REG_FIFO_TIMESTAMP:
+	case EVR_REG_FIFO_EVENT:
+		// read only
+		return;
+	case EVR_REG_IRQFLAG:
+		// write 1 to clear
+		hw_data->irq_flags &= ~value;
+		return;
+	case EVR_REG_CTRL:
+		if(value & (1 << C_EVR_CTRL_RESET_EVENTFIFO)) {
+			hw_data->fifo_tail = hw_data->fifo_head;
+			hw_data->irq_flags &= ~EVR_IRQFLAG_FIFOFULL;
+		}
+		if(value & (1 << C_EVR_CTRL_LATCH_TIMESTAMP)) {
+			u32 seconds, timestamp;
+			
+			sim_time(ktime_to_ns(ktime_get()), &seconds, &timestamp);
+			sim_latch_time(hw_data, seconds, timestamp);
+		}
+		value &= ~EVR_CTRL_STROBE_BITS;
+		break;
+	case EVR_REG_DATA_BUF_CTRL:
+		/*
+		 * The ISR re-arms with the value read back, which has the RXREADY
+		 * where the STOP is, so the LOAD wins.
+		 */
+		if(value & (1 << C_EVR_DATABUF_LOAD)) {
+			hw_data->dbuf_armed = 1;
+			hw_data->dbuf_ctrl = 0;
+		} else if(value & (1 << C_EVR_DATABUF_STOP)) {
+			hw_data->dbuf_armed = 0;
+		}
+		hw_data->dbuf_ctrl &= ~(1 << C_EVR_DATABUF_MODE);
+		hw_data->dbuf_ctrl |= value & (1 << C_EVR_DATABUF_MODE);
+		return;
+	}
+	
+	if(offset >= EVR_REG_DATA_BUF &&
+			offset < EVR_REG_DATA_BUF + EVRSIM_DBUF_WORDS * 4) {
+		// read only
+		return;
+	}
+	
+	reg_set(hw_data, offset, value & sim_reg_mask(offset));
 }
 
 /*
- * This must match the enums in the EVR_RES_TYPE_...
+ * The values are big endian, as on the EVR bus; the evr_read32 swaps them.
  */
-struct modac_hw_res_def default_res_defs[EVR_RES_TYPE_COUNT] = {
-	{
-		.name = "pulsegen",
-		.count = EVRSIM_PULSEGEN_COUNT,
-		.flags = MODAC_RES_FLAG_EXCLUSIVE,
-		.suits = pulsegen_suits,
-	},
-	{
-		.name = "output",
-		.count = EVRSIM_OUTPUT_COUNT,
-		.flags = MODAC_RES_FLAG_EXCLUSIVE,
-		.suits = output_suits,
-	},
-};
-
-static void fill_hw_res_defs(struct evr_hw_data *evr_hw_data)
+static u32 modac_read_u32(struct modac_mngdev_des *devdes, u32 offset)
 {
-	struct modac_hw_support_data *hw_support_data = evr_hw_data->hw_support_data;
-	// use the default
-	memcpy(hw_support_data->hw_res_defs, default_res_defs, sizeof(default_res_defs));
+	struct hw_data *hw_data = (struct hw_data *)devdes->io_priv;
+	unsigned long flags;
+	u32 val = 0;
+	
+	if(hw_data == NULL) {
+		return 0;
+	}
+	
+	spin_lock_irqsave(&hw_data->lock, flags);
+	hw_data->mmio_reads ++;
+	if(offset < EVRSIM_REGS_SIZE && (offset & 3) == 0) {
+		val = sim_reg_read(hw_data, offset);
+	}
+	spin_unlock_irqrestore(&hw_data->lock, flags);
+	
+	return cpu_to_be32(val);
 }
 
-static void init_hw_data(struct evr_hw_data *evr_hw_data)
+static void modac_write_u32(struct modac_mngdev_des *devdes, u32 offset, u32 value)
 {
-	struct hw_data *hw_data = (struct hw_data *)evr_hw_data->sim;
+	struct hw_data *hw_data = (struct hw_data *)devdes->io_priv;
+	unsigned long flags;
 	
-	/* Note that these lengths are only used to test the allocation. They
-	 * will not be checked when setting the pulsegen's parameters.
-	 */
-	const int pulsegen_prescaler_lengths[EVRSIM_PULSEGEN_COUNT] = {
-		16, 16, 32, 32,
-		8, 8, 8, 8,
-		0, 0, 0, 0,
-		0, 0, 0, 0,
-	};
+	if(hw_data == NULL) {
+		return;
+	}
 	
-	int i;
-
-	memcpy(hw_data->pulsegen_prescaler_lengths,
-			pulsegen_prescaler_lengths, sizeof(pulsegen_prescaler_lengths));
-
-	// to test the validity in the sim
-	for(i = 0; i < sizeof(struct vevr_mmap_data); i ++) {
-		evr_hw_data->mmap_p[i] = (u8)(i & 0xFF);
+	spin_lock_irqsave(&hw_data->lock, flags);
+	hw_data->mmio_writes ++;
+	if(offset < EVRSIM_REGS_SIZE && (offset & 3) == 0) {
+		sim_reg_write(hw_data, offset, be32_to_cpu(value));
 	}
+	spin_unlock_irqrestore(&hw_data->lock, flags);
 }
 
-void evr_sim_irq_set(struct modac_mngdev_des *mngdev_des, int enabled)
+/* The 16 bit registers (the output maps) have no behaviour. */
+static u16 modac_read_u16(struct modac_mngdev_des *devdes, u32 offset)
 {
+	struct hw_data *hw_data = (struct hw_data *)devdes->io_priv;
+	unsigned long flags;
+	u16 val = 0;
+	
+	if(hw_data == NULL) {
+		return 0;
+	}
+	
+	spin_lock_irqsave(&hw_data->lock, flags);
+	hw_data->mmio_reads ++;
+	if(offset < EVRSIM_REGS_SIZE && (offset & 1) == 0) {
+		val = ((u16 *)hw_data->regs)[offset >> 1];
+	}
+	spin_unlock_irqrestore(&hw_data->lock, flags);
+	
+	return val;
 }
 
-int evr_sim_init(struct evr_hw_data *evr_hw_data)
+static void modac_write_u16(struct modac_mngdev_des *devdes, u32 offset, u16 value)
 {
-	struct hw_data *hw_data;
+	struct hw_data *hw_data = (struct hw_data *)devdes->io_priv;
+	unsigned long flags;
 	
-	hw_data = kzalloc(sizeof(struct hw_data), GFP_ATOMIC);
 	if(hw_data == NULL) {
-		return -ENOMEM;
+		return;
 	}
 	
-	evr_hw_data->sim = hw_data;
+	spin_lock_irqsave(&hw_data->lock, flags);
+	hw_data->mmio_writes ++;
+	if(offset < EVRSIM_REGS_SIZE && (offset & 1) == 0) {
+		((u16 *)hw_data->regs)[offset >> 1] = value;
+	}
+	spin_unlock_irqrestore(&hw_data->lock, flags);
+}
+
+/* Each word is one MMIO read, the same as with the PCIe block read. */
+static void modac_read_block_u32(struct modac_mngdev_des *devdes, u32 offset,
+								 u32 *dest, int count)
+{
+	struct hw_data *hw_data = (struct hw_data *)devdes->io_priv;
+	unsigned long flags;
+	int i;
 	
-	init_hw_data(evr_hw_data);
-	fill_hw_res_defs(evr_hw_data);
+	if(hw_data == NULL) {
+		return;
+	}
 	
-	return 0;
+	spin_lock_irqsave(&hw_data->lock, flags);
+	hw_data->mmio_reads += count;
+	for(i = 0; i < count; i ++) {
+		u32 reg = offset + (i << 2);
+		dest[i] = (reg < EVRSIM_REGS_SIZE && (reg & 3) == 0) ?
+				cpu_to_be32(sim_reg_read(hw_data, reg)) : 0;
+	}
+	spin_unlock_irqrestore(&hw_data->lock, flags);
 }
 
-void evr_sim_end(struct evr_hw_data *evr_hw_data)
-{
-	struct hw_data *hw_data = (struct hw_data *)evr_hw_data->sim;
+struct modac_io_rw_plugin evr_sim_rw_plugin = {
+	write_u16: modac_write_u16,
+	read_u16: modac_read_u16,
+	write_u32: modac_write_u32,
+	read_u32: modac_read_u32,
+	read_block_u32: modac_read_block_u32,
+};
 
-	kfree(hw_data);
+void evr_sim_irq_set(struct modac_mngdev_des *mngdev_des, int enabled)
+{
 }
 
-int evr_sim_set_output_to_pulsegen(struct evr_hw_data *evr_hw_data, 
-		int index_output, int index_pulsegen)
+/*
+ * Puts one burst of the stream to the simulated registers. The events go
+ * through the active MapRam bank, the same as with the HW.
+ */
+static void gen_fire(struct hw_data *hw_data, struct sim_gen_stream *stream,
+					 u64 now_ns)
 {
-	struct hw_data *hw_data = (struct hw_data *)evr_hw_data->sim;
+	u32 seconds, timestamp;
+	u32 ctrl = reg_get(hw_data, EVR_REG_CTRL);
+	u32 int_event = 0;
+	int i;
 	
+	sim_time(now_ns, &seconds, &timestamp);
 	
-	hw_data->output_src[index_output] = index_pulsegen;
-	return 0;
+	if(stream->code != 0 && (ctrl & (1 << C_EVR_CTRL_MAP_RAM_ENABLE))) {
+		u32 bank = (ctrl & (1 << C_EVR_CTRL_MAP_RAM_SELECT)) ?
+						EVR_REG_MAPRAM2 : EVR_REG_MAPRAM1;
+		int_event = reg_get(hw_data, bank +
+						stream->code * EVR_REG_MAPRAM_SLOT_SIZE +
+						EVR_REG_MAPRAM_INT_FUNC_OFFSET);
+	}
+	
+	for(i = 0; stream->code != 0 && i < stream->burst; i ++) {
+		
+		struct sim_fifo_entry *e;
+		
+		if(int_event & (1 << C_EVR_MAP_LATCH_TIMESTAMP)) {
+			sim_latch_time(hw_data, seconds, timestamp);
+		}
+		
+		if(!(int_event & (1 << C_EVR_MAP_SAVE_EVENT))) {
+			hw_data->gen_unmapped ++;
+			continue;
+		}
+		
+		if(hw_data->fifo_head - hw_data->fifo_tail >= EVRSIM_FIFO_SIZE) {
+			hw_data->irq_flags |= EVR_IRQFLAG_FIFOFULL;
+			hw_data->gen_fifo_drops ++;
+			continue;
+		}
+		
+		e = &hw_data->fifo[hw_data->fifo_head % EVRSIM_FIFO_SIZE];
+		e->code = stream->code;
+		e->seconds = seconds;
+		e->timestamp = timestamp;
+		hw_data->fifo_head ++;
+		hw_data->gen_events ++;
+	}
+	
+	if(stream->dbuf_bytes > 0) {
+		
+		int words = stream->dbuf_bytes >> 2;
+		
+		if(!hw_data->dbuf_armed) {
+			hw_data->gen_dbuf_drops ++;
+			return;
+		}
+		
+		for(i = 0; i < words; i ++) {
+			reg_set(hw_data, EVR_REG_DATA_BUF + (i << 2),
+					(hw_data->gen_dbufs << 16) | i);
+		}
+		
+		hw_data->dbuf_ctrl &= (1 << C_EVR_DATABUF_MODE);
+		hw_data->dbuf_ctrl |= (1 << C_EVR_DATABUF_RXREADY) |
+				((stream->dbuf_bytes & C_EVR_DATABUF_RXSIZE_MASK) << C_EVR_DATABUF_RXSIZE);
+		if(hw_data->gen_csum_err > 0 &&
+				(hw_data->gen_dbufs + 1) % hw_data->gen_csum_err == 0) {
+			hw_data->dbuf_ctrl |= (1 << C_EVR_DATABUF_CHECKSUM);
+		}
+		
+		hw_data->dbuf_armed = 0;
+		hw_data->irq_flags |= EVR_IRQFLAG_DATABUF;
+		hw_data->gen_dbufs ++;
+	}
 }
 
-int evr_sim_set_output_to_misc_func(struct evr_hw_data *evr_hw_data, 
-		int index_output, int misc_func)
+static u32 gen_period_ns(struct hw_data *hw_data, struct sim_gen_stream *stream)
 {
-	struct hw_data *hw_data = (struct hw_data *)evr_hw_data->sim;
+	s64 period = stream->period_ns;
+	
+	if(hw_data->gen_jitter_ns > 0) {
+		u32 r;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+		r = get_random_u32();
+#else
+		r = prandom_u32();
+#endif
+		period += (s64)(r % (2 * hw_data->gen_jitter_ns + 1)) -
+							hw_data->gen_jitter_ns;
+	}
+	
+	return (u32)max_t(s64, period, EVRSIM_GEN_MIN_PERIOD_NS);
+}
 
-	hw_data->output_src[index_output] = misc_func;
-	return 0;
+/* Calls the ISR and counts its MMIO accesses. */
+static void gen_isr(struct hw_data *hw_data)
+{
+	u64 reads = hw_data->mmio_reads;
+	u64 writes = hw_data->mmio_writes;
+	
+	modac_mngdev_isr(hw_data->devdes, NULL);
+	
+	hw_data->isr_calls ++;
+	hw_data->isr_last_reads = (u32)(hw_data->mmio_reads - reads);
+	hw_data->isr_last_writes = (u32)(hw_data->mmio_writes - writes);
+	hw_data->isr_max_reads = max(hw_data->isr_max_reads, hw_data->isr_last_reads);
+	hw_data->isr_max_writes = max(hw_data->isr_max_writes, hw_data->isr_last_writes);
 }
 
-int evr_sim_get_pulsegen_param(struct evr_hw_data *evr_hw_data,
-					int index,
-					u32 *prescaler,
-					u32 *delay,
-					u32 *width)
+/*
+ * Runs in the hard IRQ context, the same as the ISR of a real EVR.
+ */
+static enum hrtimer_restart gen_timer_fn(struct hrtimer *timer)
 {
-	if(index >= 0 && index < EVRSIM_PULSEGEN_COUNT) {
-		struct hw_data *hw_data = (struct hw_data *)evr_hw_data->sim;
-		struct pulsegen_params *pulsegen_params = 
-				&hw_data->pulsegen_params[index];
-
-		*prescaler = pulsegen_params->prescaler;
-		*delay = pulsegen_params->delay;
-		*width = pulsegen_params->width;
-		return 0;
-	} else {
-		printk(KERN_DEBUG "Error Setting the pulse params\n");
-		return -EINVAL;
+	struct hw_data *hw_data = container_of(timer, struct hw_data, gen_timer);
+	u64 now_ns = ktime_to_ns(ktime_get());
+	u64 next_ns = U64_MAX;
+	unsigned long flags;
+	u32 irq_enable;
+	u32 pending;
+	int i;
+	
+	spin_lock_irqsave(&hw_data->lock, flags);
+	
+	hw_data->gen_ticks ++;
+	
+	for(i = 0; i < hw_data->gen_stream_count; i ++) {
+		
+		struct sim_gen_stream *stream = &hw_data->gen_streams[i];
+		int n = 0;
+		
+		while(stream->next_ns <= now_ns && n < EVRSIM_GEN_MAX_CATCHUP) {
+			gen_fire(hw_data, stream, now_ns);
+			stream->next_ns += gen_period_ns(hw_data, stream);
+			n ++;
+		}
+		
+		if(stream->next_ns <= now_ns) {
+			// too late, skip the rest
+			stream->next_ns = now_ns + stream->period_ns;
+		}
+		
+		next_ns = min(next_ns, stream->next_ns);
+	}
+	
+	// the interrupt is raised only for what the IRQEN enables
+	irq_enable = reg_get(hw_data, EVR_REG_IRQEN);
+	pending = sim_reg_read(hw_data, EVR_REG_IRQFLAG) & irq_enable;
+	
+	spin_unlock_irqrestore(&hw_data->lock, flags);
+	
+	if((irq_enable & EVR_IRQ_MASTER_ENABLE) && pending != 0) {
+		gen_isr(hw_data);
 	}
+	
+	if(!hw_data->gen_running) {
+		return HRTIMER_NORESTART;
+	}
+	
+	hrtimer_set_expires(timer, ns_to_ktime(next_ns));
+	return HRTIMER_RESTART;
 }
 
-int evr_sim_set_pulsegen_param(struct evr_hw_data *evr_hw_data,
-					int index,
-					u32 prescaler,
-					u32 delay,
-					u32 width)
+static int gen_start(struct hw_data *hw_data)
 {
-	if(index >= 0 && index < EVRSIM_PULSEGEN_COUNT) {
-		struct hw_data *hw_data = (struct hw_data *)evr_hw_data->sim;
-		struct pulsegen_params *pulsegen_params = 
-				&hw_data->pulsegen_params[index];
-
-		pulsegen_params->prescaler = prescaler;
-		pulsegen_params->delay = delay;
-		pulsegen_params->width = width;
-		return 0;
-	} else {
-		printk(KERN_DEBUG "Error Setting the pulse params\n");
+	u64 now_ns = ktime_to_ns(ktime_get());
+	u32 first_ns = ~0;
+	int i;
+	
+	if(hw_data->gen_running) {
+		return -EBUSY;
+	}
+	
+	if(hw_data->gen_stream_count == 0) {
 		return -EINVAL;
 	}
+	
+	for(i = 0; i < hw_data->gen_stream_count; i ++) {
+		struct sim_gen_stream *stream = &hw_data->gen_streams[i];
+		stream->next_ns = now_ns + stream->period_ns;
+		first_ns = min(first_ns, stream->period_ns);
+	}
+	
+	hw_data->gen_running = 1;
+	hrtimer_start(&hw_data->gen_timer, ns_to_ktime(first_ns), HRTIMER_MODE_REL);
+	
+	return 0;
 }
 
-int evr_sim_init_res(struct evr_hw_data *evr_hw_data,
-				int res_type, int res_index)
+static void gen_stop(struct hw_data *hw_data)
 {
-	if(res_type == EVR_RES_TYPE_PULSEGEN) {
-		if(res_index >= 0 && res_index < EVRSIM_PULSEGEN_COUNT) {
-			struct hw_data *hw_data = (struct hw_data *)evr_hw_data->sim;
-			struct pulsegen_params *pulsegen_params = 
-					&hw_data->pulsegen_params[res_index];
-
-			pulsegen_params->prescaler = 0;
-			pulsegen_params->delay = 0;
-			pulsegen_params->width = 0;
-			return 0;
-		} else {
+	hw_data->gen_running = 0;
+	hrtimer_cancel(&hw_data->gen_timer);
+}
+
+/*
+ * gen add <CODE> <RATE_HZ> [<BURST> [<DBUF_BYTES>]]
+ * gen jitter <NS>
+ * gen csum_err <N>
+ * gen start|stop|clear
+ */
+static int gen_dbg(struct hw_data *hw_data, const char *cmd)
+{
+	unsigned int code, rate_hz, burst = 1, dbuf_bytes = 0, jitter_ns, csum_err;
+	
+	if(strncmp(cmd, "start", 5) == 0) {
+		return gen_start(hw_data);
+	}
+	
+	if(strncmp(cmd, "stop", 4) == 0) {
+		gen_stop(hw_data);
+		return 0;
+	}
+	
+	// the rest can only be changed while stopped
+	if(hw_data->gen_running) {
+		return -EBUSY;
+	}
+	
+	if(strncmp(cmd, "clear", 5) == 0) {
+		hw_data->gen_stream_count = 0;
+		hw_data->gen_jitter_ns = 0;
+		hw_data->gen_csum_err = 0;
+		hw_data->gen_ticks = 0;
+		hw_data->gen_events = 0;
+		hw_data->gen_unmapped = 0;
+		hw_data->gen_fifo_drops = 0;
+		hw_data->gen_dbufs = 0;
+		hw_data->gen_dbuf_drops = 0;
+		hw_data->mmio_reads = 0;
+		hw_data->mmio_writes = 0;
+		hw_data->isr_calls = 0;
+		hw_data->isr_last_reads = 0;
+		hw_data->isr_last_writes = 0;
+		hw_data->isr_max_reads = 0;
+		hw_data->isr_max_writes = 0;
+		return 0;
+	}
+	
+	if(sscanf(cmd, "jitter %u", &jitter_ns) == 1) {
+		hw_data->gen_jitter_ns = jitter_ns;
+		return 0;
+	}
+	
+	if(sscanf(cmd, "csum_err %u", &csum_err) == 1) {
+		hw_data->gen_csum_err = csum_err;
+		return 0;
+	}
+	
+	if(sscanf(cmd, "add %u %u %u %u", &code, &rate_hz, &burst, &dbuf_bytes) >= 2) {
+		
+		struct sim_gen_stream *stream;
+		
+		if(hw_data->gen_stream_count >= EVRSIM_GEN_MAX_STREAMS) {
+			return -ENOSPC;
+		}
+		
+		if(code > EVRMA_FIFO_MAX_EVENT_CODE || rate_hz == 0 ||
+				NSEC_PER_SEC / rate_hz < EVRSIM_GEN_MIN_PERIOD_NS ||
+				burst > EVRSIM_FIFO_SIZE ||
+				dbuf_bytes > EVRSIM_DBUF_WORDS * 4 || (code == 0 && dbuf_bytes == 0)) {
 			return -EINVAL;
 		}
-	} else if(res_type == EVR_RES_TYPE_OUTPUT) {
+		
+		stream = &hw_data->gen_streams[hw_data->gen_stream_count];
+		stream->code = code;
+		stream->period_ns = NSEC_PER_SEC / rate_hz;
+		stream->burst = burst;
+		stream->dbuf_bytes = dbuf_bytes & ~3;
+		hw_data->gen_stream_count ++;
+		
 		return 0;
-	} else {
-		return -ENOSYS;
 	}
+	
+	return -EINVAL;
+}
+
+int evr_sim_init(struct evr_hw_data *evr_hw_data)
+{
+	struct hw_data *hw_data;
+	
+	hw_data = vzalloc(sizeof(struct hw_data));
+	if(hw_data == NULL) {
+		return -ENOMEM;
+	}
+	
+	evr_hw_data->sim = hw_data;
+	
+	spin_lock_init(&hw_data->lock);
+	reg_set(hw_data, EVR_REG_FW_VERSION, EVRSIM_FW_VERSION);
+	reg_set(hw_data, EVR_REG_USEC_DIV, EVRSIM_USEC_DIV);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+	hrtimer_setup(&hw_data->gen_timer, gen_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&hw_data->gen_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	hw_data->gen_timer.function = gen_timer_fn;
+#endif
+
+	hw_data->devdes = evr_hw_data->hw_support_data->mngdev_des;
+	hw_data->devdes->io_priv = hw_data;
+	
+	return 0;
+}
+
+void evr_sim_end(struct evr_hw_data *evr_hw_data)
+{
+	struct hw_data *hw_data = (struct hw_data *)evr_hw_data->sim;
+	
+	gen_stop(hw_data);
+	hw_data->devdes->io_priv = NULL;
+	
+	vfree(hw_data);
 }
 
 // return <0 on err; >=0 is the result
@@ -330,6 +774,13 @@ ssize_t evr_sim_dbg(struct evr_hw_data *evr_hw_data,
 	} else 
 		return count;
 	
+	if(count > 4 && strncmp(buf, "gen ", 4) == 0) {
+		
+		int ret = gen_dbg((struct hw_data *)evr_hw_data->sim, buf + 4);
+		
+		return ret < 0 ? ret : count;
+	}
+	
 	i += 1;
 	
 	if(cmd == 'i') {
@@ -362,30 +813,43 @@ ssize_t evr_sim_dbg(struct evr_hw_data *evr_hw_data,
 		modac_mngdev_notify(evr_hw_data->hw_support_data->mngdev_des, code);
 		
 	}
-
+	
 	return count;
 }
 
-ssize_t evr_sim_dbg_res(struct evr_hw_data *evr_hw_data, 
-						char *buf, size_t count, int res_type,
-						int res_index)
+ssize_t evr_sim_show_dbg(struct evr_hw_data *evr_hw_data,
+						char *buf, size_t count)
 {
 	struct hw_data *hw_data = (struct hw_data *)evr_hw_data->sim;
 	ssize_t n = 0;
+	int i;
 	
-	if(res_type == EVR_RES_TYPE_PULSEGEN && res_index >= 0 && res_index < EVRSIM_PULSEGEN_COUNT) {
-		struct pulsegen_params *pulsegen_params = 
-				&hw_data->pulsegen_params[res_index];
-
-		n += scnprintf(buf + n, count - n, "%d,", pulsegen_params->prescaler);
-		n += scnprintf(buf + n, count - n, "%d,", pulsegen_params->delay);
-		n += scnprintf(buf + n, count - n, "%d", pulsegen_params->width);
-	} else if(res_type == EVR_RES_TYPE_OUTPUT && res_index >= 0 && res_index < EVRSIM_OUTPUT_COUNT) {
-		n += scnprintf(buf + n, count - n, "%d", hw_data->output_src[res_index]);
-	} else {
-		n += scnprintf(buf + n, count - n, "XXX");
+	n += scnprintf(buf + n, count - n, "Generator: running=%d jitter_ns=%u "
+				"csum_err=%u ticks=%u events=%llu unmapped=%llu fifo_drops=%u "
+				"dbufs=%u dbuf_drops=%u\n",
+				hw_data->gen_running, hw_data->gen_jitter_ns,
+				hw_data->gen_csum_err, hw_data->gen_ticks,
+				(unsigned long long)hw_data->gen_events,
+				(unsigned long long)hw_data->gen_unmapped,
+				hw_data->gen_fifo_drops, hw_data->gen_dbufs,
+				hw_data->gen_dbuf_drops);
+	
+	for(i = 0; i < hw_data->gen_stream_count; i ++) {
+		struct sim_gen_stream *stream = &hw_data->gen_streams[i];
+		
+		n += scnprintf(buf + n, count - n, "Stream[%d]: code=%u period_ns=%u "
+				"burst=%u dbuf_bytes=%u\n", i, stream->code, stream->period_ns,
+				stream->burst, stream->dbuf_bytes);
 	}
 	
+	n += scnprintf(buf + n, count - n, "Mmio: reads=%llu writes=%llu "
+				"isr_calls=%u isr_last_reads=%u isr_last_writes=%u "
+				"isr_max_reads=%u isr_max_writes=%u\n",
+				(unsigned long long)hw_data->mmio_reads,
+				(unsigned long long)hw_data->mmio_writes,
+				hw_data->isr_calls, hw_data->isr_last_reads,
+				hw_data->isr_last_writes, hw_data->isr_max_reads,
+				hw_data->isr_max_writes);
+	
 	return n;
 }
-
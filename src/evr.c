@@ -34,10 +34,23 @@
 enum {
 	CLEAN_RES,
 	CLEAN_DATA,
+	CLEAN_MMAP,
 	CLEAN_SIM,
 	CLEAN_ALL = CLEAN_SIM
 };
 
+static int dbuf_ring_slots = 0;
+module_param(dbuf_ring_slots, int, 0444);
+MODULE_PARM_DESC(dbuf_ring_slots, "The number of the DataBuf ring slots "
+		"in the VEVR mmap region (0 = no ring, max. 64).");
+
+static int shadow_regs = 0;
+module_param(shadow_regs, int, 0644);
+MODULE_PARM_DESC(shadow_regs, "Serve the IRQEN, FW_VERSION, pulse generator "
+		"and output registers from memory (0 = off, 1 = on, 2 = on and verify "
+		"against the HW on every read). Only if nothing writes them through "
+		"the MNG_DEV mmap (e.g. the evrManager).");
+
 
 // ------ General EVR definitions ------------------------------------------
 // 
@@ -238,7 +251,10 @@ static void cleanup(struct modac_hw_support_data *hw_support_data, int what)
 		if(hw_data->sim != NULL) {
 			evr_sim_end(hw_data);
 		}
+	case CLEAN_MMAP:
+		free_pages_exact(hw_data->mmap_p, hw_data->mmap_p_final_size);
 	case CLEAN_DATA:
+		kfree(hw_data->txn);
 		kfree(hw_support_data->priv);
 	case CLEAN_RES:
 		kfree(hw_support_data->hw_res_defs);
@@ -314,44 +330,219 @@ static inline int output_suits(struct modac_rm_data *rm_data, int index, int *ar
 	return 0;
 }
 
+/*
+ * The pulse generator control bits set by the driver; the others are status.
+ */
+#define EVR_PULSE_CTRL_DRIVER_BITS 0x3F
+
+/*
+ * Returns the index to the shadow32 or -1 if the register is not shadowed.
+ * The EVR_REG_CTRL never is: the evrManager changes it through the MNG_DEV
+ * mmap and evr_ctrl_modify would write a stale copy back.
+ */
+static inline int shadow32_index(int reg)
+{
+	if(reg == EVR_REG_IRQEN || reg == EVR_REG_FW_VERSION ||
+			(reg >= EVR_REG_PULSES && reg < EVR_SHADOW32_WORDS * 4)) {
+		return reg >> 2;
+	}
+	
+	return -1;
+}
+
+/*
+ * The bits of the register that are not kept in the shadow.
+ */
+static inline u32 shadow32_volatile_bits(int reg)
+{
+	if(reg >= EVR_REG_PULSES && 
+			((reg - EVR_REG_PULSES) % EVR_REG_PULSE_SLOT_SIZE) == EVR_REG_PULSE_CTRL_OFFSET) {
+		return ~EVR_PULSE_CTRL_DRIVER_BITS;
+	}
+	
+	return 0;
+}
+
+static inline int shadow16_index(int reg)
+{
+	if(reg >= EVR_SHADOW16_FIRST && 
+			reg < EVR_SHADOW16_FIRST + EVR_SHADOW16_COUNT * 2) {
+		return (reg - EVR_SHADOW16_FIRST) >> 1;
+	}
+	
+	return -1;
+}
+
+/*
+ * Forces the next read of the register to go to the HW. Must be called
+ * when someone else than evr_write.. changes the register.
+ */
+void evr_shadow_invalidate(struct evr_hw_data *hw_data, int reg)
+{
+	int i = shadow32_index(reg);
+	
+	if(i >= 0) {
+		clear_bit(i, hw_data->shadow.valid32);
+	}
+	
+	i = shadow16_index(reg);
+	if(i >= 0) {
+		clear_bit(i, hw_data->shadow.valid16);
+	}
+}
+
+void evr_shadow_invalidate_all(struct evr_hw_data *hw_data)
+{
+	bitmap_zero(hw_data->shadow.valid32, EVR_SHADOW32_WORDS);
+	bitmap_zero(hw_data->shadow.valid16, EVR_SHADOW16_COUNT);
+}
+
+static void shadow_drift(struct evr_hw_data *hw_data, int reg, u32 shadow, u32 hw)
+{
+	hw_data->shadow.drifts ++;
+	printk_ratelimited(KERN_WARNING "EVR shadow register 0x%04x: 0x%08x, HW: 0x%08x\n",
+			reg, shadow, hw);
+}
+
 // Does everything on 16-bit read (endiannes!)
 u16 evr_read16(struct modac_hw_support_data *hw_support_data, int reg)
 {
 	struct modac_mngdev_des *devdes = hw_support_data->mngdev_des;
+	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
+	int i = (shadow_regs && hw_data != NULL) ? shadow16_index(reg) : -1;
+	u16 val;
 	
-	return be16_to_cpu(devdes->io_rw->read_u16(devdes, reg));
+	if(i >= 0 && test_bit(i, hw_data->shadow.valid16)) {
+		
+		hw_data->shadow.hits ++;
+		
+		if(shadow_regs < 2) {
+			return hw_data->shadow.val16[i];
+		}
+		
+		val = be16_to_cpu(devdes->io_rw->read_u16(devdes, reg));
+		if(val != hw_data->shadow.val16[i]) {
+			shadow_drift(hw_data, reg, hw_data->shadow.val16[i], val);
+		}
+		
+	} else {
+		
+		val = be16_to_cpu(devdes->io_rw->read_u16(devdes, reg));
+		
+		if(i >= 0) {
+			hw_data->shadow.misses ++;
+		}
+	}
+	
+	if(i >= 0) {
+		hw_data->shadow.val16[i] = val;
+		set_bit(i, hw_data->shadow.valid16);
+	}
+	
+	return val;
 }
 
 // Does everything on 16-bit write (endiannes!)
 void evr_write16(struct modac_hw_support_data *hw_support_data, int reg, u16 val)
 {
 	struct modac_mngdev_des *devdes = hw_support_data->mngdev_des;
+	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
+	int i = (hw_data != NULL) ? shadow16_index(reg) : -1;
 	
 	devdes->io_rw->write_u16(devdes, reg, cpu_to_be16(val));
+	
+	if(i >= 0) {
+		hw_data->shadow.val16[i] = val;
+		set_bit(i, hw_data->shadow.valid16);
+	}
 }
 
 // Does everything on 32-bit read (endiannes!)
 u32 evr_read32(struct modac_hw_support_data *hw_support_data, int reg)
 {
 	struct modac_mngdev_des *devdes = hw_support_data->mngdev_des;
+	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
+	int i = (shadow_regs && hw_data != NULL) ? shadow32_index(reg) : -1;
+	u32 val;
+	
+	if(i >= 0 && test_bit(i, hw_data->shadow.valid32)) {
+		
+		hw_data->shadow.hits ++;
+		
+		if(shadow_regs < 2) {
+			return hw_data->shadow.val32[i];
+		}
+		
+		val = be32_to_cpu(devdes->io_rw->read_u32(devdes, reg)) & 
+						~shadow32_volatile_bits(reg);
+		if(val != hw_data->shadow.val32[i]) {
+			shadow_drift(hw_data, reg, hw_data->shadow.val32[i], val);
+		}
+		
+	} else {
+		
+		val = be32_to_cpu(devdes->io_rw->read_u32(devdes, reg));
+		
+		if(i < 0) {
+			return val;
+		}
+		
+		hw_data->shadow.misses ++;
+		val &= ~shadow32_volatile_bits(reg);
+	}
+	
+	hw_data->shadow.val32[i] = val;
+	set_bit(i, hw_data->shadow.valid32);
 	
-	return be32_to_cpu(devdes->io_rw->read_u32(devdes, reg));
+	return val;
 }
 
 // Does everything on 32-bit write (endiannes!)
 void evr_write32(struct modac_hw_support_data *hw_support_data, int reg, u32 val)
 {
 	struct modac_mngdev_des *devdes = hw_support_data->mngdev_des;
+	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
+	int i = (hw_data != NULL) ? shadow32_index(reg) : -1;
 	
 	devdes->io_rw->write_u32(devdes, reg, cpu_to_be32(val));
+	
+	if(i >= 0) {
+		hw_data->shadow.val32[i] = val & ~shadow32_volatile_bits(reg);
+		set_bit(i, hw_data->shadow.valid32);
+	}
+}
+
+/* 
+ * Clears the 'clear' and then sets the 'set' bits of the EVR_REG_CTRL and
+ * returns the written value. Any context; all the read-modify-writes of the 
+ * EVR_REG_CTRL must go through here or the IRQ handler could write back a
+ * stale value (e.g. undo a MAP_RAM_SELECT switch) read before the write of 
+ * the others. The register is read from the HW, so the bits the evrManager
+ * changed are kept.
+ */
+u32 evr_ctrl_modify(struct modac_hw_support_data *hw_support_data, 
+		u32 clear, u32 set)
+{
+	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
+	unsigned long flags;
+	u32 ctrl;
+	
+	spin_lock_irqsave(&hw_data->ctrl_lock, flags);
+	ctrl = (evr_read32(hw_support_data, EVR_REG_CTRL) & ~clear) | set;
+	evr_write32(hw_support_data, EVR_REG_CTRL, ctrl);
+	spin_unlock_irqrestore(&hw_data->ctrl_lock, flags);
+	
+	return ctrl;
 }
 
-static void save_map_ram(struct modac_hw_support_data *hw_support_data, u32 address)
+/* Writes the entries the bank is missing. */
+static void save_map_ram(struct modac_hw_support_data *hw_support_data, 
+		u32 address, unsigned long *dirty)
 {
 	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
 	int i;
 	
-	for(i = 0; i < EVR_MAPRAM_EVENT_CODES; i ++) {
+	for_each_set_bit(i, dirty, EVR_MAPRAM_EVENT_CODES) {
 		evr_write32(hw_support_data, 
 					address + i * EVR_REG_MAPRAM_SLOT_SIZE + EVR_REG_MAPRAM_CLEAR_OFFSET,
 					hw_data->map_ram[i].pulse_clear);
@@ -364,28 +555,40 @@ static void save_map_ram(struct modac_hw_support_data *hw_support_data, u32 addr
 		evr_write32(hw_support_data, 
 					address + i * EVR_REG_MAPRAM_SLOT_SIZE + EVR_REG_MAPRAM_INT_FUNC_OFFSET,
 					hw_data->map_ram[i].int_event);
+		hw_data->map_ram_writes += 4;
 	}
+	
+	bitmap_zero(dirty, EVR_MAPRAM_EVENT_CODES);
 }
 
 void evr_ram_map_change_flush(
 		struct modac_hw_support_data *hw_support_data)
 {
+	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
 	u32 newram_offset;
+	int newram_bank;
 	u32 ctrl = evr_read32(hw_support_data, EVR_REG_CTRL);
 	
 	if ((ctrl >> C_EVR_CTRL_MAP_RAM_SELECT) & 1)
-		newram_offset = EVR_REG_MAPRAM1;
+		newram_bank = 0;
 	else
-		newram_offset = EVR_REG_MAPRAM2;
+		newram_bank = 1;
+	newram_offset = newram_bank ? EVR_REG_MAPRAM2 : EVR_REG_MAPRAM1;
+	
+	/* the active bank is already up to date */
+	if(bitmap_empty(hw_data->map_ram_dirty[1 - newram_bank], EVR_MAPRAM_EVENT_CODES))
+		return;
 	
-	save_map_ram(hw_support_data, newram_offset);
+	hw_data->map_ram_flushes ++;
+	
+	save_map_ram(hw_support_data, newram_offset, hw_data->map_ram_dirty[newram_bank]);
 
 	// switch the ram
-	ctrl &= ~((1 << C_EVR_CTRL_MAP_RAM_ENABLE) | (1 << C_EVR_CTRL_MAP_RAM_SELECT));
-	ctrl |= (1 << C_EVR_CTRL_MAP_RAM_ENABLE);
-	if (newram_offset == EVR_REG_MAPRAM2)
-		ctrl |= (1 << C_EVR_CTRL_MAP_RAM_SELECT);
-	evr_write32(hw_support_data, EVR_REG_CTRL, ctrl);
+	evr_ctrl_modify(hw_support_data, 
+			(1 << C_EVR_CTRL_MAP_RAM_ENABLE) | (1 << C_EVR_CTRL_MAP_RAM_SELECT),
+			(1 << C_EVR_CTRL_MAP_RAM_ENABLE) | 
+				((newram_offset == EVR_REG_MAPRAM2) ? (1 << C_EVR_CTRL_MAP_RAM_SELECT) : 0));
+	hw_data->map_ram_writes ++;
 
 }
 
@@ -394,6 +597,11 @@ static void evr_ram_map_init(struct modac_hw_support_data *hw_support_data)
 	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
 	
 	memset(&hw_data->map_ram, 0, sizeof(hw_data->map_ram));
+	/* the HW content is unknown, both banks must be written completely */
+	bitmap_fill(hw_data->map_ram_dirty[0], EVR_MAPRAM_EVENT_CODES);
+	bitmap_fill(hw_data->map_ram_dirty[1], EVR_MAPRAM_EVENT_CODES);
+	hw_data->map_ram_flushes = 0;
+	hw_data->map_ram_writes = 0;
 
 	// copied from ErInitializeRams in event2
 	hw_data->map_ram[0x70].int_event = 1<<C_EVR_MAP_SECONDS_0;
@@ -416,22 +624,19 @@ static void evr_ram_map_init(struct modac_hw_support_data *hw_support_data)
 static void evr_output_enable(struct modac_hw_support_data *hw_support_data,
 							 int state)
 {
-	u32 ctrl = evr_read32(hw_support_data, EVR_REG_CTRL);
-	
 	if (state)
-		ctrl |= (1 << C_EVR_CTRL_OUTEN);
+		evr_ctrl_modify(hw_support_data, 0, 1 << C_EVR_CTRL_OUTEN);
 	else
-		ctrl &= (~(1 << C_EVR_CTRL_OUTEN));
-	
-	evr_write32(hw_support_data, EVR_REG_CTRL, ctrl);
+		evr_ctrl_modify(hw_support_data, 1 << C_EVR_CTRL_OUTEN, 0);
 	
-	ctrl = evr_read32(hw_support_data, EVR_REG_CTRL);
+	evr_read32(hw_support_data, EVR_REG_CTRL);
 }
 
 static int hw_support_evr_init(struct modac_hw_support_data *hw_support_data)
 {
 	struct evr_hw_data *hw_data;
 	int ret;
+	int evr_type_docd;
 	int current_clean; // keeps track of what to clean up on error.
 	
 	/*
@@ -456,119 +661,141 @@ static int hw_support_evr_init(struct modac_hw_support_data *hw_support_data)
 		return -ENOMEM;
 	}
 	
-	current_clean = CLEAN_DATA;
-	
-	hw_data->mmap_p = (void *)((long)(hw_data->mmap_mem + PAGE_SIZE - 1) & PAGE_MASK);
-	hw_data->mmap_p_final_size = 
-			(u8 *)&hw_data->mmap_mem + sizeof(hw_data->mmap_mem) - (u8 *)hw_data->mmap_p;
-
 	hw_data->hw_support_data = hw_support_data;
+	spin_lock_init(&hw_data->ctrl_lock);
 	hw_support_data->priv = hw_data;
 	
+	current_clean = CLEAN_DATA;
+	
+	hw_data->dbuf_ring_slot_count = clamp(dbuf_ring_slots, 0, EVR_DBUF_RING_MAX_SLOTS);
+	hw_data->dbuf_ring_sequence = 0;
+	
+	/* so that the USEC_DIV is read with the first event */
+	hw_data->ts_last_seconds = ~0;
+	
+	/*
+	 * The region is mmap-ed to the user space so it must be page aligned and
+	 * physically contiguous.
+	 */
+	hw_data->mmap_p_final_size = PAGE_ALIGN(sizeof(struct vevr_mmap_data) +
+			hw_data->dbuf_ring_slot_count * sizeof(struct evr_data_buff_ring_slot));
+	hw_data->mmap_p = alloc_pages_exact(hw_data->mmap_p_final_size, 
+										GFP_KERNEL | __GFP_ZERO);
+	if(hw_data->mmap_p == NULL) {
+		cleanup(hw_support_data, current_clean);
+		return -ENOMEM;
+	}
+	
+	current_clean = CLEAN_MMAP;
+	
+	((struct vevr_mmap_data *)hw_data->mmap_p)->dbuf_ring_slot_count = 
+			hw_data->dbuf_ring_slot_count;
+	
 	// io_start == NULL means the simulation
 	if(hw_support_data->mngdev_des->io_start == NULL) {
 		
 		ret = evr_sim_init(hw_data);
 		if(ret < 0) {
 			cleanup(hw_support_data, current_clean);
+			return ret;
 		}
+	}
+	
+	current_clean = CLEAN_SIM;
+	
+	/*
+	 * The first SLAC card (not present anymore) had: FWVersion=0x1f000000
+	 * Second SLAC card: fw_version=0x1fd20005
+	 */
+	
+	evr_type_docd = hw_support_data->mngdev_des->hw_support_hint1;
+	
+	hw_data->fw_version = evr_read32(hw_support_data, EVR_REG_FW_VERSION);
 
-	} else {
+	if(hw_data->sim != NULL) {
 		
-		// non-simulation stuff
+		// the simulation has its own register model and type
 		
-		int evr_type_docd;
+		memcpy(&hw_data->evr_type_data, &evr_sim_type_data, 
+				sizeof(struct evr_type_data));
 		
-		hw_data->sim = NULL;
-	
+	} else if(evr_type_docd >= 0 && evr_type_docd < EVR_TYPE_DOCD_COUNT) {
 		
-		/*
-		 * The first SLAC card (not present anymore) had: FWVersion=0x1f000000
-		 * Second SLAC card: fw_version=0x1fd20005
-		 */
+		// evr_type_docd can be one of the documented EVR types 
 		
-		evr_type_docd = hw_support_data->mngdev_des->hw_support_hint1;
+		memcpy(&hw_data->evr_type_data, 
+				&documented_evr_type_data_table[evr_type_docd], 
+				sizeof(struct evr_type_data));
+
+	} else if((hw_data->fw_version & EVR_TYPE_ADHOC_SLAC_FW_VERSION_MASK) 
+			== EVR_TYPE_ADHOC_SLAC_FW_VERSION) {
 		
-		hw_data->fw_version = evr_read32(hw_support_data, EVR_REG_FW_VERSION);
-	
-		if(evr_type_docd >= 0 && evr_type_docd < EVR_TYPE_DOCD_COUNT) {
-			
-			// evr_type_docd can be one of the documented EVR types 
-			
-			memcpy(&hw_data->evr_type_data, 
-					&documented_evr_type_data_table[evr_type_docd], 
-					sizeof(struct evr_type_data));
+		memcpy(&hw_data->evr_type_data, 
+				&adhoc_evr_type_slac_general, 
+				sizeof(struct evr_type_data));
+		
+	} else if(hw_data->fw_version == EVR_TYPE_EMCOR_FW_VERSION) {
+		
+		memcpy(&hw_data->evr_type_data, 
+				&adhoc_evr_type_emcor, 
+				sizeof(struct evr_type_data));
+		
+	} else {
+		
+		printk(KERN_ERR "Not supported: evr_type_docd=%d, fw_version=0x%x\n", evr_type_docd, hw_data->fw_version);
+		cleanup(hw_support_data, current_clean);
+		
+		// The HW we got is not supported
+		return -ENOSYS;
+	}
 
-		} else if((hw_data->fw_version & EVR_TYPE_ADHOC_SLAC_FW_VERSION_MASK) 
-				== EVR_TYPE_ADHOC_SLAC_FW_VERSION) {
-			
-			memcpy(&hw_data->evr_type_data, 
-					&adhoc_evr_type_slac_general, 
-					sizeof(struct evr_type_data));
-			
-		} else if(hw_data->fw_version == EVR_TYPE_EMCOR_FW_VERSION) {
-			
-			memcpy(&hw_data->evr_type_data, 
-					&adhoc_evr_type_emcor, 
-					sizeof(struct evr_type_data));
-			
-		} else {
+	printk(KERN_DEBUG "OK, going on. FW_VERSION: 0x%x, Type: '%s'\n", hw_data->fw_version, hw_data->evr_type_data.name);
+
+	{
+		int otype;
+		int current_res_inx = 0;
+		
+		for(otype = 0; otype < EVR_OUT_TYPE_COUNT; otype ++) {
+			int cnt = 0;
+			u32 evr_map_reg_start = 0;
+
+			switch(otype) {
+			case EVR_OUT_TYPE_FP_TTL:
+				cnt = hw_data->evr_type_data.output_count;
+				evr_map_reg_start = EVR_REG_FIRST_OUTPUT_FP_TTL;
+				break;
+			case EVR_OUT_TYPE_FP_UNIV:
+				cnt = hw_data->evr_type_data.univ_io;
+				evr_map_reg_start = EVR_REG_FIRST_OUTPUT_FP_UNIV;
+				break;
+			case EVR_OUT_TYPE_TB_OUTPUT:
+				cnt = hw_data->evr_type_data.tb_outputs;
+				evr_map_reg_start = EVR_REG_FIRST_OUTPUT_TB;
+				break;
+			}
 			
-			printk(KERN_ERR "Not supported: evr_type_docd=%d, fw_version=0x%x\n", evr_type_docd, hw_data->fw_version);
-			cleanup(hw_support_data, current_clean);
+			hw_data->out_cfg[otype].res_start = current_res_inx;
+			hw_data->out_cfg[otype].res_count = cnt;
+			hw_data->out_cfg[otype].evr_map_reg_start = evr_map_reg_start;
 			
-			// The HW we got is not supported
-			return -ENOSYS;
+			current_res_inx += cnt;
 		}
 
-		printk(KERN_DEBUG "OK, going on. FW_VERSION: 0x%x, Type: '%s'\n", hw_data->fw_version, hw_data->evr_type_data.name);
-
-		{
-			int otype;
-			int current_res_inx = 0;
-			
-			for(otype = 0; otype < EVR_OUT_TYPE_COUNT; otype ++) {
-				int cnt = 0;
-				u32 evr_map_reg_start = 0;
-
-				switch(otype) {
-				case EVR_OUT_TYPE_FP_TTL:
-					cnt = hw_data->evr_type_data.output_count;
-					evr_map_reg_start = EVR_REG_FIRST_OUTPUT_FP_TTL;
-					break;
-				case EVR_OUT_TYPE_FP_UNIV:
-					cnt = hw_data->evr_type_data.univ_io;
-					evr_map_reg_start = EVR_REG_FIRST_OUTPUT_FP_UNIV;
-					break;
-				case EVR_OUT_TYPE_TB_OUTPUT:
-					cnt = hw_data->evr_type_data.tb_outputs;
-					evr_map_reg_start = EVR_REG_FIRST_OUTPUT_TB;
-					break;
-				}
-				
-				hw_data->out_cfg[otype].res_start = current_res_inx;
-				hw_data->out_cfg[otype].res_count = cnt;
-				hw_data->out_cfg[otype].evr_map_reg_start = evr_map_reg_start;
-				
-				current_res_inx += cnt;
-			}
-
-			hw_data->out_res_count = current_res_inx;
-		}
-		
-		strcpy(hw_support_data->hw_res_defs[0].name, "pulsegen");
-		strcpy(hw_support_data->hw_res_defs[1].name, "output");
-		hw_support_data->hw_res_defs[0].flags = MODAC_RES_FLAG_EXCLUSIVE;
-		hw_support_data->hw_res_defs[1].flags = MODAC_RES_FLAG_EXCLUSIVE;
-		hw_support_data->hw_res_defs[0].suits = pulsegen_suits;
-		hw_support_data->hw_res_defs[1].suits = output_suits;
-		hw_support_data->hw_res_defs[0].count = hw_data->evr_type_data.pulsegen_count;
-		hw_support_data->hw_res_defs[1].count = hw_data->out_res_count;
-		ret = 0;
-		
-		evr_ram_map_init(hw_support_data);
+		hw_data->out_res_count = current_res_inx;
 	}
 	
+	strcpy(hw_support_data->hw_res_defs[0].name, "pulsegen");
+	strcpy(hw_support_data->hw_res_defs[1].name, "output");
+	hw_support_data->hw_res_defs[0].flags = MODAC_RES_FLAG_EXCLUSIVE;
+	hw_support_data->hw_res_defs[1].flags = MODAC_RES_FLAG_EXCLUSIVE;
+	hw_support_data->hw_res_defs[0].suits = pulsegen_suits;
+	hw_support_data->hw_res_defs[1].suits = output_suits;
+	hw_support_data->hw_res_defs[0].count = hw_data->evr_type_data.pulsegen_count;
+	hw_support_data->hw_res_defs[1].count = hw_data->out_res_count;
+	ret = 0;
+	
+	evr_ram_map_init(hw_support_data);
+	
 	return ret;
 }
 	
@@ -658,6 +885,175 @@ static void set_pulse_params(struct modac_hw_support_data *hw_support_data,
 								width);
 }
 
+/*
+ * Returns the EVR_PULSE_CFG_BIT_... bits of the pulsegen in the map_ram item.
+ */
+static u8 map_ram_item_get_cfg(const struct evr_map_ram_item_struct *item,
+							u32 pulse_mask)
+{
+	u8 cfg = 0;
+	
+	if(item->pulse_clear & pulse_mask) {
+		cfg |= (1 << EVR_PULSE_CFG_BIT_CLEAR);
+	}
+	
+	if(item->pulse_set & pulse_mask) {
+		cfg |= (1 << EVR_PULSE_CFG_BIT_SET);
+	}
+	
+	if(item->pulse_trigger & pulse_mask) {
+		cfg |= (1 << EVR_PULSE_CFG_BIT_TRIGGER);
+	}
+	
+	return cfg;
+}
+
+/*
+ * Sets the EVR_PULSE_CFG_BIT_... bits of the pulsegen in the map_ram item.
+ * Returns nonzero if the item changed.
+ */
+static int map_ram_item_set_cfg(struct evr_map_ram_item_struct *item,
+							u32 pulse_mask, u8 cfg)
+{
+	u32 clr32_old = item->pulse_clear;
+	u32 set32_old = item->pulse_set;
+	u32 trg32_old = item->pulse_trigger;
+	
+	if(cfg & (1 << EVR_PULSE_CFG_BIT_CLEAR)) {
+		item->pulse_clear |= pulse_mask;
+	} else {
+		item->pulse_clear &= (~pulse_mask);
+	}
+	
+	if(cfg & (1 << EVR_PULSE_CFG_BIT_SET)) {
+		item->pulse_set |= pulse_mask;
+	} else {
+		item->pulse_set &= (~pulse_mask);
+	}
+	
+	if(cfg & (1 << EVR_PULSE_CFG_BIT_TRIGGER)) {
+		item->pulse_trigger |= pulse_mask;
+	} else {
+		item->pulse_trigger &= (~pulse_mask);
+	}
+	
+	return item->pulse_clear != clr32_old || item->pulse_set != set32_old || 
+						item->pulse_trigger != trg32_old;
+}
+
+/*
+ * Returns the configuration transaction if it is open by the vdev_des,
+ * NULL otherwise.
+ */
+static struct evr_config_txn *config_txn_get(struct evr_hw_data *hw_data,
+							struct modac_vdev_des *vdev_des)
+{
+	struct evr_config_txn *txn = hw_data->txn;
+	
+	if(txn == NULL || vdev_des == NULL || txn->owner != vdev_des) {
+		return NULL;
+	}
+	
+	return txn;
+}
+
+static int config_txn_begin(struct evr_hw_data *hw_data,
+							struct modac_vdev_des *vdev_des)
+{
+	struct evr_config_txn *txn;
+	
+	if(hw_data->txn != NULL) {
+		return (hw_data->txn->owner == vdev_des) ? -EINVAL : -EBUSY;
+	}
+	
+	txn = kzalloc(sizeof(struct evr_config_txn), GFP_KERNEL);
+	if(txn == NULL) {
+		return -ENOMEM;
+	}
+	
+	txn->owner = vdev_des;
+	hw_data->txn = txn;
+	
+	return 0;
+}
+
+static void config_txn_end(struct evr_hw_data *hw_data)
+{
+	kfree(hw_data->txn);
+	hw_data->txn = NULL;
+}
+
+/*
+ * Writes the staged configuration to the HW. The pulsegen registers go 
+ * first, then all the MapRam changes with one flush (bank switch).
+ */
+static int config_txn_commit(struct modac_hw_support_data *hw_support_data,
+							struct evr_config_txn *txn)
+{
+	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
+	int ipulse;
+	
+	for(ipulse = 0; ipulse < EVR_MAX_PULSEGEN_COUNT; ipulse ++) {
+		
+		int pulse_start_reg = EVR_REG_PULSES + EVR_REG_PULSE_SLOT_SIZE * ipulse;
+		
+		if(txn->param_staged & (1 << ipulse)) {
+			set_pulse_params(hw_support_data, pulse_start_reg,
+					txn->pulsegen[ipulse].prescaler,
+					txn->pulsegen[ipulse].delay,
+					txn->pulsegen[ipulse].width);
+		}
+		
+		if(txn->pctrl_staged & (1 << ipulse)) {
+			evr_write32(hw_support_data, 
+						pulse_start_reg + EVR_REG_PULSE_CTRL_OFFSET, 
+						txn->pulsegen[ipulse].pctrl);
+		}
+	}
+	
+	if(txn->map_staged) {
+		
+		int i;
+		
+		for(i = EVRMA_FIFO_MIN_EVENT_CODE; i <= EVRMA_FIFO_MAX_EVENT_CODE; i ++) {
+			
+			int changed = 0;
+			
+			for(ipulse = 0; ipulse < EVR_MAX_PULSEGEN_COUNT; ipulse ++) {
+				if(txn->map_staged & (1 << ipulse)) {
+					changed |= map_ram_item_set_cfg(&hw_data->map_ram[i],
+							(1 << ipulse), txn->map[ipulse][i]);
+				}
+			}
+			
+			if(changed) {
+				evr_map_ram_dirty(hw_data, i);
+			}
+		}
+		
+		// the changes must be written to HW
+		evr_ram_map_change_flush(hw_support_data);
+	}
+	
+	return 0;
+}
+
+/*
+ * Forgets whatever was staged for the pulsegen (it is being initialized).
+ */
+static void config_txn_drop_pulsegen(struct evr_hw_data *hw_data, int res_index)
+{
+	u32 pulse_inv_mask = (~(1 << res_index));
+	
+	if(hw_data->txn == NULL) {
+		return;
+	}
+	
+	hw_data->txn->param_staged &= pulse_inv_mask;
+	hw_data->txn->pctrl_staged &= pulse_inv_mask;
+	hw_data->txn->map_staged &= pulse_inv_mask;
+}
+
 
 
 static long hw_support_evr_direct_ioctl(struct modac_hw_support_data *hw_support_data, 
@@ -673,9 +1069,7 @@ static long hw_support_evr_direct_ioctl(struct modac_hw_support_data *hw_support
 	{
 		u32 val;
 
-		val = evr_read32(hw_support_data, EVR_REG_CTRL);
-		val |= (1 << C_EVR_CTRL_LATCH_TIMESTAMP);
-		evr_write32(hw_support_data, EVR_REG_CTRL, val);
+		evr_ctrl_modify(hw_support_data, 0, 1 << C_EVR_CTRL_LATCH_TIMESTAMP);
 		
 		val = evr_read32(hw_support_data, EVR_REG_TIMESTAMP_LATCH);
 
@@ -733,6 +1127,7 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 				unsigned int cmd, unsigned long arg)
 {
 	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
+	struct evr_config_txn *txn = config_txn_get(hw_data, vdev_des);
 	int ret;
 	
 	int evr_pulsegen_count = hw_support_data->hw_res_defs[EVR_RES_TYPE_PULSEGEN].count;
@@ -748,6 +1143,9 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 		int otype;
 		int ipulse;
 		
+		// whatever happened to the HW before, read it again
+		evr_shadow_invalidate_all(hw_data);
+		
 		/*
 		 * Set all outputs to low state.
 		 */
@@ -816,22 +1214,15 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 				return -EINVAL;
 			}
 			
-			if(hw_data->sim != NULL) {
-				ret = evr_sim_set_output_to_pulsegen(hw_data, 
-						res_output->index,
-						res_pulsegen->index);
-			} else {
-				
-				if(res_pulsegen->index < 0 || res_pulsegen->index >= evr_pulsegen_count) {
-					// Sanity check. These values would mean a bug in the program.
-					return -EINVAL;
-				}
-			
-				ret = evr_set_out_map(hw_support_data, 
-						res_output->index,
-						// pulsegen functions start from the func=0
-						0 + res_pulsegen->index);
+			if(res_pulsegen->index < 0 || res_pulsegen->index >= evr_pulsegen_count) {
+				// Sanity check. These values would mean a bug in the program.
+				return -EINVAL;
 			}
+		
+			ret = evr_set_out_map(hw_support_data, 
+					res_output->index,
+					// pulsegen functions start from the func=0
+					0 + res_pulsegen->index);
 			
 		} else if(res_pulsegen->type == MODAC_RES_TYPE_NONE) {
 
@@ -842,16 +1233,9 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 				return -EINVAL;
 			}
 			
-			if(hw_data->sim != NULL) {
-				ret = evr_sim_set_output_to_misc_func(hw_data, 
-						res_output->index,
-						set_args.misc_func);
-			} else {
-
-				ret = evr_set_out_map(hw_support_data, 
-						res_output->index,
-						set_args.misc_func);
-			}
+			ret = evr_set_out_map(hw_support_data, 
+					res_output->index,
+					set_args.misc_func);
 		} else {
 			// must be a pulsegen or undefined
 			return -EINVAL;
@@ -877,6 +1261,33 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 		ret = 0;
 		break;
 	}
+	
+	case VEVR_IOC_CONFIG_BEGIN:
+	{
+		if(vdev_des == NULL) {
+			return -EINVAL;
+		}
+		
+		ret = config_txn_begin(hw_data, vdev_des);
+		break;
+	}
+	
+	case VEVR_IOC_CONFIG_COMMIT:
+	case VEVR_IOC_CONFIG_ABORT:
+	{
+		if(txn == NULL) {
+			// no transaction open by this VIRT_DEV
+			return -EINVAL;
+		}
+		
+		ret = 0;
+		if(cmd == VEVR_IOC_CONFIG_COMMIT) {
+			ret = config_txn_commit(hw_support_data, txn);
+		}
+		
+		config_txn_end(hw_data);
+		break;
+	}
 		
 	case VEVR_IOC_PULSE_PARAM_SET:
 	case VEVR_IOC_PULSE_PARAM_GET:
@@ -898,20 +1309,19 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 			}
 		}
 		
-		if(hw_data->sim != NULL) {
-			if(reading) {
-				ret = evr_sim_get_pulsegen_param(hw_data, 
-						res_pulsegen->index,
-						&pulse_param_args.prescaler,
-						&pulse_param_args.delay,
-						&pulse_param_args.width);
-			} else {
-				ret = evr_sim_set_pulsegen_param(hw_data, 
-						res_pulsegen->index,
-						pulse_param_args.prescaler,
-						pulse_param_args.delay,
-						pulse_param_args.width);
-			}
+		if(txn != NULL && (res_pulsegen->index < 0 || 
+						res_pulsegen->index >= EVR_MAX_PULSEGEN_COUNT)) {
+			// Sanity check. These values would mean a bug in the program.
+			return -EINVAL;
+		}
+		
+		if(reading && txn != NULL && 
+						(txn->param_staged & (1 << res_pulsegen->index))) {
+			
+			pulse_param_args.prescaler = txn->pulsegen[res_pulsegen->index].prescaler;
+			pulse_param_args.delay = txn->pulsegen[res_pulsegen->index].delay;
+			pulse_param_args.width = txn->pulsegen[res_pulsegen->index].width;
+			
 		} else {
 			
 			const struct evr_pulsegen_bit_info *pulsegen_bit_info;
@@ -950,11 +1360,18 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 					return -EINVAL;
 				}
 				
-				set_pulse_params(hw_support_data,
-						pulse_start_reg,
-						pulse_param_args.prescaler, 
-						pulse_param_args.delay, 
-						pulse_param_args.width);
+				if(txn != NULL) {
+					txn->pulsegen[res_pulsegen->index].prescaler = pulse_param_args.prescaler;
+					txn->pulsegen[res_pulsegen->index].delay = pulse_param_args.delay;
+					txn->pulsegen[res_pulsegen->index].width = pulse_param_args.width;
+					txn->param_staged |= (1 << res_pulsegen->index);
+				} else {
+					set_pulse_params(hw_support_data,
+							pulse_start_reg,
+							pulse_param_args.prescaler, 
+							pulse_param_args.delay, 
+							pulse_param_args.width);
+				}
 			}
 		}
 
@@ -985,11 +1402,6 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 			return -EINVAL;
 		}
 		
-		if(hw_data->sim != NULL) {
-			// not supported on the test simulation
-			return -ENOSYS;
-		}
-		
 		if(res_pulsegen->index < 0 || res_pulsegen->index >= evr_pulsegen_count) {
 			// Sanity check. These values would mean a bug in the program.
 			return -EINVAL;
@@ -1004,7 +1416,11 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 		
 		pulse_start_reg = EVR_REG_PULSES + EVR_REG_PULSE_SLOT_SIZE * res_pulsegen->index;
 		
-		pctrl = evr_read32(hw_support_data, pulse_start_reg + EVR_REG_PULSE_CTRL_OFFSET);
+		if(txn != NULL && (txn->pctrl_staged & (1 << res_pulsegen->index))) {
+			pctrl = txn->pulsegen[res_pulsegen->index].pctrl;
+		} else {
+			pctrl = evr_read32(hw_support_data, pulse_start_reg + EVR_REG_PULSE_CTRL_OFFSET);
+		}
 		
 		if(reading) {
 			
@@ -1058,8 +1474,13 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 				pctrl &= ~(1 << C_EVR_PULSE_MAP_TRIG_ENA);
 			}
 			
-			evr_write32(hw_support_data, 
+			if(txn != NULL) {
+				txn->pulsegen[res_pulsegen->index].pctrl = pctrl;
+				txn->pctrl_staged |= (1 << res_pulsegen->index);
+			} else {
+				evr_write32(hw_support_data, 
 							pulse_start_reg + EVR_REG_PULSE_CTRL_OFFSET, pctrl);
+			}
 		}
 		
 		ret = 0;
@@ -1086,19 +1507,14 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 										EVR_EVENT_CODES : 1;
 		int i;
 		u8 *map;
+		u8 *txn_map = NULL;
+		u32 pulse_mask;
 		
 		if(res_pulsegen->type != EVR_RES_TYPE_PULSEGEN) {
 			// must be a defined pulsegen
 			return -EINVAL;
 		}
 		
-		if(hw_data->sim != NULL) {
-			// not supported on the test simulation
-			return -ENOSYS;
-		}
-		
-		// a real EVR (not the sim)
-		
 		
 		if(event_count == 1) {
 			
@@ -1136,49 +1552,43 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 			return -EINVAL;
 		}
 		
+		pulse_mask = (1 << res_pulsegen->index);
+		
+		if(txn != NULL && !(txn->map_staged & pulse_mask)) {
+			
+			if(!reading) {
+				// stage the whole map of the pulsegen, starting from the current
+				for(i = EVRMA_FIFO_MIN_EVENT_CODE; i <= EVRMA_FIFO_MAX_EVENT_CODE; i ++) {
+					txn->map[res_pulsegen->index][i] = 
+						map_ram_item_get_cfg(&hw_data->map_ram[i], pulse_mask);
+				}
+				txn->map_staged |= pulse_mask;
+				txn_map = txn->map[res_pulsegen->index];
+			}
+		} else if(txn != NULL) {
+			txn_map = txn->map[res_pulsegen->index];
+		}
+		
 		for(i = 0; i < event_count; i ++) {
 			
-			u32 pulse_mask = (1 << res_pulsegen->index);
-			u32 *clr32, *set32, *trg32;
+			struct evr_map_ram_item_struct *item = 
+								&hw_data->map_ram[event_first + i];
 			
-			clr32 = &hw_data->map_ram[event_first + i].pulse_clear;
-			set32 = &hw_data->map_ram[event_first + i].pulse_set;
-			trg32 = &hw_data->map_ram[event_first + i].pulse_trigger;
-
-			if(reading) {
-				map[i] = 0;
-				
-				if(*clr32 & pulse_mask) {
-					map[i] |= (1 << EVR_PULSE_CFG_BIT_CLEAR);
-				}
-				
-				if(*set32 & pulse_mask) {
-					map[i] |= (1 << EVR_PULSE_CFG_BIT_SET);
-				}
-				
-				if(*trg32 & pulse_mask) {
-					map[i] |= (1 << EVR_PULSE_CFG_BIT_TRIGGER);
-				}
-				
-			} else {
-				
-				if(map[i] & (1 << EVR_PULSE_CFG_BIT_CLEAR)) {
-					*clr32 |= pulse_mask;
-				} else {
-					*clr32 &= (~pulse_mask);
-				}
+			if(txn_map != NULL) {
 				
-				if(map[i] & (1 << EVR_PULSE_CFG_BIT_SET)) {
-					*set32 |= pulse_mask;
+				if(reading) {
+					map[i] = txn_map[event_first + i];
 				} else {
-					*set32 &= (~pulse_mask);
+					txn_map[event_first + i] = map[i] & 
+							((1 << EVR_PULSE_CFG_BIT_CLEAR) |
+							(1 << EVR_PULSE_CFG_BIT_SET) |
+							(1 << EVR_PULSE_CFG_BIT_TRIGGER));
 				}
 				
-				if(map[i] & (1 << EVR_PULSE_CFG_BIT_TRIGGER)) {
-					*trg32 |= pulse_mask;
-				} else {
-					*trg32 &= (~pulse_mask);
-				}
+			} else if(reading) {
+				map[i] = map_ram_item_get_cfg(item, pulse_mask);
+			} else if(map_ram_item_set_cfg(item, pulse_mask, map[i])) {
+				evr_map_ram_dirty(hw_data, event_first + i);
 			}
 			
 			ret = 0;
@@ -1200,7 +1610,7 @@ static long hw_support_evr_ioctl(struct modac_hw_support_data *hw_support_data,
 					return -EFAULT;
 				}
 			}
-		} else {
+		} else if(txn_map == NULL) {
 			// the changes must be written to HW
 			evr_ram_map_change_flush(hw_support_data);
 		}
@@ -1232,25 +1642,29 @@ static int hw_support_evr_init_res(struct modac_hw_support_data *hw_support_data
 {
 	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
 	
-	if(hw_data->sim != NULL) {
-		return evr_sim_init_res(hw_data, res_type, res_index);
-	}
-
 	if(res_type == EVR_RES_TYPE_PULSEGEN) {
 		
 		int pulse_start_reg = EVR_REG_PULSES + EVR_REG_PULSE_SLOT_SIZE * res_index;
 		int i;
 		u32 pulse_inv_mask = (~(1 << res_index));
 		
+		config_txn_drop_pulsegen(hw_data, res_index);
+		
 		set_pulse_params(hw_support_data, pulse_start_reg, 0, 0, 0);
 		
 		evr_write32(hw_support_data, 
 					pulse_start_reg + EVR_REG_PULSE_CTRL_OFFSET, 0);
 		
 		for(i = EVRMA_FIFO_MIN_EVENT_CODE; i <= EVRMA_FIFO_MAX_EVENT_CODE; i ++) {
-			hw_data->map_ram[i].pulse_clear &= pulse_inv_mask;
-			hw_data->map_ram[i].pulse_set &= pulse_inv_mask;
-			hw_data->map_ram[i].pulse_trigger &= pulse_inv_mask;
+			struct evr_map_ram_item_struct *item = &hw_data->map_ram[i];
+			
+			if((item->pulse_clear | item->pulse_set | item->pulse_trigger) & 
+					~pulse_inv_mask) {
+				item->pulse_clear &= pulse_inv_mask;
+				item->pulse_set &= pulse_inv_mask;
+				item->pulse_trigger &= pulse_inv_mask;
+				evr_map_ram_dirty(hw_data, i);
+			}
 		}
 		
 		// the changes must be written to HW
@@ -1267,6 +1681,17 @@ static int hw_support_evr_init_res(struct modac_hw_support_data *hw_support_data
 	return 0;
 }
 
+static void hw_support_evr_on_vdev_close(struct modac_hw_support_data *hw_support_data,
+				struct modac_vdev_des *vdev_des)
+{
+	struct evr_hw_data *hw_data = (struct evr_hw_data *)hw_support_data->priv;
+	
+	// a transaction that was not committed is dropped
+	if(config_txn_get(hw_data, vdev_des) != NULL) {
+		config_txn_end(hw_data);
+	}
+}
+
 struct modac_hw_support_def hw_support_evr = {
 	hw_name: MODAC_HW_EVR_ID,
 	init: hw_support_evr_init,
@@ -1276,6 +1701,7 @@ struct modac_hw_support_def hw_support_evr = {
 	direct_ioctl: hw_support_evr_direct_ioctl,
 	on_subscribe_change: hw_support_evr_on_subscribe_change,
 	init_res: hw_support_evr_init_res,
+	on_vdev_close: hw_support_evr_on_vdev_close,
 	vdev_mmap_ro: hw_support_evr_vdev_mmap_ro,
 	store_dbg: hw_support_evr_store_dbg,
 	show_dbg: hw_support_evr_show_dbg,
@@ -86,6 +86,13 @@ struct modac_hw_support_def {
 	int (*init_res)(struct modac_hw_support_data *hw_support_data,
 				int res_type, int res_index);
 	
+	/**
+	 * Called when the VIRT_DEV is closed by the last application, before
+	 * its resources are initialized. Can be NULL.
+	 */
+	void (*on_vdev_close)(struct modac_hw_support_data *hw_support_data,
+				struct modac_vdev_des *vdev_des);
+	
 	/**
 	 * Called when the system interrupt for the MODAC device occurs.
 	 * Must be provided.
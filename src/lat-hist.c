@@ -0,0 +1,63 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'evrmaDriver'.
+// It is subject to the license terms in the LICENSE.txt file found in the 
+// top-level directory of this distribution and at: 
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html. 
+// No part of 'evrmaDriver', including this file, 
+// may be copied, modified, propagated, or distributed except according to 
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+
+#include "internal.h"
+#include "lat-hist.h"
+
+void lat_hist_add(struct lat_hist *hist, u32 stamp, u32 now)
+{
+	u32 ns;
+	
+	if(stamp == 0)
+		return;
+	
+	/* modulo 2^32, see lat_stamp */
+	ns = now - stamp;
+	
+	hist->count ++;
+	hist->total_ns += ns;
+	if(ns > hist->max_ns)
+		hist->max_ns = ns;
+	hist->buckets[ns ? ilog2(ns) : 0] ++;
+}
+
+void lat_hist_reset(struct lat_hist *hist)
+{
+	memset(hist, 0, sizeof(struct lat_hist));
+}
+
+ssize_t lat_hist_show(char *buf, ssize_t n, const char *name, 
+		const struct lat_hist *hist)
+{
+	ssize_t n0 = n;
+	int i;
+	
+	n += scnprintf(buf + n, PAGE_SIZE - n, 
+			"%s: count=%u avg_ns=%llu max_ns=%u", name, hist->count,
+			hist->count ? div_u64(hist->total_ns, hist->count) : 0,
+			hist->max_ns);
+	
+	/* only the non-empty buckets as '<lower bound in ns>:<count>' */
+	for(i = 0; i < LAT_HIST_BUCKETS; i ++) {
+		if(hist->buckets[i] != 0) {
+			n += scnprintf(buf + n, PAGE_SIZE - n, " %lu:%u", 
+					i ? (1UL << i) : 0UL, hist->buckets[i]);
+		}
+	}
+	
+	n += scnprintf(buf + n, PAGE_SIZE - n, "\n");
+	
+	return n - n0;
+}
@@ -0,0 +1,55 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'evrmaDriver'.
+// It is subject to the license terms in the LICENSE.txt file found in the 
+// top-level directory of this distribution and at: 
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html. 
+// No part of 'evrmaDriver', including this file, 
+// may be copied, modified, propagated, or distributed except according to 
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+#ifndef MODAC_LAT_HIST_H_
+#define MODAC_LAT_HIST_H_
+
+#include <linux/ktime.h>
+
+/*
+ * The latency stamps are the lower 32 bits of the ktime in ns (they wrap 
+ * after ~4.3 s, the differences are still correct for any shorter latency).
+ * Zero means 'not stamped', i.e. the measurement was off when the event
+ * arrived.
+ */
+static inline u32 lat_stamp(void)
+{
+	return (u32)ktime_to_ns(ktime_get()) | 1;
+}
+
+/* 
+ * Bucket 'i' counts the latencies in [2^i, 2^(i+1)) ns, the bucket 0 
+ * also counts 0.
+ */
+#define LAT_HIST_BUCKETS 32
+
+/*
+ * A log2 latency histogram. Updated without locking, the values are
+ * informative only.
+ */
+struct lat_hist {
+	u32 count;
+	u32 max_ns;
+	u64 total_ns;
+	u32 buckets[LAT_HIST_BUCKETS];
+};
+
+/* Adds the latency since the 'stamp' (if non-zero) taken at 'now'. */
+void lat_hist_add(struct lat_hist *hist, u32 stamp, u32 now);
+
+void lat_hist_reset(struct lat_hist *hist);
+
+/* 
+ * Prints one line starting with the 'name' to the sysfs 'buf' at offset
+ * 'n'. Returns the number of characters printed.
+ */
+ssize_t lat_hist_show(char *buf, ssize_t n, const char *name, 
+		const struct lat_hist *hist);
+
+#endif /* MODAC_LAT_HIST_H_ */
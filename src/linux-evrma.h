@@ -12,8 +12,6 @@
 
 #include "linux-modac.h"
 
-//## #define DBG_MEASURE_TIME_FROM_IRQ_TO_USER
-
 
 /** @file */
 
@@ -241,6 +239,17 @@ struct vevr_ioctl_status {
 	struct vevr_status status;
 };
 
+/**
+ * The data for the VEVR_IOC_CONFIG_BEGIN, VEVR_IOC_CONFIG_COMMIT and
+ * VEVR_IOC_CONFIG_ABORT IOCTL calls.
+ */
+struct vevr_ioctl_config {
+    /**
+	 * Not used and must be set to MODAC_RES_TYPE_NONE.
+	 */
+	struct vdev_ioctl_hw_header header;
+};
+
 
 /**
  * Sets the parameters of the pulse generator. 
@@ -295,6 +304,33 @@ struct vevr_ioctl_status {
  */
 #define VEVR_IOC_STATUS_GET	\
 	_IOWR(VIRT_DEV_IOC_MAGIC, VIRT_DEV_HW_IOC_MIN + 8, struct vevr_ioctl_status)
+
+/**
+ * Starts a configuration transaction on the VEVR. Until the
+ * VEVR_IOC_CONFIG_COMMIT the VEVR_IOC_PULSE_PARAM_SET, VEVR_IOC_PULSE_PROP_SET
+ * and VEVR_IOC_PULSE_MAP_RAM_SET... calls are only staged (the ..._GET calls
+ * return the staged values) and nothing is written to the HW.
+ * 
+ * Only one transaction can be open on the EVR at a time; -EBUSY is returned
+ * if another VEVR has one open. The transaction is aborted if the VEVR
+ * is closed without a commit.
+ */
+#define VEVR_IOC_CONFIG_BEGIN	\
+	_IOW(VIRT_DEV_IOC_MAGIC, VIRT_DEV_HW_IOC_MIN + 9, struct vevr_ioctl_config)
+
+/**
+ * Writes the configuration staged since VEVR_IOC_CONFIG_BEGIN to the HW.
+ * The pulse generator registers are written first, then all the MAP RAM
+ * changes are applied with a single MAP RAM bank switch.
+ */
+#define VEVR_IOC_CONFIG_COMMIT	\
+	_IOW(VIRT_DEV_IOC_MAGIC, VIRT_DEV_HW_IOC_MIN + 10, struct vevr_ioctl_config)
+
+/**
+ * Discards the configuration staged since VEVR_IOC_CONFIG_BEGIN.
+ */
+#define VEVR_IOC_CONFIG_ABORT	\
+	_IOW(VIRT_DEV_IOC_MAGIC, VIRT_DEV_HW_IOC_MIN + 11, struct vevr_ioctl_config)
 	
 /**
  * Reads the value of the latched timestamp. This call is direct (no mutex
@@ -332,16 +368,64 @@ struct evr_data_buff_slot_data {
 	uint32_t data[512];
 };
 
+/**
+ * One slot of the DataBuf ring.
+ * 
+ * The slot is written seqlock-style. The writer first sets 'seq_begin' to the
+ * sequence number of the new message, then writes the data and sets 'seq_end'
+ * to the same value at last. A consumer reads 'seq_end', copies the data and
+ * reads 'seq_begin' (with the read barriers in between). The copy is
+ * consistent if both are equal to the expected sequence number. Otherwise
+ * the slot was overwritten in the meantime.
+ */
+struct evr_data_buff_ring_slot {
+	/**
+	 * The sequence number of the message, set before the data is written.
+	 */
+	uint32_t seq_begin;
+	/**
+	 * The sequence number of the message, set after the data is written.
+	 */
+	uint32_t seq_end;
+	/**
+	 * The DataBuf message.
+	 */
+	struct evr_data_buff_slot_data data;
+};
+
 /**
  * The memory mapped region definition for the VEVR.
  */
 struct vevr_mmap_data {
 	
 	/**
-	 * Only one slot of DataBuf data is stored here. It is assumed the data
-	 * will be read by the application before the next data arrives.
+	 * The last DataBuf message. It is overwritten in place with each new 
+	 * message so it is assumed the data will be read by the application
+	 * before the next data arrives. Use the 'dbuf_ring' to avoid that.
+	 * 
+	 * Not written when the 'dbuf_ring' is used (dbuf_ring_slot_count > 0);
+	 * the messages are then only found in the ring slots named by the
+	 * EVRMA_EVENT_DBUF_DATA events.
 	 */
 	struct evr_data_buff_slot_data data_buff;
+	
+	/**
+	 * The number of slots in the 'dbuf_ring'. Zero if the ring is not used
+	 * (set by the 'dbuf_ring_slots' module parameter).
+	 */
+	uint32_t dbuf_ring_slot_count;
+	
+	/**
+	 * The sequence number of the last message written to the 'dbuf_ring'.
+	 * The sequence numbers start with 1 and the message with the sequence 
+	 * number 'seq' is in the slot 'seq % dbuf_ring_slot_count'.
+	 */
+	uint32_t dbuf_ring_sequence;
+	
+	/**
+	 * The ring of the recent DataBuf messages.
+	 */
+	struct evr_data_buff_ring_slot dbuf_ring[];
 };
 	
 	
@@ -385,10 +469,26 @@ struct vevr_mmap_data {
 #define EVRMA_EVENT_DELAYED_IRQ		0x104
 
 /**
- * Data buffer event.
+ * Data buffer event. If the DataBuf ring is used (see struct vevr_mmap_data)
+ * the struct evr_data_dbuf_event is attached, no data otherwise.
  */
 #define EVRMA_EVENT_DBUF_DATA		0x105
 
+/**
+ * The data attached to the EVRMA_EVENT_DBUF_DATA event if the DataBuf
+ * ring is used.
+ */
+struct evr_data_dbuf_event {
+	/**
+	 * The index of the slot in the vevr_mmap_data 'dbuf_ring'.
+	 */
+	uint32_t slot;
+	/**
+	 * The sequence number of the message in the slot.
+	 */
+	uint32_t sequence;
+};
+
 /**
  * The data attached to the Event FIFO event codes.
  */
@@ -401,10 +501,36 @@ struct evr_data_fifo_event {
 	 * The read value of the FIFO Timestamp Register.
 	 */
 	uint32_t timestamp;
-	
-#ifdef DBG_MEASURE_TIME_FROM_IRQ_TO_USER
-	uint32_t dbg_timestamp[5];
-#endif
+};
+
+/**
+ * The data attached to the Event FIFO event codes for the VIRT_DEVs created
+ * with the MNG_DEV_VDEV_CREATE_FLAG_EXT_DATA. It starts with the 
+ * struct evr_data_fifo_event.
+ */
+struct evr_data_fifo_event_ext {
+	/**
+	 * The read value of the FIFO Seconds Register.
+	 */
+	uint32_t seconds;
+	/**
+	 * The read value of the FIFO Timestamp Register.
+	 */
+	uint32_t timestamp;
+	/**
+	 * The EVR time in ns: seconds * 10^9 + timestamp converted from the 
+	 * event clock ticks (using the USEC_DIV register). If the timestamp 
+	 * counter wraps (it is not reset by the seconds) the wraps are counted 
+	 * for as long as the seconds stay the same; a wrap can only be noticed
+	 * if at least one event arrives in each wrap period. 0 if the event 
+	 * clock is not known.
+	 */
+	uint64_t evr_time_ns;
+	/**
+	 * The CLOCK_MONOTONIC time in ns taken when the interrupt that read
+	 * the event was entered.
+	 */
+	uint64_t irq_ktime_ns;
 };
 
 /** @} */
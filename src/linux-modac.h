@@ -90,6 +90,72 @@ struct mngdev_ioctl_vdev_ids {
 	char name[MODAC_ID_MAX_NAME + 1];
 };
 
+/**
+ * @short The default depth of the VIRT_DEV event queue.
+ */
+#define MODAC_VDEV_QUEUE_DEPTH_DEFAULT 1024
+/**
+ * @short The minimal depth of the VIRT_DEV event queue.
+ */
+#define MODAC_VDEV_QUEUE_DEPTH_MIN 64
+/**
+ * @short The maximal depth of the VIRT_DEV event queue.
+ */
+#define MODAC_VDEV_QUEUE_DEPTH_MAX (1 << 20)
+
+/**
+ * The data for the MNG_DEV_IOC_CREATE_EXT IOCTL call.
+ */
+struct mngdev_ioctl_vdev_create {
+	/**
+	 * Unique VIRT_DEV id for further reference (1..31), 0 for auto choosing.
+	 */
+	uint8_t id;
+	/**
+	 * the device name
+	 */
+	char name[MODAC_ID_MAX_NAME + 1];
+	/**
+	 * The depth of the event queue (the max. number of queued events). Must 
+	 * be a power of 2 between MODAC_VDEV_QUEUE_DEPTH_MIN and 
+	 * MODAC_VDEV_QUEUE_DEPTH_MAX; 0 for MODAC_VDEV_QUEUE_DEPTH_DEFAULT.
+	 */
+	uint32_t queue_depth;
+	/**
+	 * MNG_DEV_VDEV_CREATE_FLAG_... or 0.
+	 */
+	uint32_t flags;
+};
+
+/**
+ * @short The event queue entries carry up to 28 bytes of data instead of 12.
+ * 
+ * The HW specific events may attach more data (see linux-evrma.h). The
+ * other VIRT_DEVs get the same data as without this flag.
+ */
+#define MNG_DEV_VDEV_CREATE_FLAG_EXT_DATA	0x1
+
+/**
+ * @short The events are taken from the MNG_DEV's event log instead of being
+ * copied into the VIRT_DEV's own event queue.
+ * 
+ * The MNG_DEV writes each event only once into its event log, no matter how
+ * many VIRT_DEVs are subscribed to it. Such a VIRT_DEV only keeps a read
+ * position (a cursor) into the log per queue and read() skips the events
+ * it is not subscribed to (or that are filtered out for the open file, see
+ * VIRT_DEV_IOC_PRIVATE_QUEUE). The log can also be mmap-ed read-only (see
+ * VIRT_DEV_MMAP_OFFSET_EVENT_LOG) and consumed from the user space.
+ * 
+ * The log entries always carry the extended data, the read() returns it
+ * only with MNG_DEV_VDEV_CREATE_FLAG_EXT_DATA (the regular data otherwise). The log is never
+ * blocked by a slow reader; a reader whose unread events fall more than 
+ * the depth of the log behind loses them and gets a 
+ * MODAC_EVENT_READ_OVERFLOW. The events the reader is not subscribed to 
+ * never cause that.
+ * The VIRT_DEV_MMAP_OFFSET_EVENT_RING can't be used with such a VIRT_DEV.
+ */
+#define MNG_DEV_VDEV_CREATE_FLAG_EVENT_LOG	0x2
+
 /**
  * The data for the MNG_DEV_IOC_DESTROY IOCTL call.
  */
@@ -169,8 +235,14 @@ struct mngdev_config {
 #define MNG_DEV_IOC_CONFIG \
 		_IOWR(MNG_DEV_IOC_MAGIC, 5, struct mngdev_config)
 
+/**
+ * Creates a new virtual EVR. The same as MNG_DEV_IOC_CREATE with additional
+ * settings in the struct mngdev_ioctl_vdev_create.
+ */
+#define MNG_DEV_IOC_CREATE_EXT		_IOW(MNG_DEV_IOC_MAGIC, 6, struct mngdev_ioctl_vdev_create)
+
 
-#define MNG_DEV_IOC_MAX  		5
+#define MNG_DEV_IOC_MAX  		6
 
 
 
@@ -196,6 +268,35 @@ struct mngdev_config {
 #define MNG_DEV_DBG_IOC_MAX  		240
 
 
+/* ---------- sysfs ------------ */
+
+/**
+ * @short The number of the event codes counted by the MNG_DEV.
+ */
+#define MODAC_EVENT_STATS_COUNT 512
+
+/**
+ * The statistics of one event code. The MNG_DEV sysfs binary attribute 
+ * 'events_bin' holds MODAC_EVENT_STATS_COUNT of these, indexed by the 
+ * event code.
+ */
+struct modac_event_stats {
+	/**
+	 * The number of the events since the MNG_DEV was created (wraps around).
+	 */
+	uint32_t total;
+	/**
+	 * Events per second over the last second.
+	 */
+	uint32_t rate_1s;
+	/**
+	 * Events per second over the last 10 seconds.
+	 */
+	uint32_t rate_10s;
+	uint32_t reserved;
+};
+
+
 
 
 
@@ -262,6 +363,11 @@ struct vdev_ioctl_status {
 	 * the device name
 	 */
 	char name[MODAC_ID_MAX_NAME + 1];
+	
+	/**
+	 * The depth of the event queue as set when the VIRT_DEV was created.
+	 */
+	uint32_t queue_depth;
 };
 
 /**
@@ -278,6 +384,186 @@ struct vdev_ioctl_res_status {
 	int count;
 };
 
+/**
+ * @short The max. number of bytes one read() of a VIRT_DEV returns.
+ * 
+ * A longer buffer is only filled up to this length; the rest of the events
+ * is returned by the next read(). This bounds the time the readers of one 
+ * queue wait for each other.
+ */
+#define VIRT_DEV_READ_MAX_LEN (32 * 1024)
+
+/**
+ * The formats of the data returned by read().
+ */
+enum {
+	/**
+	 * The default. Each event is returned as a 16-bit event followed by
+	 * its data (the length of data depends on the event).
+	 */
+	VIRT_DEV_READ_FORMAT_PACKED,
+	/**
+	 * Each event is returned as a whole struct modac_event_ring_entry, 
+	 * 'entry_size' bytes long, the same as found in the mmap-ed event ring.
+	 * This allows the kernel to copy the queue in bulk.
+	 */
+	VIRT_DEV_READ_FORMAT_RING_ENTRIES
+};
+
+/**
+ * The data for the VIRT_DEV_IOC_READ_FORMAT_SET IOCTL call.
+ */
+struct vdev_ioctl_read_format {
+	/**
+	 * One of VIRT_DEV_READ_FORMAT_...
+	 */
+	uint32_t format;
+	/**
+	 * Returned: the size of one entry in the VIRT_DEV_READ_FORMAT_RING_ENTRIES
+	 * format.
+	 */
+	uint32_t entry_size;
+};
+
+/**
+ * The number of 32-bit words in an event bitmap. Event 'e' is represented
+ * by the bit (e % 32) of the word (e / 32); event codes 0...511 are covered.
+ */
+#define VIRT_DEV_EVENT_BITMAP_WORDS 16
+
+/**
+ * The data for the VIRT_DEV_IOC_WAKEUP_POLICY_SET IOCTL call.
+ * 
+ * By default, the readers are woken up once after each batch of events
+ * the IRQ delivers (not for each event).
+ */
+struct vdev_ioctl_wakeup_policy {
+	/**
+	 * Wake up the readers only when at least this many events are queued.
+	 * 0 or 1 wakes them after each batch. Must be less than the queue depth.
+	 */
+	uint32_t min_events;
+	/**
+	 * If non-zero, wake up the readers at most this many microseconds
+	 * after an event was queued even if fewer than 'min_events' are queued.
+	 */
+	uint32_t max_latency_us;
+	/**
+	 * The events that wake up the readers immediately when queued,
+	 * regardless of the above.
+	 */
+	uint32_t urgent_events[VIRT_DEV_EVENT_BITMAP_WORDS];
+};
+
+/**
+ * Bulk subscribe actions.
+ */
+enum {
+	/**
+	 * The subscriptions become exactly the given events.
+	 */
+	VIRT_DEV_IOCTL_SUBSCRIBE_BULK_REPLACE,
+	/**
+	 * Subscription for the given events, the others are kept.
+	 */
+	VIRT_DEV_IOCTL_SUBSCRIBE_BULK_ADD,
+	/**
+	 * Unsubscription for the given events, the others are kept.
+	 */
+	VIRT_DEV_IOCTL_SUBSCRIBE_BULK_REMOVE
+};
+
+/**
+ * The data for the VIRT_DEV_IOC_SUBSCRIBE_BULK IOCTL call.
+ */
+struct vdev_ioctl_subscribe_bulk {
+	/**
+	 * One of VIRT_DEV_IOCTL_SUBSCRIBE_BULK_...
+	 */
+	uint32_t action;
+	/**
+	 * The events the action applies to.
+	 */
+	uint32_t events[VIRT_DEV_EVENT_BITMAP_WORDS];
+};
+
+/**
+ * The maximum number of operations in one VIRT_DEV_IOC_VECTOR call.
+ */
+#define VIRT_DEV_IOC_VECTOR_MAX_OPS 64
+
+/**
+ * The VIRT_DEV_IOC_VECTOR flag: stop at the first operation that fails.
+ */
+#define VIRT_DEV_IOC_VECTOR_STOP_ON_ERROR 1
+
+/**
+ * One operation of the VIRT_DEV_IOC_VECTOR.
+ */
+struct vdev_ioctl_vector_op {
+	/**
+	 * The HW specific IOCTL (e.g. VEVR_IOC_PULSE_PARAM_SET). The direct
+	 * IOCTLs are not allowed.
+	 */
+	uint32_t cmd;
+	/**
+	 * Set by the call to the result of the operation (0 or a negative errno).
+	 * -ECANCELED if the operation was not executed.
+	 */
+	int32_t result;
+	/**
+	 * The pointer to the IOCTL data, the same as for the standalone call.
+	 */
+	uint64_t arg;
+};
+
+/**
+ * The data for the VIRT_DEV_IOC_VECTOR IOCTL call.
+ */
+struct vdev_ioctl_vector {
+	/**
+	 * The number of operations, up to VIRT_DEV_IOC_VECTOR_MAX_OPS.
+	 */
+	uint32_t count;
+	/**
+	 * Zero or VIRT_DEV_IOC_VECTOR_STOP_ON_ERROR.
+	 */
+	uint32_t flags;
+	/**
+	 * The pointer to the array of 'count' struct vdev_ioctl_vector_op. The 
+	 * results are written back to it.
+	 */
+	uint64_t ops;
+};
+
+/**
+ * The VIRT_DEV_IOC_PRIVATE_QUEUE flag: put only the events in 'events' 
+ * to the private queue.
+ */
+#define VIRT_DEV_PRIVATE_QUEUE_FLAG_FILTER 1
+
+/**
+ * The data for the VIRT_DEV_IOC_PRIVATE_QUEUE IOCTL call.
+ */
+struct vdev_ioctl_private_queue {
+	/**
+	 * The depth of the private queue, the same rules as for the
+	 * 'queue_depth' of the struct mngdev_ioctl_vdev_create; 0 for the 
+	 * depth of the VIRT_DEV queue.
+	 */
+	uint32_t queue_depth;
+	/**
+	 * Zero or VIRT_DEV_PRIVATE_QUEUE_FLAG_FILTER.
+	 */
+	uint32_t flags;
+	/**
+	 * With the VIRT_DEV_PRIVATE_QUEUE_FLAG_FILTER, the events (and the 
+	 * notifications) this file gets. Only the events the VIRT_DEV is 
+	 * subscribed to can arrive; this doesn't change the subscriptions.
+	 */
+	uint32_t events[VIRT_DEV_EVENT_BITMAP_WORDS];
+};
+
 /* Pick a free magic number according to Documentation/ioctl/ioctl-number.txt. */
 #define VIRT_DEV_IOC_MAGIC 	0xF1
 
@@ -298,8 +584,59 @@ struct vdev_ioctl_res_status {
  */
 #define VIRT_DEV_IOC_RES_STATUS_GET	_IOWR(VIRT_DEV_IOC_MAGIC, 3, struct vdev_ioctl_res_status)
 
+/**
+ * Sets the format of the data returned by read(). The setting stays
+ * for the VIRT_DEV until changed.
+ */
+#define VIRT_DEV_IOC_READ_FORMAT_SET	_IOWR(VIRT_DEV_IOC_MAGIC, 4, struct vdev_ioctl_read_format)
+
+/**
+ * Sets when the readers are woken up. The setting stays for the VIRT_DEV 
+ * until changed.
+ */
+#define VIRT_DEV_IOC_WAKEUP_POLICY_SET	_IOW(VIRT_DEV_IOC_MAGIC, 5, struct vdev_ioctl_wakeup_policy)
 
-#define VIRT_DEV_IOC_MAX  		3
+/**
+ * Alters the subscriptions to many events at once. The change is atomic
+ * and the HW is reconfigured only once. Much faster than the 
+ * VIRT_DEV_IOC_SUBSCRIBE for each event.
+ */
+#define VIRT_DEV_IOC_SUBSCRIBE_BULK	_IOW(VIRT_DEV_IOC_MAGIC, 6, struct vdev_ioctl_subscribe_bulk)
+
+/**
+ * Executes many HW specific IOCTLs in one call, under a single lock of the
+ * device. The ownership of each referenced resource is checked only once.
+ * The result of each operation is written back to its 'result'.
+ */
+#define VIRT_DEV_IOC_VECTOR		_IOW(VIRT_DEV_IOC_MAGIC, 7, struct vdev_ioctl_vector)
+
+/**
+ * Gives this open file its own event queue. By default all the open files 
+ * of a VIRT_DEV read from one shared queue, so several readers split the 
+ * events between them (a blocked read() is woken up only for one reader at
+ * a time). With a private queue every event the VIRT_DEV gets is put to 
+ * the queue of each such file, so each reader gets them all (or the 
+ * filtered ones) independently. read(), poll(), the 
+ * VIRT_DEV_IOC_READ_FORMAT_SET and the mmap of the event ring
+ * (VIRT_DEV_MMAP_OFFSET_EVENT_RING) then apply to the private queue; the
+ * read format is taken over from the shared queue. The wakeup policy is
+ * common to all the queues of the VIRT_DEV. An overflow of the private 
+ * queue is marked in its own ring with a MODAC_EVENT_READ_OVERFLOW entry;
+ * the notifying events are reported to the file only by its read() and 
+ * poll().
+ * 
+ * Can be called only once per open file (-EBUSY otherwise); the queue is
+ * freed on close. While all the open files have private queues, the shared
+ * queue is not filled.
+ * 
+ * For a VIRT_DEV created with MNG_DEV_VDEV_CREATE_FLAG_EVENT_LOG the private
+ * queue is just an own cursor into the event log; the 'queue_depth' is
+ * ignored.
+ */
+#define VIRT_DEV_IOC_PRIVATE_QUEUE	_IOW(VIRT_DEV_IOC_MAGIC, 8, struct vdev_ioctl_private_queue)
+
+
+#define VIRT_DEV_IOC_MAX  		8
 
 
 
@@ -317,6 +654,167 @@ struct vdev_ioctl_res_status {
 #define VIRT_DEV_DBG_IOC_MIN  		240
 #define VIRT_DEV_DBG_IOC_MAX  		0
 
+
+
+/* ------------- mmap ------------ */
+
+/**
+ * @short The mmap offset of the VIRT_DEV's event ring.
+ *
+ * The VIRT_DEV event queue can be mmap-ed at this offset. The mapping
+ * starts with the struct modac_event_ring_header followed by the
+ * entries at the header's 'entry_offset'. The offset 0 (and all the other
+ * offsets) are reserved for the HW support region (the DataBuf for the EVR,
+ * see struct vevr_mmap_data).
+ *
+ * The mapping can be read-only (only to observe the queue) or shared
+ * read-write (MAP_SHARED) in which case the consumer advances the 'tail'
+ * itself. Both the read() and the mmap-ed ring consume from the same queue
+ * (the private one of the file, see VIRT_DEV_IOC_PRIVATE_QUEUE, if set).
+ * An overflow of the queue is marked in the ring itself with a
+ * MODAC_EVENT_READ_OVERFLOW entry (see struct modac_event_ring_entry). The
+ * HW specific notifying events are not put into the ring; they are only 
+ * reported by the poll() and read().
+ */
+#define VIRT_DEV_MMAP_OFFSET_EVENT_RING 0x10000000
+
+/**
+ * The header of the mmap-ed event ring.
+ *
+ * The consumer reads the entries between 'tail' and 'head'
+ * (both are indices modulo 'count'):
+ * - load the 'head' with the acquire semantics,
+ * - read the entries from 'tail' up to 'head',
+ * - store the new 'tail' with the release semantics.
+ *
+ * If the ring is empty poll() or read() can be used to wait for more events.
+ */
+struct modac_event_ring_header {
+	/**
+	 * The index of the next entry to be written by the kernel.
+	 */
+	uint32_t head;
+	/**
+	 * The number of entries in the ring, a power of 2.
+	 */
+	uint32_t count;
+	/**
+	 * The size of one entry (struct modac_event_ring_entry with its data).
+	 */
+	uint32_t entry_size;
+	/**
+	 * The offset of the first entry from the start of the mapping.
+	 */
+	uint32_t entry_offset;
+
+	uint32_t reserved0[12];
+
+	/**
+	 * The index of the next entry to be read by the consumer. It is
+	 * in its own cache line.
+	 */
+	uint32_t tail;
+
+	uint32_t reserved1[15];
+};
+
+/**
+ * One entry of the mmap-ed event ring. The entries are 'entry_size' apart.
+ */
+struct modac_event_ring_entry {
+	/**
+	 * The event; MODAC_EVENT_READ_OVERFLOW if the queue overflowed.
+	 */
+	uint16_t event;
+	/**
+	 * The length of the valid 'data'.
+	 */
+	uint16_t length;
+	/**
+	 * The event data, the same as returned by read() after the event.
+	 */
+	uint8_t data[];
+};
+
+/**
+ * @short The mmap offset of the MNG_DEV's event log.
+ *
+ * Only for a VIRT_DEV created with MNG_DEV_VDEV_CREATE_FLAG_EVENT_LOG. The
+ * mapping is read-only and starts with the struct modac_event_log_header
+ * followed by the entries at the header's 'entry_offset'. The log is shared
+ * by all such VIRT_DEVs of the MNG_DEV so it holds all the events that any
+ * of them is subscribed to; the consumer filters the events itself.
+ * 
+ * The consumer keeps its own cursor (a sequence number) and never writes to
+ * the log, so the kernel's read() cursor is not affected and the kernel
+ * can't detect that such a consumer lags; that is up to the consumer, see
+ * struct modac_event_log_header.
+ */
+#define VIRT_DEV_MMAP_OFFSET_EVENT_LOG 0x20000000
+
+/**
+ * The header of the mmap-ed event log.
+ *
+ * Each written event gets the next sequence number (a 32-bit counter that
+ * wraps around); the entry with the sequence number 'seq' is stored at 
+ * the index 'seq' modulo 'count'. The consumer with the cursor 'seq':
+ * - loads the 'head' with the acquire semantics; if it is equal to 'seq' 
+ *   there are no new events,
+ * - if 'head' - 'seq' > 'count' the entry was overwritten already,
+ * - otherwise loads the entry's 'seq' with the acquire semantics, copies 
+ *   the entry, and loads the entry's 'seq' again (after a read barrier). 
+ *   Unless both are equal to the cursor the entry was overwritten while
+ *   being copied and the copy must be discarded,
+ * - increments the cursor.
+ *
+ * After the entries were overwritten the consumer should continue from
+ * somewhere between 'head' - 'count' and 'head', leaving some margin 
+ * for the writer.
+ */
+struct modac_event_log_header {
+	/**
+	 * The sequence number of the next entry to be written by the kernel.
+	 */
+	uint32_t head;
+	/**
+	 * The number of entries in the log, a power of 2.
+	 */
+	uint32_t count;
+	/**
+	 * The size of one entry (struct modac_event_log_entry with its data).
+	 */
+	uint32_t entry_size;
+	/**
+	 * The offset of the first entry from the start of the mapping.
+	 */
+	uint32_t entry_offset;
+
+	uint32_t reserved[12];
+};
+
+/**
+ * One entry of the mmap-ed event log. The entries are 'entry_size' apart.
+ */
+struct modac_event_log_entry {
+	/**
+	 * The sequence number of the entry. It is changed before the entry is
+	 * rewritten and set again once the new entry is complete.
+	 */
+	uint32_t seq;
+	/**
+	 * The event.
+	 */
+	uint16_t event;
+	/**
+	 * The length of the valid 'data'.
+	 */
+	uint16_t length;
+	/**
+	 * The event data, the same as returned by read() after the event.
+	 */
+	uint8_t data[];
+};
+
 /** @} */
 
 #endif /* LINUX_MODAC_H_ */
@@ -25,15 +25,29 @@
 #include <linux/mutex.h>
 #include <linux/version.h>
 #include <linux/delay.h>
+#include <linux/log2.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/types.h>
+#endif
 
 #include "devref.h"
 #include "internal.h"
 #include "event-list.h"
+#include "packet-queue.h"
+#include "lat-hist.h"
 #include "mng-dev.h"
 #include "virt-dev.h"
 
 enum {
 	CLEAN_PRIV,
+	CLEAN_COUNTERS,
+	CLEAN_STAGING,
 	CLEAN_HW,
 	CLEAN_RM,
 	CLEAN_DEV,
@@ -66,6 +80,89 @@ enum {
  */
 #define MAX_COUNTED_EVENTS EVENT_LIST_TYPE_MAX_EVENTS
 
+/*
+ * The deferred dispatch (see irq_dispatch_deferred).
+ * 
+ * The staging queue must hold a few FIFO drains worth of events.
+ */
+#define STAGING_QUEUE_DEPTH 4096
+/* Max. events dispatched in one RCU read-side critical section. */
+#define DISPATCH_BATCH_EVENTS 32
+/* Marks the staged events that are to be dispatched as notifications. */
+#define STAGING_EVENT_NOTIFY 0x4000
+/* 
+ * The staged entries hold the data for the extended entries, the length of
+ * it for the regular entries is kept in these bits of the staged event (see
+ * modac_mngdev_put_event_ext).
+ */
+#define STAGING_EVENT_LENGTH_SHIFT 9
+#define STAGING_EVENT_LENGTH_MASK (0x1f << STAGING_EVENT_LENGTH_SHIFT)
+
+static int irq_dispatch_deferred = 0;
+module_param(irq_dispatch_deferred, int, 0444);
+MODULE_PARM_DESC(irq_dispatch_deferred, "0 = the events are dispatched to "
+		"the VIRT_DEVs in the IRQ handler, 1 = the IRQ handler only stages "
+		"the events and a per MNG_DEV kernel thread dispatches them.");
+
+static int irq_dispatch_thread_prio = 80;
+module_param(irq_dispatch_thread_prio, int, 0444);
+MODULE_PARM_DESC(irq_dispatch_thread_prio, "SCHED_FIFO priority of the "
+		"dispatch thread (1...99) if irq_dispatch_deferred=1. Only used "
+		"before Linux 5.9, the newer kernels give the thread the default "
+		"sched_set_fifo() priority (use chrt to change it).");
+
+static int event_log_depth = 8192;
+module_param(event_log_depth, int, 0444);
+MODULE_PARM_DESC(event_log_depth, "The number of entries in the event log "
+		"of a MNG_DEV (a power of 2) used by the VIRT_DEVs created with "
+		"MNG_DEV_VDEV_CREATE_FLAG_EVENT_LOG.");
+
+/* The event rates are averaged over 1 s and over this many seconds. */
+#define EVENT_RATE_WINDOW 10
+
+/*
+ * The event counters, one copy per CPU. The totals are the sums of all 
+ * the copies.
+ */
+struct mngdev_event_counts {
+	u32 count[MAX_COUNTED_EVENTS];
+};
+
+/*
+ * The event totals sampled every second and the rates computed from them.
+ * Only accessed by the rates_work, the rates are read without locking.
+ */
+struct mngdev_event_rates {
+	u32 history[EVENT_RATE_WINDOW + 1][MAX_COUNTED_EVENTS];
+	unsigned long history_jiffies[EVENT_RATE_WINDOW + 1];
+	/* the newest history sample */
+	int history_last;
+	/* the number of the valid history samples (besides the newest one) */
+	int history_count;
+	
+	u32 rate_1s[MAX_COUNTED_EVENTS];
+	u32 rate_10s[MAX_COUNTED_EVENTS];
+};
+
+/*
+ * Timing of a processing stage. Updated without locking, the values are
+ * informative only.
+ */
+struct mngdev_stage_stats {
+	u64 count;
+	u64 events;
+	u64 total_ns;
+	u64 max_ns;
+};
+
+/*
+ * An immutable copy of the subscriptions, published with RCU.
+ */
+struct mngdev_dispatch_snapshot {
+	struct rcu_head rcu;
+	struct event_dispatch_list list;
+};
+
 
 /*
  * Per MNG_DEV data
@@ -85,17 +182,15 @@ struct mngdev_data {
 	
 	struct list_head vdev_list;
 
-	/* used to:
-	 * - maintain the VIRT_DEV list because the list may be called from the IRQ
-	 * - put events to the queue
-	 */
-	spinlock_t	lock_general;
-	unsigned long lock_flags;
-
 	/*
-	 * used from IRQ, must be spin lock protected
+	 * The subscriptions. Read with rcu_read_lock() only (also from the IRQ).
+	 * The writers are serialized with the dispatch_mutex; they publish a
+	 * modified copy and free the old one after a grace period.
 	 */
-	struct event_dispatch_list event_dispatch_list;
+	struct mngdev_dispatch_snapshot __rcu *dispatch;
+	struct mutex dispatch_mutex;
+	/* the number of the dispatch_mutex lock attempts that had to wait */
+	u32 dispatch_contended;
 	
 	/*
 	 * the argument for the dbg regs show command.
@@ -107,7 +202,68 @@ struct mngdev_data {
 	 */
 	void *hw_priv;
 
-	atomic_t event_counters[MAX_COUNTED_EVENTS];
+	struct mngdev_event_counts __percpu *event_counts;
+	struct mngdev_event_rates *event_rates;
+	struct delayed_work rates_work;
+	
+	/*
+	 * The deferred dispatch. The IRQ only puts the events to the 'staging'
+	 * queue (protected by the lock_staging) and the 'dispatch_thread'
+	 * fans them out to the VIRT_DEVs.
+	 */
+	int dispatch_deferred;
+	struct modac_circ_buf staging;
+	spinlock_t lock_staging;
+	wait_queue_head_t wait_staging;
+	struct task_struct *dispatch_thread;
+	/* 
+	 * non-zero while the modac_mngdev_isr runs; it wakes the thread (or the
+	 * VIRT_DEV readers) at the end 
+	 */
+	atomic_t in_isr;
+	/* the time of the last wakeup of the dispatch_thread, 0 if none pending */
+	atomic64_t wake_ns;
+	u32 staging_dropped;
+	u32 staging_overflows;
+	
+	/* 
+	 * isr: the whole modac_mngdev_isr
+	 * handoff: from waking the dispatch thread until it runs
+	 * fanout: copying the events to the VIRT_DEVs
+	 * These are only measured while stats_enabled is set (written "on" /
+	 * "off" to the 'stats' sysfs attribute) to keep the clock reads off
+	 * the IRQ path otherwise.
+	 */
+	int stats_enabled;
+	struct mngdev_stage_stats stats_isr;
+	struct mngdev_stage_stats stats_handoff;
+	struct mngdev_stage_stats stats_fanout;
+	/* the dispatch_mutex hold times of the subscription changes */
+	struct mngdev_stage_stats stats_subscribe;
+	
+	/*
+	 * The event log, allocated when the first VIRT_DEV with 
+	 * MNG_DEV_VDEV_CREATE_FLAG_EVENT_LOG is created. Each event that any
+	 * such VIRT_DEV is subscribed to is written once, under the lock_log.
+	 * The lock_log is held until all the subscribers are marked, so that
+	 * the readers (see modac_vdev_des.event_log_lock) never see an event
+	 * in the log that is not marked yet.
+	 */
+	struct modac_event_log event_log;
+	spinlock_t lock_log;
+	
+	/*
+	 * The latency measurement, switched on and off with the 'latency' 
+	 * sysfs attribute. The events are stamped at the modac_mngdev_isr entry
+	 * (or when put, if outside of it) and the stamp travels with the event
+	 * to the VIRT_DEVs (see struct modac_vdev_des for the rest).
+	 * lat_read: until the event was read from the HW
+	 * lat_dispatch: until the fan-out to the VIRT_DEVs started
+	 */
+	int lat_enabled;
+	u32 lat_isr_stamp;
+	struct lat_hist lat_read;
+	struct lat_hist lat_dispatch;
 	
 	struct modac_hw_support_data hw_support_data;
 	struct modac_rm_data rm_data;
@@ -134,10 +290,20 @@ struct mngdev_table_item {
 };
 
 struct irq_process_arg {
+	struct mngdev_data *mngdev;
 	int notify_only;
 	int event;
 	void *data;
+	/* the data length for the regular and for the extended entries */
 	int length;
+	int ext_length;
+	u32 stamp;
+	/* 
+	 * non-zero once the event was written to the event log, the lock_log
+	 * is held (with the 'log_flags') until all the subscribers are done
+	 */
+	int logged;
+	unsigned long log_flags;
 };
 
 
@@ -233,8 +399,6 @@ static void drvdat_put(struct mngdev_data *mngdev, struct inode *inode,
 
 static void init_dev(struct mngdev_data *mngdev)
 {
-	int i;
-	
 	/* Initialize the reference to the device
      */
 	devref_init(&mngdev->ref, mngdev);
@@ -246,13 +410,173 @@ static void init_dev(struct mngdev_data *mngdev)
 	mngdev->regs_length = 1024;
 
 	INIT_LIST_HEAD(&mngdev->vdev_list);
-	spin_lock_init(&mngdev->lock_general);
+	RCU_INIT_POINTER(mngdev->dispatch, NULL);
+	mutex_init(&mngdev->dispatch_mutex);
+	mngdev->dispatch_contended = 0;
+	
+	mngdev->event_counts = NULL;
+	mngdev->event_rates = NULL;
+	
+	mngdev->dispatch_deferred = 0;
+	mngdev->dispatch_thread = NULL;
+	spin_lock_init(&mngdev->lock_staging);
+	init_waitqueue_head(&mngdev->wait_staging);
+	atomic_set(&mngdev->in_isr, 0);
+	atomic64_set(&mngdev->wake_ns, 0);
+	mngdev->staging_dropped = 0;
+	mngdev->staging_overflows = 0;
+	mngdev->stats_enabled = 0;
+	memset(&mngdev->stats_isr, 0, sizeof(mngdev->stats_isr));
+	memset(&mngdev->stats_handoff, 0, sizeof(mngdev->stats_handoff));
+	memset(&mngdev->stats_fanout, 0, sizeof(mngdev->stats_fanout));
+	memset(&mngdev->stats_subscribe, 0, sizeof(mngdev->stats_subscribe));
+	
+	memset(&mngdev->event_log, 0, sizeof(mngdev->event_log));
+	spin_lock_init(&mngdev->lock_log);
+	
+	mngdev->lat_enabled = 0;
+	mngdev->lat_isr_stamp = 0;
+	lat_hist_reset(&mngdev->lat_read);
+	lat_hist_reset(&mngdev->lat_dispatch);
+}
+
+static int dispatch_init(struct mngdev_data *mngdev)
+{
+	struct mngdev_dispatch_snapshot *snap;
+	
+	snap = kmalloc(sizeof(struct mngdev_dispatch_snapshot), GFP_KERNEL);
+	if(snap == NULL)
+		return -ENOMEM;
+	
+	event_dispatch_list_init(&snap->list);
+	RCU_INIT_POINTER(mngdev->dispatch, snap);
+	
+	return 0;
+}
+
+/* 
+ * Allocates the event log if not yet. Called under the devref lock when a
+ * VIRT_DEV that needs it is created.
+ */
+static int event_log_init(struct mngdev_data *mngdev)
+{
+	if(mngdev->event_log.storage != NULL)
+		return 0;
+	
+	if(!is_power_of_2(event_log_depth) || 
+			event_log_depth < MODAC_VDEV_QUEUE_DEPTH_MIN ||
+			event_log_depth > MODAC_VDEV_QUEUE_DEPTH_MAX) {
+		printk(KERN_ERR "%s: Invalid event_log_depth=%d\n", 
+				mngdev->des->name, event_log_depth);
+		return -EINVAL;
+	}
+	
+	/* The log entries always have the extended data. */
+	return modac_log_init(&mngdev->event_log, event_log_depth, 
+			CBUF_EVENT_ENTRY_DATA_LENGTH_EXT);
+}
+
+static void staging_fini(struct mngdev_data *mngdev)
+{
+	if(!mngdev->dispatch_deferred)
+		return;
+	
+	if(mngdev->dispatch_thread != NULL) {
+		kthread_stop(mngdev->dispatch_thread);
+		mngdev->dispatch_thread = NULL;
+	}
+	
+	modac_cb_fini(&mngdev->staging);
+	mngdev->dispatch_deferred = 0;
+}
+
+static u32 event_count_total(struct mngdev_data *mngdev, int event)
+{
+	u32 total = 0;
+	int cpu;
+	
+	for_each_possible_cpu(cpu) {
+		total += per_cpu_ptr(mngdev->event_counts, cpu)->count[event];
+	}
+	
+	return total;
+}
+
+/* Samples the event totals once per second and updates the rates. */
+static void event_rates_work(struct work_struct *work)
+{
+	struct mngdev_data *mngdev = 
+			container_of(to_delayed_work(work), struct mngdev_data, rates_work);
+	struct mngdev_event_rates *rates = mngdev->event_rates;
+	int last = rates->history_last;
+	int cur = (last + 1) % (EVENT_RATE_WINDOW + 1);
+	unsigned long now = jiffies;
+	unsigned long elapsed_1s, elapsed_10s;
+	int oldest, i;
+	
+	if(rates->history_count < EVENT_RATE_WINDOW)
+		rates->history_count ++;
+	oldest = (cur + EVENT_RATE_WINDOW + 1 - rates->history_count) % 
+			(EVENT_RATE_WINDOW + 1);
+	
+	/* the work may be delayed, use the real time elapsed */
+	elapsed_1s = max(now - rates->history_jiffies[last], 1UL);
+	elapsed_10s = max(now - rates->history_jiffies[oldest], 1UL);
 	
 	for(i = 0; i < MAX_COUNTED_EVENTS; i ++) {
-		atomic_set(&mngdev->event_counters[i], 0);
+		
+		u32 total = event_count_total(mngdev, i);
+		
+		/* the differences are correct even if the totals wrap around */
+		rates->rate_1s[i] = div_u64((u64)(total - rates->history[last][i]) * HZ, 
+				elapsed_1s);
+		rates->rate_10s[i] = div_u64((u64)(total - rates->history[oldest][i]) * HZ, 
+				elapsed_10s);
+		rates->history[cur][i] = total;
+	}
+	
+	rates->history_jiffies[cur] = now;
+	rates->history_last = cur;
+	
+	schedule_delayed_work(&mngdev->rates_work, HZ);
+}
+
+static int counters_init(struct mngdev_data *mngdev)
+{
+	/* the events_bin entries are indexed by the event code */
+	BUILD_BUG_ON(MODAC_EVENT_STATS_COUNT != MAX_COUNTED_EVENTS);
+	
+	mngdev->event_counts = alloc_percpu(struct mngdev_event_counts);
+	if(mngdev->event_counts == NULL)
+		return -ENOMEM;
+	
+	mngdev->event_rates = vzalloc(sizeof(struct mngdev_event_rates));
+	if(mngdev->event_rates == NULL) {
+		free_percpu(mngdev->event_counts);
+		mngdev->event_counts = NULL;
+		return -ENOMEM;
 	}
 	
-	event_dispatch_list_init(&mngdev->event_dispatch_list);
+	/* all the totals start with 0 */
+	mngdev->event_rates->history_jiffies[0] = jiffies;
+	
+	INIT_DELAYED_WORK(&mngdev->rates_work, event_rates_work);
+	schedule_delayed_work(&mngdev->rates_work, HZ);
+	
+	return 0;
+}
+
+static void counters_fini(struct mngdev_data *mngdev)
+{
+	if(mngdev->event_counts == NULL)
+		return;
+	
+	cancel_delayed_work_sync(&mngdev->rates_work);
+	
+	vfree(mngdev->event_rates);
+	mngdev->event_rates = NULL;
+	free_percpu(mngdev->event_counts);
+	mngdev->event_counts = NULL;
 }
 
 static void cleanup(struct mngdev_data *mngdev, int what)
@@ -264,21 +588,19 @@ static void cleanup(struct mngdev_data *mngdev, int what)
 		modac_rm_end(&mngdev->rm_data);
 	case CLEAN_HW:
 		mngdev->des->hw_support->end(&mngdev->hw_support_data);
+	case CLEAN_STAGING:
+		staging_fini(mngdev);
+	case CLEAN_COUNTERS:
+		counters_fini(mngdev);
 	case CLEAN_PRIV:
+		/* no readers left at this point */
+		kfree(rcu_dereference_protected(mngdev->dispatch, 1));
+		/* the existing mappings keep the log memory */
+		modac_log_fini(&mngdev->event_log);
 		kfree(mngdev);
 	}
 }
 
-static inline void dev_spin_lock(struct mngdev_data *mngdev)
-{
-	spin_lock_irqsave(&mngdev->lock_general, mngdev->lock_flags);
-}
-
-static inline void dev_spin_unlock(struct mngdev_data *mngdev)
-{
-	spin_unlock_irqrestore(&mngdev->lock_general, mngdev->lock_flags);
-}
-
 static int mngdev_devref_lock(struct mngdev_data *mngdev)
 {
 	/* Lock the reference. (No need to increment the reference
@@ -305,20 +627,102 @@ static inline void mngdev_devref_unlock(struct mngdev_data *mngdev)
 /*****  Event handling functions  *****/
 
 
-static int on_subscribe_change(struct mngdev_data *mngdev)
+static inline u64 stage_time_ns(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static void stage_stats_add(struct mngdev_stage_stats *stats, int events, u64 ns)
+{
+	stats->count ++;
+	stats->events += events;
+	stats->total_ns += ns;
+	if(ns > stats->max_ns)
+		stats->max_ns = ns;
+}
+
+/* 
+ * The start of a measured stage on the event path, 0 if the measurement is
+ * off.
+ */
+static inline u64 stage_start(struct mngdev_data *mngdev)
+{
+	return READ_ONCE(mngdev->stats_enabled) ? stage_time_ns() : 0;
+}
+
+/* Ends the stage started with stage_start(). */
+static inline void stage_end(struct mngdev_stage_stats *stats, int events, 
+		u64 t0)
+{
+	if(t0 != 0)
+		stage_stats_add(stats, events, stage_time_ns() - t0);
+}
+
+/* 
+ * Locks the dispatch_mutex and returns a copy of the current subscriptions
+ * to be modified. Returns NULL (and leaves unlocked) if out of memory.
+ */
+static struct mngdev_dispatch_snapshot *dispatch_update_begin(
+		struct mngdev_data *mngdev, gfp_t gfp, u64 *t0)
+{
+	struct mngdev_dispatch_snapshot *snap;
+	
+	snap = kmalloc(sizeof(struct mngdev_dispatch_snapshot), gfp);
+	if(snap == NULL)
+		return NULL;
+	
+	if(!mutex_trylock(&mngdev->dispatch_mutex)) {
+		mutex_lock(&mngdev->dispatch_mutex);
+		mngdev->dispatch_contended ++;
+	}
+	*t0 = stage_time_ns();
+	
+	memcpy(&snap->list, 
+		&rcu_dereference_protected(mngdev->dispatch, 
+				lockdep_is_held(&mngdev->dispatch_mutex))->list,
+		sizeof(struct event_dispatch_list));
+	
+	return snap;
+}
+
+static void dispatch_update_abort(struct mngdev_data *mngdev, 
+		struct mngdev_dispatch_snapshot *snap)
+{
+	mutex_unlock(&mngdev->dispatch_mutex);
+	kfree(snap);
+}
+
+/* 
+ * Publishes the modified copy, passes the new subscriptions to the HW (and
+ * to the 'vdev_des' whose subscriptions were changed, if it reads from the
+ * event log) and unlocks the dispatch_mutex. Returns the HW result.
+ */
+static int dispatch_update_commit(struct mngdev_data *mngdev, 
+		struct mngdev_dispatch_snapshot *snap, u64 t0,
+		struct modac_vdev_des *vdev_des)
 {
+	struct mngdev_dispatch_snapshot *old;
 	struct event_list_type all_subscriptions;
 	int ret;
 	
-	/* start from empty */
-	event_list_clear(&all_subscriptions);
+	old = rcu_dereference_protected(mngdev->dispatch, 
+				lockdep_is_held(&mngdev->dispatch_mutex));
+	rcu_assign_pointer(mngdev->dispatch, snap);
 	
-	dev_spin_lock(mngdev);
-	/*
-	 * Quickly (spinlocked section) make a copy of all subscriptions.
+	/* 
+	 * Still under the dispatch_mutex so that the HW always gets the latest
+	 * subscriptions.
 	 */
-	event_dispatch_list_add_subscribed_events(&mngdev->event_dispatch_list, &all_subscriptions);
-	dev_spin_unlock(mngdev);
+	event_list_clear(&all_subscriptions);
+	event_dispatch_list_add_subscribed_events(&snap->list, &all_subscriptions);
+	
+	if(vdev_des->event_log != NULL) {
+		struct event_list_type vdev_subscriptions;
+		
+		event_dispatch_list_subscriber_events(&snap->list, vdev_des, 
+				&vdev_subscriptions);
+		modac_vdev_set_log_events(vdev_des, &vdev_subscriptions);
+	}
 	
 	/* Only call HW if the device is still living */
 	if ( devref_ptr(&mngdev->ref) != NULL ) {
@@ -329,6 +733,12 @@ static int on_subscribe_change(struct mngdev_data *mngdev)
 		ret = -ENODEV;
 	}
 	
+	stage_stats_add(&mngdev->stats_subscribe, 0, stage_time_ns() - t0);
+	
+	mutex_unlock(&mngdev->dispatch_mutex);
+	
+	kfree_rcu(old, rcu);
+	
 	return ret;
 }
 
@@ -336,11 +746,22 @@ static void mngdev_event_dispatch_list_remove_all(
 		struct mngdev_data *mngdev,
 		struct modac_vdev_des *vdev_des)
 {
-	dev_spin_lock(mngdev);
-	event_dispatch_list_remove_all(&mngdev->event_dispatch_list, vdev_des);
-	dev_spin_unlock(mngdev);
+	struct mngdev_dispatch_snapshot *snap;
+	u64 t0;
+	
+	/* Must not fail, the VIRT_DEV is going away. */
+	snap = dispatch_update_begin(mngdev, GFP_KERNEL | __GFP_NOFAIL, &t0);
+	event_dispatch_list_remove_all(&snap->list, vdev_des);
+	dispatch_update_commit(mngdev, snap, t0, vdev_des);
+	
+	/* 
+	 * Wait until no IRQ (or the dispatch thread) can see the 'vdev_des'
+	 * in the old subscriptions anymore.
+	 */
+	synchronize_rcu();
 	
-	on_subscribe_change(mngdev);
+	/* The last batch may not have woken it up (see mngdev_flush_wakeups). */
+	modac_vdev_flush_wakeup(vdev_des);
 }
 
 static int mng_event_dispatch_list_vdev_dbg(
@@ -350,9 +771,10 @@ static int mng_event_dispatch_list_vdev_dbg(
 {
 	int n = 0;
 	
-	dev_spin_lock(mngdev);
-	n += event_dispatch_list_dbg(&mngdev->event_dispatch_list, buf, count, vdev_des);
-	dev_spin_unlock(mngdev);
+	rcu_read_lock();
+	n += event_dispatch_list_dbg(&rcu_dereference(mngdev->dispatch)->list, 
+			buf, count, vdev_des);
+	rcu_read_unlock();
 	
 	return n;
 }
@@ -721,14 +1143,32 @@ static long mngdev_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned
 	}
 		
 	case MNG_DEV_IOC_CREATE:
+	case MNG_DEV_IOC_CREATE_EXT:
 	{
-		struct mngdev_ioctl_vdev_ids create_args;
+		struct mngdev_ioctl_vdev_create create_args;
 		struct modac_vdev_des *vdev_des;
 		u8 vdev_id;
 		
-		if (copy_from_user(&create_args, (void *)arg, sizeof(struct mngdev_ioctl_vdev_ids))) {
-			ret = -EFAULT;
-			goto bail;
+		if(cmd == MNG_DEV_IOC_CREATE) {
+			
+			struct mngdev_ioctl_vdev_ids ids_args;
+			
+			if (copy_from_user(&ids_args, (void *)arg, sizeof(struct mngdev_ioctl_vdev_ids))) {
+				ret = -EFAULT;
+				goto bail;
+			}
+			
+			create_args.id = ids_args.id;
+			memcpy(create_args.name, ids_args.name, sizeof(create_args.name));
+			create_args.queue_depth = 0;
+			create_args.flags = 0;
+			
+		} else {
+			
+			if (copy_from_user(&create_args, (void *)arg, sizeof(struct mngdev_ioctl_vdev_create))) {
+				ret = -EFAULT;
+				goto bail;
+			}
 		}
 		
 		if(create_args.id < 0 || create_args.id > MAX_VIRT_DEVS_PER_MNG_DEV) {
@@ -736,6 +1176,27 @@ static long mngdev_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned
 			goto bail;
 		}
 		
+		if(create_args.flags & ~(MNG_DEV_VDEV_CREATE_FLAG_EXT_DATA |
+				MNG_DEV_VDEV_CREATE_FLAG_EVENT_LOG)) {
+			ret = -EINVAL;
+			goto bail;
+		}
+		
+		if(create_args.flags & MNG_DEV_VDEV_CREATE_FLAG_EVENT_LOG) {
+			ret = event_log_init(mngdev);
+			if(ret)
+				goto bail;
+		}
+		
+		if(create_args.queue_depth == 0) {
+			create_args.queue_depth = MODAC_VDEV_QUEUE_DEPTH_DEFAULT;
+		} else if(!is_power_of_2(create_args.queue_depth) ||
+				create_args.queue_depth < MODAC_VDEV_QUEUE_DEPTH_MIN ||
+				create_args.queue_depth > MODAC_VDEV_QUEUE_DEPTH_MAX) {
+			ret = -EINVAL;
+			goto bail;
+		}
+		
 		/*
 		 * Check if the name is already in use for this MNG_DEV.
 		 */
@@ -791,6 +1252,15 @@ static long mngdev_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned
 				
 				vdev_des->usage_counter = 0;
 				vdev_des->leave_res_set_on_last_close = 0;
+				vdev_des->queue_depth = create_args.queue_depth;
+				vdev_des->entry_data_length = 
+					(create_args.flags & MNG_DEV_VDEV_CREATE_FLAG_EXT_DATA) ?
+						CBUF_EVENT_ENTRY_DATA_LENGTH_EXT : CBUF_EVENT_ENTRY_DATA_LENGTH;
+				vdev_des->event_log = 
+					(create_args.flags & MNG_DEV_VDEV_CREATE_FLAG_EVENT_LOG) ?
+						&mngdev->event_log : NULL;
+				vdev_des->event_log_lock = &mngdev->lock_log;
+				vdev_des->lat_enabled = mngdev->lat_enabled;
 
 				ret = modac_vdev_create(vdev_des);
 				if(ret) {
@@ -977,7 +1447,7 @@ static const struct file_operations mngdev_fops = {
 
 /*****  Local IRQ context support and functions  *****/
 
-/* Called from an IRQ in a spin-locked context. */
+/* Called from an IRQ in the RCU read-side critical section. */
 static void irq_process(void *subscriber, void *arg_a)
 {
 	struct modac_vdev_des *vdev_des = (struct modac_vdev_des *)subscriber;
@@ -985,115 +1455,349 @@ static void irq_process(void *subscriber, void *arg_a)
 
 	if(arg->notify_only) {
 		modac_vdev_notify(vdev_des, arg->event);
-	} else {
-		modac_vdev_put_cb(vdev_des, arg->event, arg->data, arg->length);
+		return;
+	}
+	
+	if(vdev_des->event_log != NULL && !arg->logged) {
+		
+		/* 
+		 * The first such subscriber writes the event to the log, the
+		 * others only get marked in modac_vdev_put_cb. Unlocked in 
+		 * mngdev_dispatch.
+		 */
+		spin_lock_irqsave(&arg->mngdev->lock_log, arg->log_flags);
+		modac_log_put(vdev_des->event_log, arg->event, arg->data, 
+				arg->length, arg->ext_length, arg->stamp);
+		
+		arg->logged = 1;
 	}
+	
+	modac_vdev_put_cb(vdev_des, arg->event, arg->data, 
+			vdev_des->entry_data_length == CBUF_EVENT_ENTRY_DATA_LENGTH_EXT ?
+					arg->ext_length : arg->length, 
+			arg->stamp);
 }
 
-/* Called from an IRQ. */
-static void modac_mngdev_process_event(struct modac_mngdev_des *devdes, 
-		int event_usage_type, int event, void *data, int length)
+/* Must be called in the RCU read-side critical section. */
+static void mngdev_dispatch(struct mngdev_data *mngdev, 
+		struct event_dispatch_list *list,
+		int event_usage_type, int event, void *data, int length, 
+		int ext_length, u32 stamp)
 {
-	struct mngdev_data *mngdev = (struct mngdev_data *)devdes->priv;
 	struct irq_process_arg arg;
 	
 	if(event >= 0 && event < MAX_COUNTED_EVENTS) {
-		atomic_inc(&mngdev->event_counters[event]);
+		this_cpu_inc(mngdev->event_counts->count[event]);
 	}
+	
+	if(stamp != 0)
+		lat_hist_add(&mngdev->lat_dispatch, stamp, lat_stamp());
 
+	arg.mngdev = mngdev;
 	arg.notify_only = (event_usage_type == EUT_NOTIFY_ONLY);
 	arg.event = event;
 	arg.data = data;
 	arg.length = length;
+	arg.ext_length = ext_length;
+	arg.stamp = stamp;
+	arg.logged = 0;
 
 	/* 
 	 * copy the event everywhere
 	 */
-	dev_spin_lock(mngdev);
-
-	event_dispatch_list_for_all_subscribers(&mngdev->event_dispatch_list, event,
-											irq_process, &arg);
-
-	dev_spin_unlock(mngdev);
+	event_dispatch_list_for_all_subscribers(list, event, irq_process, &arg);
+	
+	if(arg.logged)
+		spin_unlock_irqrestore(&mngdev->lock_log, arg.log_flags);
 }
 
-/*****  Local hot-unplug support functions  *****/
-
-/* Remove all mappings that are held by an inode.
- * We keep track of all open inodes that reference
- * a single device (there could be multiple device
- * special files, i.e. multiple inodes per device).
- * When we remove the device we zap all mappings
- * from all inodes.
- */ 
-static inline int
-unmap_inode(struct inode *inod, void *closure)
+/* 
+ * Wakes up the VIRT_DEV readers (according to their policies) after a batch
+ * of events. Must be called in the same RCU read-side critical section as 
+ * the mngdev_dispatch calls or the readers of a just unsubscribed VIRT_DEV
+ * might be missed.
+ */
+static void mngdev_flush_wakeups(struct event_dispatch_list *list)
 {
-	unmap_mapping_range( inod->i_mapping, 0, 0, 1 );
-	return 0;
+	int i;
+	
+	for(i = 0; i < EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS; i ++) {
+		if(list->subs[i] != NULL)
+			modac_vdev_flush_wakeup((struct modac_vdev_des *)list->subs[i]);
+	}
 }
 
-static inline void app_kill(struct mngdev_data *mngdev)
+/* Called from an IRQ. */
+static void modac_mngdev_process_event(struct modac_mngdev_des *devdes, 
+		int event_usage_type, int event, void *data, int length, 
+		int ext_length, u32 stamp)
 {
-	if(mngdev->pid != NO_PID) {
-		kill_pid(find_vpid(mngdev->pid), SIGKILL, 1);
-	}
+	struct mngdev_data *mngdev = (struct mngdev_data *)devdes->priv;
+	struct event_dispatch_list *list;
+	u64 t0 = stage_start(mngdev);
+	
+	rcu_read_lock();
+	list = &rcu_dereference(mngdev->dispatch)->list;
+	mngdev_dispatch(mngdev, list, event_usage_type, event, data, length, 
+			ext_length, stamp);
+	
+	/* 
+	 * Within modac_mngdev_isr the wakeups are done once at its end. 
+	 * Outside of it (i.e. the simulator) immediately.
+	 */
+	smp_mb();
+	if(!atomic_read(&mngdev->in_isr))
+		mngdev_flush_wakeups(list);
+	rcu_read_unlock();
+	
+	stage_end(&mngdev->stats_fanout, 1, t0);
 }
 
-static void inline mngdev_destroy_now(struct mngdev_data *mngdev)
+static void mngdev_wake_dispatch(struct mngdev_data *mngdev)
 {
-	list_stop_and_destroy_vdevs(mngdev);
-	cleanup(mngdev, CLEAN_ALL);
+	atomic64_set(&mngdev->wake_ns, stage_start(mngdev));
+	wake_up(&mngdev->wait_staging);
 }
 
-/*****  MNG_DEV sysfs support  *****/
-
-static ssize_t show_alloc(struct device *dev, struct device_attribute *attr,
-		char *buf)
+/* 
+ * Called from an IRQ (or any other context). Only puts the event to the
+ * staging queue, the dispatch thread does the rest.
+ */
+static void mngdev_stage_event(struct mngdev_data *mngdev, 
+		int event_usage_type, int event, void *data, int length, 
+		int ext_length, u32 stamp)
 {
-	struct mngdev_data *mngdev = dev_get_drvdata(dev);
-	ssize_t ret;
-
-	ret = mngdev_devref_lock(mngdev);
-	if(ret)
-		return ret;
+	unsigned long flags;
+	int ret;
 	
-	ret = modac_rm_print_info(&mngdev->rm_data, buf, PAGE_SIZE, 0, 200);
+	if(event_usage_type == EUT_NOTIFY_ONLY)
+		event |= STAGING_EVENT_NOTIFY;
+	event |= length << STAGING_EVENT_LENGTH_SHIFT;
 	
-	devref_unlock( &mngdev->ref );
+	spin_lock_irqsave(&mngdev->lock_staging, flags);
+	ret = modac_cb_put(&mngdev->staging, event, data, ext_length, stamp, NULL);
+	if(ret < 0)
+		mngdev->staging_dropped ++;
+	spin_unlock_irqrestore(&mngdev->lock_staging, flags);
 	
-	return ret;
+	/* 
+	 * The modac_mngdev_isr wakes the thread only once at its end. Outside
+	 * of it (i.e. the simulator) the thread is woken here.
+	 */
+	smp_mb();
+	if(!atomic_read(&mngdev->in_isr))
+		mngdev_wake_dispatch(mngdev);
 }
 
-static ssize_t store_dbg(struct device *dev, struct device_attribute *attr,
-			 const char *buf, size_t count)
+static void dispatch_staged(struct mngdev_data *mngdev, 
+		struct event_dispatch_list *list,
+		struct modac_cb_span *span)
 {
-	struct mngdev_data *mngdev = dev_get_drvdata(dev);
-	ssize_t ret;
-	
-	ret = mngdev_devref_lock(mngdev);
-	if(ret)
-		return ret;
-	
-	if(mngdev->des->hw_support->store_dbg == NULL) {
-		count = -ENOSYS;
-	} else {
-		count = mngdev->des->hw_support->store_dbg(&mngdev->hw_support_data, buf, count);
-	}
+	int i;
 	
-	devref_unlock( &mngdev->ref );
+	for(i = 0; i < span->count; i ++) {
+		struct modac_circ_buf_entry *entry = 
+				modac_cb_span_entry(&mngdev->staging, span, i);
+		int event = entry->event;
 		
-	return count;
+		if(event == MODAC_EVENT_READ_OVERFLOW) {
+			mngdev->staging_overflows ++;
+			printk_ratelimited(KERN_WARNING "%s: IRQ staging queue overflow, events lost\n",
+					mngdev->des->name);
+		} else if(event & STAGING_EVENT_NOTIFY) {
+			mngdev_dispatch(mngdev, list, EUT_NOTIFY_ONLY, 
+					event & ~(STAGING_EVENT_NOTIFY | STAGING_EVENT_LENGTH_MASK), 
+					NULL, 0, 0, 0);
+		} else {
+			mngdev_dispatch(mngdev, list, EUT_REGULAR_EVENT, 
+					event & ~STAGING_EVENT_LENGTH_MASK, entry->data, 
+					(event & STAGING_EVENT_LENGTH_MASK) >> STAGING_EVENT_LENGTH_SHIFT,
+					entry->length, 
+					modac_cb_span_stamp(&mngdev->staging, span, i));
+		}
+	}
 }
 
-static ssize_t show_dbg(struct device *dev, struct device_attribute *attr,
-		char *buf)
+static int mngdev_dispatch_thread(void *arg)
 {
-	struct mngdev_data *mngdev = dev_get_drvdata(dev);
-	ssize_t ret;
-
-	ret = mngdev_devref_lock(mngdev);
-	if(ret)
+	struct mngdev_data *mngdev = (struct mngdev_data *)arg;
+	struct modac_cb_span spans[2];
+	
+	while(!kthread_should_stop()) {
+		
+		int n;
+		u64 t0, wake_ns;
+		
+		wait_event_interruptible(mngdev->wait_staging, 
+				modac_cb_available(&mngdev->staging) || kthread_should_stop());
+		
+		t0 = stage_start(mngdev);
+		wake_ns = atomic64_xchg(&mngdev->wake_ns, 0);
+		if(wake_ns != 0 && t0 > wake_ns)
+			stage_stats_add(&mngdev->stats_handoff, 0, t0 - wake_ns);
+		
+		/* 
+		 * The thread is the only reader of the staging queue, no lock is
+		 * needed on this side.
+		 */
+		while((n = modac_cb_peek(&mngdev->staging, DISPATCH_BATCH_EVENTS, spans)) > 0) {
+			
+			struct event_dispatch_list *list;
+			
+			rcu_read_lock();
+			list = &rcu_dereference(mngdev->dispatch)->list;
+			dispatch_staged(mngdev, list, &spans[0]);
+			dispatch_staged(mngdev, list, &spans[1]);
+			mngdev_flush_wakeups(list);
+			rcu_read_unlock();
+			
+			modac_cb_consume(&mngdev->staging, n);
+			
+			stage_end(&mngdev->stats_fanout, n, t0);
+			t0 = stage_start(mngdev);
+		}
+	}
+	
+	return 0;
+}
+
+static int mngdev_set_dispatch_prio(struct task_struct *task, int prio)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+	/* 
+	 * sched_setscheduler_nocheck() is not exported anymore. The
+	 * sched_set_fifo() gives the task the MAX_RT_PRIO / 2 priority, the
+	 * 'prio' cannot be chosen.
+	 */
+	sched_set_fifo(task);
+	return 0;
+#else
+	struct sched_param param = { .sched_priority = prio };
+	
+	return sched_setscheduler_nocheck(task, SCHED_FIFO, &param);
+#endif
+}
+
+static int staging_init(struct mngdev_data *mngdev, const char *name)
+{
+	int ret;
+	
+	/* the event and the length bits of the staged events must not overlap */
+	BUILD_BUG_ON(EVENT_LIST_TYPE_MAX_EVENTS > (1 << STAGING_EVENT_LENGTH_SHIFT));
+	BUILD_BUG_ON((CBUF_EVENT_ENTRY_DATA_LENGTH << STAGING_EVENT_LENGTH_SHIFT) & 
+			~STAGING_EVENT_LENGTH_MASK);
+	
+	if(!irq_dispatch_deferred)
+		return 0;
+	
+	/* must be able to hold all the data that any VIRT_DEV may get */
+	ret = modac_cb_init(&mngdev->staging, STAGING_QUEUE_DEPTH, 
+			CBUF_EVENT_ENTRY_DATA_LENGTH_EXT);
+	if(ret)
+		return ret;
+	
+	mngdev->dispatch_deferred = 1;
+	
+	mngdev->dispatch_thread = kthread_create(mngdev_dispatch_thread, mngdev,
+			"evrma-%s", name);
+	if(IS_ERR(mngdev->dispatch_thread)) {
+		ret = PTR_ERR(mngdev->dispatch_thread);
+		mngdev->dispatch_thread = NULL;
+		printk(KERN_ERR "%s: Failed to create the dispatch thread!\n", name);
+		staging_fini(mngdev);
+		return ret;
+	}
+	
+	ret = mngdev_set_dispatch_prio(mngdev->dispatch_thread, 
+			clamp(irq_dispatch_thread_prio, 1, MAX_RT_PRIO - 1));
+	if(ret) {
+		/* not fatal, the thread will run with the normal priority */
+		printk(KERN_WARNING "%s: Failed to set the dispatch thread priority: %d\n", 
+				name, ret);
+	}
+	
+	wake_up_process(mngdev->dispatch_thread);
+	
+	return 0;
+}
+
+/*****  Local hot-unplug support functions  *****/
+
+/* Remove all mappings that are held by an inode.
+ * We keep track of all open inodes that reference
+ * a single device (there could be multiple device
+ * special files, i.e. multiple inodes per device).
+ * When we remove the device we zap all mappings
+ * from all inodes.
+ */ 
+static inline int
+unmap_inode(struct inode *inod, void *closure)
+{
+	unmap_mapping_range( inod->i_mapping, 0, 0, 1 );
+	return 0;
+}
+
+static inline void app_kill(struct mngdev_data *mngdev)
+{
+	if(mngdev->pid != NO_PID) {
+		kill_pid(find_vpid(mngdev->pid), SIGKILL, 1);
+	}
+}
+
+static void inline mngdev_destroy_now(struct mngdev_data *mngdev)
+{
+	list_stop_and_destroy_vdevs(mngdev);
+	cleanup(mngdev, CLEAN_ALL);
+}
+
+/*****  MNG_DEV sysfs support  *****/
+
+static ssize_t show_alloc(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct mngdev_data *mngdev = dev_get_drvdata(dev);
+	ssize_t ret;
+
+	ret = mngdev_devref_lock(mngdev);
+	if(ret)
+		return ret;
+	
+	ret = modac_rm_print_info(&mngdev->rm_data, buf, PAGE_SIZE, 0, 200);
+	
+	devref_unlock( &mngdev->ref );
+	
+	return ret;
+}
+
+static ssize_t store_dbg(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count)
+{
+	struct mngdev_data *mngdev = dev_get_drvdata(dev);
+	ssize_t ret;
+	
+	ret = mngdev_devref_lock(mngdev);
+	if(ret)
+		return ret;
+	
+	if(mngdev->des->hw_support->store_dbg == NULL) {
+		count = -ENOSYS;
+	} else {
+		count = mngdev->des->hw_support->store_dbg(&mngdev->hw_support_data, buf, count);
+	}
+	
+	devref_unlock( &mngdev->ref );
+		
+	return count;
+}
+
+static ssize_t show_dbg(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct mngdev_data *mngdev = dev_get_drvdata(dev);
+	ssize_t ret;
+
+	ret = mngdev_devref_lock(mngdev);
+	if(ret)
 		return ret;
 	
 	if(mngdev->des->hw_support->show_dbg == NULL) {
@@ -1209,7 +1913,7 @@ static ssize_t show_events(struct device *dev, struct device_attribute *attr,
 		if(i % 16 == 0) {
 			n += scnprintf(buf + n, PAGE_SIZE - n, "%3.3d: ", i);
 		}
-		n += scnprintf(buf + n, PAGE_SIZE - n, "%d ", atomic_read(&mngdev->event_counters[i]));
+		n += scnprintf(buf + n, PAGE_SIZE - n, "%d ", (int)event_count_total(mngdev, i));
 		if(i % 16 == 15) {
 			n += scnprintf(buf + n, PAGE_SIZE - n, "\n");
 		}
@@ -1220,6 +1924,292 @@ static ssize_t show_events(struct device *dev, struct device_attribute *attr,
 	return n;
 }
 
+/* 
+ * The same layout as the 'events', the 1 s rates first, then the 10 s ones.
+ * The rows with all the rates zero are omitted.
+ */
+static ssize_t show_event_rates(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct mngdev_data *mngdev = dev_get_drvdata(dev);
+	struct mngdev_event_rates *rates = mngdev->event_rates;
+	u32 *rate_table[2] = { rates->rate_1s, rates->rate_10s };
+	const char *rate_name[2] = { "rate_1s", "rate_10s" };
+	int i, j, k;
+	ssize_t n = 0;
+	ssize_t ret;
+	
+	ret = mngdev_devref_lock(mngdev);
+	if(ret)
+		return ret;
+	
+	for(k = 0; k < 2; k ++) {
+		
+		u32 *rate = rate_table[k];
+		
+		n += scnprintf(buf + n, PAGE_SIZE - n, "%s:\n", rate_name[k]);
+		
+		for(i = 0; i < MAX_COUNTED_EVENTS; i += 16) {
+			
+			for(j = i; j < i + 16 && rate[j] == 0; j ++);
+			if(j == i + 16)
+				continue;
+			
+			n += scnprintf(buf + n, PAGE_SIZE - n, "%3.3d: ", i);
+			for(j = i; j < i + 16; j ++) {
+				n += scnprintf(buf + n, PAGE_SIZE - n, "%u ", rate[j]);
+			}
+			n += scnprintf(buf + n, PAGE_SIZE - n, "\n");
+		}
+	}
+	
+	devref_unlock( &mngdev->ref );
+
+	return n;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+static ssize_t events_bin_read(struct file *filp, struct kobject *kobj,
+		const struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,35)
+static ssize_t events_bin_read(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+#else
+static ssize_t events_bin_read(struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+#endif
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct mngdev_data *mngdev = dev_get_drvdata(dev);
+	size_t size = MODAC_EVENT_STATS_COUNT * sizeof(struct modac_event_stats);
+	size_t pos, done;
+	ssize_t ret;
+	
+	if(off >= size)
+		return 0;
+	pos = off;
+	count = min(count, size - pos);
+	
+	ret = mngdev_devref_lock(mngdev);
+	if(ret)
+		return ret;
+	
+	for(done = 0; done < count; ) {
+		
+		struct modac_event_stats stats;
+		int event = (pos + done) / sizeof(stats);
+		size_t stats_off = (pos + done) % sizeof(stats);
+		size_t len = min(sizeof(stats) - stats_off, count - done);
+		
+		stats.total = event_count_total(mngdev, event);
+		stats.rate_1s = mngdev->event_rates->rate_1s[event];
+		stats.rate_10s = mngdev->event_rates->rate_10s[event];
+		stats.reserved = 0;
+		
+		memcpy(buf + done, (u8 *)&stats + stats_off, len);
+		done += len;
+	}
+	
+	devref_unlock( &mngdev->ref );
+
+	return count;
+}
+
+/* Created with device_create_bin_file for all the kernel versions. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,12,00)
+static BIN_ATTR_RO(events_bin, 
+		MODAC_EVENT_STATS_COUNT * sizeof(struct modac_event_stats));
+#else
+static struct bin_attribute bin_attr_events_bin = {
+	.attr = { .name = "events_bin", .mode = S_IRUGO },
+	.size = MODAC_EVENT_STATS_COUNT * sizeof(struct modac_event_stats),
+	.read = events_bin_read,
+};
+#endif
+
+static ssize_t show_stage_stats(char *buf, ssize_t n, const char *name, 
+		struct mngdev_stage_stats *stats)
+{
+	return scnprintf(buf + n, PAGE_SIZE - n, 
+			"%s: count=%llu events=%llu avg_ns=%llu max_ns=%llu\n", name, 
+			stats->count, stats->events,
+			stats->count ? div64_u64(stats->total_ns, stats->count) : 0,
+			stats->max_ns);
+}
+
+static ssize_t show_stats(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct mngdev_data *mngdev = dev_get_drvdata(dev);
+	ssize_t n = 0;
+	ssize_t ret;
+	
+	ret = mngdev_devref_lock(mngdev);
+	if(ret)
+		return ret;
+	
+	n += scnprintf(buf + n, PAGE_SIZE - n, "stats: %s\n", 
+			mngdev->stats_enabled ? "on" : "off");
+	
+	if(mngdev->dispatch_deferred) {
+		n += scnprintf(buf + n, PAGE_SIZE - n, "dispatch: deferred, prio=%u\n",
+				mngdev->dispatch_thread->rt_priority);
+	} else {
+		n += scnprintf(buf + n, PAGE_SIZE - n, "dispatch: in IRQ\n");
+	}
+	
+	n += show_stage_stats(buf, n, "isr", &mngdev->stats_isr);
+	n += show_stage_stats(buf, n, "handoff", &mngdev->stats_handoff);
+	n += show_stage_stats(buf, n, "fanout", &mngdev->stats_fanout);
+	n += show_stage_stats(buf, n, "subscribe", &mngdev->stats_subscribe);
+	
+	{
+		struct list_head *ptr;
+		u32 put_contended = 0;
+		
+		list_for_each(ptr, &mngdev->vdev_list) {
+			struct modac_vdev_des *vdev_des = list_entry(ptr, struct modac_vdev_des, mngdev_item);
+			put_contended += vdev_des->put_lock_contended;
+		}
+		
+		n += scnprintf(buf + n, PAGE_SIZE - n, "contended: subscribe=%u vdev_put=%u\n",
+				mngdev->dispatch_contended, put_contended);
+	}
+	
+	if(mngdev->dispatch_deferred) {
+		n += scnprintf(buf + n, PAGE_SIZE - n, "staging: depth=%d dropped=%u overflows=%u\n",
+				STAGING_QUEUE_DEPTH, mngdev->staging_dropped, mngdev->staging_overflows);
+	}
+	
+	if(mngdev->event_log.storage != NULL) {
+		n += scnprintf(buf + n, PAGE_SIZE - n, "event_log: depth=%lu head=%u put=%u\n",
+				mngdev->event_log.count, mngdev->event_log.head, mngdev->event_log.put);
+	}
+	
+	devref_unlock( &mngdev->ref );
+
+	return n;
+}
+
+/* 
+ * Writing "on" / "off" starts / stops the measurement of the isr, handoff
+ * and fanout stages, "reset" clears the statistics.
+ */
+static ssize_t store_stats(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count)
+{
+	struct mngdev_data *mngdev = dev_get_drvdata(dev);
+	ssize_t ret;
+	
+	if(sysfs_streq(buf, "on") || sysfs_streq(buf, "off")) {
+		WRITE_ONCE(mngdev->stats_enabled, sysfs_streq(buf, "on"));
+		return count;
+	}
+	
+	if(!sysfs_streq(buf, "reset"))
+		return -EINVAL;
+	
+	ret = mngdev_devref_lock(mngdev);
+	if(ret)
+		return ret;
+	
+	memset(&mngdev->stats_isr, 0, sizeof(mngdev->stats_isr));
+	memset(&mngdev->stats_handoff, 0, sizeof(mngdev->stats_handoff));
+	memset(&mngdev->stats_fanout, 0, sizeof(mngdev->stats_fanout));
+	memset(&mngdev->stats_subscribe, 0, sizeof(mngdev->stats_subscribe));
+	mngdev->dispatch_contended = 0;
+	{
+		struct list_head *ptr;
+		
+		list_for_each(ptr, &mngdev->vdev_list) {
+			list_entry(ptr, struct modac_vdev_des, mngdev_item)->put_lock_contended = 0;
+		}
+	}
+	mngdev->staging_dropped = 0;
+	mngdev->staging_overflows = 0;
+	
+	devref_unlock( &mngdev->ref );
+
+	return count;
+}
+
+static ssize_t show_latency(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct mngdev_data *mngdev = dev_get_drvdata(dev);
+	struct list_head *ptr;
+	ssize_t n = 0;
+	ssize_t ret;
+	
+	ret = mngdev_devref_lock(mngdev);
+	if(ret)
+		return ret;
+	
+	n += scnprintf(buf + n, PAGE_SIZE - n, "latency: %s\n", 
+			mngdev->lat_enabled ? "on" : "off");
+	n += lat_hist_show(buf, n, "read", &mngdev->lat_read);
+	n += lat_hist_show(buf, n, "dispatch", &mngdev->lat_dispatch);
+	
+	list_for_each(ptr, &mngdev->vdev_list) {
+		struct modac_vdev_des *vdev_des = list_entry(ptr, struct modac_vdev_des, mngdev_item);
+		
+		n += scnprintf(buf + n, PAGE_SIZE - n, "%s:\n", vdev_des->name);
+		n += lat_hist_show(buf, n, "  enqueue", &vdev_des->lat_enqueue);
+		n += lat_hist_show(buf, n, "  wakeup", &vdev_des->lat_wakeup);
+		n += lat_hist_show(buf, n, "  copy", &vdev_des->lat_copy);
+	}
+	
+	devref_unlock( &mngdev->ref );
+
+	return n;
+}
+
+/* 
+ * Writing "on" / "off" starts / stops the measurement, "reset" clears the
+ * histograms.
+ */
+static ssize_t store_latency(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count)
+{
+	struct mngdev_data *mngdev = dev_get_drvdata(dev);
+	ssize_t ret;
+	
+	ret = mngdev_devref_lock(mngdev);
+	if(ret)
+		return ret;
+	
+	if(sysfs_streq(buf, "on") || sysfs_streq(buf, "off")) {
+		struct list_head *ptr;
+		int enabled = sysfs_streq(buf, "on");
+		
+		WRITE_ONCE(mngdev->lat_enabled, enabled);
+		
+		/* the VIRT_DEVs check their own copy on the read() side */
+		list_for_each(ptr, &mngdev->vdev_list) {
+			WRITE_ONCE(list_entry(ptr, struct modac_vdev_des, 
+					mngdev_item)->lat_enabled, enabled);
+		}
+	} else if(sysfs_streq(buf, "reset")) {
+		struct list_head *ptr;
+		
+		lat_hist_reset(&mngdev->lat_read);
+		lat_hist_reset(&mngdev->lat_dispatch);
+		
+		list_for_each(ptr, &mngdev->vdev_list) {
+			struct modac_vdev_des *vdev_des = list_entry(ptr, struct modac_vdev_des, mngdev_item);
+			lat_hist_reset(&vdev_des->lat_enqueue);
+			lat_hist_reset(&vdev_des->lat_wakeup);
+			lat_hist_reset(&vdev_des->lat_copy);
+		}
+	} else {
+		ret = -EINVAL;
+	}
+	
+	devref_unlock( &mngdev->ref );
+
+	return ret ? ret : count;
+}
+
 /*
  * NOTE: when this table is changed, the attrs_misc must be changed as well
  */
@@ -1229,6 +2219,9 @@ static struct device_attribute dev_attr_misc[] = {
 	__ATTR(regs, 0660, show_hw_regs, store_hw_regs),
 	__ATTR(events, S_IRUGO, show_events, NULL),
 	__ATTR(hw_info, S_IRUGO, show_hw_info, NULL),
+	__ATTR(stats, 0660, show_stats, store_stats),
+	__ATTR(latency, 0660, show_latency, store_latency),
+	__ATTR(event_rates, S_IRUGO, show_event_rates, NULL),
 
 	__ATTR_NULL
 };
@@ -1240,6 +2233,9 @@ static struct attribute *attrs_misc[] = {
 	&dev_attr_misc[2].attr,
 	&dev_attr_misc[3].attr,
 	&dev_attr_misc[4].attr,
+	&dev_attr_misc[5].attr,
+	&dev_attr_misc[6].attr,
+	&dev_attr_misc[7].attr,
 	NULL
 };
 
@@ -1277,12 +2273,51 @@ void modac_mngdev_put_event(struct modac_mngdev_des *devdes,
 	int event, void *data, int length
 )
 {
-	modac_mngdev_process_event(devdes, EUT_REGULAR_EVENT, event, data, length);
+	modac_mngdev_put_event_ext(devdes, event, data, length, length);
+}
+
+void modac_mngdev_put_event_ext(struct modac_mngdev_des *devdes,
+	int event, void *data, int length, int ext_length
+)
+{
+	struct mngdev_data *mngdev = (struct mngdev_data *)devdes->priv;
+	u32 stamp = 0;
+	
+	if(mngdev->lat_enabled) {
+		/* 
+		 * Outside of the modac_mngdev_isr (i.e. the simulator) the 
+		 * measurement starts here.
+		 */
+		stamp = mngdev->lat_isr_stamp;
+		if(stamp != 0)
+			lat_hist_add(&mngdev->lat_read, stamp, lat_stamp());
+		else
+			stamp = lat_stamp();
+	}
+	
+	if(length > CBUF_EVENT_ENTRY_DATA_LENGTH || length > ext_length ||
+			ext_length > CBUF_EVENT_ENTRY_DATA_LENGTH_EXT) {
+		printk_ratelimited(KERN_ERR "%s: Wrong event %d data length: %d / %d\n",
+				mngdev->des->name, event, length, ext_length);
+		return;
+	}
+	
+	if(mngdev->dispatch_deferred)
+		mngdev_stage_event(mngdev, EUT_REGULAR_EVENT, event, data, length, 
+				ext_length, stamp);
+	else
+		modac_mngdev_process_event(devdes, EUT_REGULAR_EVENT, event, data, length, 
+				ext_length, stamp);
 }
 
 void modac_mngdev_notify(struct modac_mngdev_des *devdes, int event)
 {
-	modac_mngdev_process_event(devdes, EUT_NOTIFY_ONLY, event, NULL, 0);
+	struct mngdev_data *mngdev = (struct mngdev_data *)devdes->priv;
+	
+	if(mngdev->dispatch_deferred)
+		mngdev_stage_event(mngdev, EUT_NOTIFY_ONLY, event, NULL, 0, 0, 0);
+	else
+		modac_mngdev_process_event(devdes, EUT_NOTIFY_ONLY, event, NULL, 0, 0, 0);
 }
 
 
@@ -1293,22 +2328,6 @@ void modac_mngdev_notify(struct modac_mngdev_des *devdes, int event)
 
 
 
-void modac_c_vdev_spin_lock(struct modac_vdev_des *vdev_des)
-{
-	struct modac_mngdev_des *devdes = vdev_des->mngdev_des;
-	struct mngdev_data *mngdev = (struct mngdev_data *)devdes->priv;
-	
-	return dev_spin_lock(mngdev);
-}
-
-void modac_c_vdev_spin_unlock(struct modac_vdev_des *vdev_des)
-{
-	struct modac_mngdev_des *devdes = vdev_des->mngdev_des;
-	struct mngdev_data *mngdev = (struct mngdev_data *)devdes->priv;
-	
-	dev_spin_unlock(mngdev);
-}
-
 int modac_c_vdev_devref_lock(struct modac_vdev_des *vdev_des)
 {
 	struct modac_mngdev_des *devdes = vdev_des->mngdev_des;
@@ -1369,19 +2388,6 @@ void modac_c_vdev_init_res(struct modac_vdev_des *vdev_des)
 	}
 }
 
-#ifdef DBG_MEASURE_TIME_FROM_IRQ_TO_USER
-
-u32 mng_dbg_get_time(struct modac_vdev_des *vdev_des)
-{
-	struct modac_mngdev_des *devdes = vdev_des->mngdev_des;
-	struct mngdev_data *mngdev = (struct mngdev_data *)devdes->priv;
-	struct modac_hw_support_data *hw_support_data = 
-				&mngdev->hw_support_data;
-				
-	return dbg_get_time(hw_support_data);
-}
-
-#endif
 
 
 
@@ -1405,6 +2411,12 @@ void modac_c_vdev_on_close(struct modac_vdev_des *vdev_des, struct inode *inode,
 	
 	if(vdev_des->usage_counter < 1) {
 		
+		if(devdes->hw_support->on_vdev_close != NULL &&
+						devref_ptr(&mngdev->ref) != NULL) {
+			devdes->hw_support->on_vdev_close(&mngdev->hw_support_data,
+						vdev_des);
+		}
+		
 		if(!vdev_des->leave_res_set_on_last_close) {
 			
 			/*
@@ -1427,9 +2439,65 @@ void modac_c_vdev_on_close(struct modac_vdev_des *vdev_des, struct inode *inode,
 	
 }
 
-int modac_c_vdev_do_ioctl(
+/*
+ * The resources already checked within one VIRT_DEV_IOC_VECTOR call. The
+ * ownership can't change while the devref is locked.
+ */
+struct vdev_vres_cache {
+	int count;
+	struct {
+		struct mngdev_ioctl_hw_header_vres vres;
+		struct modac_rm_vres_desc res;
+		int ret;
+	} items[VIRT_DEV_IOC_VECTOR_MAX_OPS];
+};
+
+/*
+ * Translates the VIRT_DEV relative resource and checks that the VIRT_DEV owns
+ * it. The cache can be NULL.
+ */
+static int vdev_check_vres(struct mngdev_data *mngdev,
+		struct modac_vdev_des *vdev_des,
+		struct mngdev_ioctl_hw_header_vres *vres,
+		struct modac_rm_vres_desc *res,
+		struct vdev_vres_cache *cache)
+{
+	int i;
+	int ret;
+	
+	if(cache != NULL) {
+		for(i = 0; i < cache->count; i ++) {
+			if(cache->items[i].vres.type == vres->type &&
+						cache->items[i].vres.index == vres->index) {
+				*res = cache->items[i].res;
+				return cache->items[i].ret;
+			}
+		}
+	}
+	
+	mngdev_vdev_get_vres_desc(mngdev, vdev_des, vres, res);
+	ret = modac_rm_get_owner(&mngdev->rm_data, res);
+	if(ret != vdev_des->id) {
+		// the resource is not owned by the wanted instance
+		ret = -EACCES;
+	} else {
+		ret = 0;
+	}
+	
+	if(cache != NULL && cache->count < VIRT_DEV_IOC_VECTOR_MAX_OPS) {
+		cache->items[cache->count].vres = *vres;
+		cache->items[cache->count].res = *res;
+		cache->items[cache->count].ret = ret;
+		cache->count ++;
+	}
+	
+	return ret;
+}
+
+static int vdev_do_ioctl(
 		struct modac_vdev_des *vdev_des,
 		struct mngdev_ioctl_hw_header_vres *vres,
+		struct vdev_vres_cache *cache,
 		unsigned int cmd, unsigned long arg)
 {
 	struct modac_mngdev_des *devdes = vdev_des->mngdev_des;
@@ -1439,13 +2507,8 @@ int modac_c_vdev_do_ioctl(
 	
 	// only check the resource if defined
 	if(vres->type != MODAC_RES_TYPE_NONE) {
-	
-		mngdev_vdev_get_vres_desc(mngdev, vdev_des,
-					vres, &res);
-		ret = modac_rm_get_owner(&mngdev->rm_data, &res);
-		if(ret != vdev_des->id) {
-			// the resource is not owned by the wanted instance
-			ret = -EACCES;
+		ret = vdev_check_vres(mngdev, vdev_des, vres, &res, cache);
+		if(ret < 0) {
 			goto bail;
 		}
 	}
@@ -1462,6 +2525,62 @@ bail:
 	return ret;
 }
 
+int modac_c_vdev_do_ioctl(
+		struct modac_vdev_des *vdev_des,
+		struct mngdev_ioctl_hw_header_vres *vres,
+		unsigned int cmd, unsigned long arg)
+{
+	return vdev_do_ioctl(vdev_des, vres, NULL, cmd, arg);
+}
+
+int modac_c_vdev_do_ioctl_vector(
+		struct modac_vdev_des *vdev_des,
+		struct vdev_ioctl_vector_op *ops, int count, u32 flags)
+{
+	struct vdev_vres_cache *cache;
+	int i;
+	
+	cache = kmalloc(sizeof(struct vdev_vres_cache), GFP_KERNEL);
+	if(cache == NULL) {
+		return -ENOMEM;
+	}
+	cache->count = 0;
+	
+	for(i = 0; i < count; i ++) {
+		ops[i].result = -ECANCELED;
+	}
+	
+	for(i = 0; i < count; i ++) {
+		
+		struct vdev_ioctl_hw_header header_args;
+		unsigned int cmd = ops[i].cmd;
+		unsigned long arg = (unsigned long)ops[i].arg;
+		
+		if(_IOC_TYPE(cmd) != VIRT_DEV_IOC_MAGIC ||
+					_IOC_NR(cmd) < VIRT_DEV_HW_IOC_MIN ||
+					_IOC_NR(cmd) > VIRT_DEV_HW_IOC_MAX ||
+					(_IOC_NR(cmd) >= VIRT_DEV_HW_DIRECT_IOC_MIN &&
+					_IOC_NR(cmd) <= VIRT_DEV_HW_DIRECT_IOC_MAX)) {
+			// only the mutex locked HW IOCTLs
+			ops[i].result = -ENOTTY;
+		} else if (copy_from_user(&header_args, (void *)arg, 
+							sizeof(struct vdev_ioctl_hw_header))) {
+			ops[i].result = -EFAULT;
+		} else {
+			ops[i].result = vdev_do_ioctl(vdev_des, &header_args.vres, 
+							cache, cmd, arg);
+		}
+		
+		if(ops[i].result < 0 && (flags & VIRT_DEV_IOC_VECTOR_STOP_ON_ERROR)) {
+			break;
+		}
+	}
+	
+	kfree(cache);
+	
+	return 0;
+}
+
 int modac_c_vdev_do_direct_ioctl(
 		struct modac_vdev_des *vdev_des,
 		unsigned int cmd, unsigned long arg)
@@ -1487,27 +2606,87 @@ int modac_c_vdev_subscribe(struct modac_vdev_des *vdev_des,
 	struct modac_mngdev_des *devdes = vdev_des->mngdev_des;
 	struct mngdev_data *mngdev = (struct mngdev_data *)devdes->priv;
 
+	struct mngdev_dispatch_snapshot *snap;
+	u64 t0;
 	int ret = 0;
 	
-	dev_spin_lock(mngdev);
+	snap = dispatch_update_begin(mngdev, GFP_KERNEL, &t0);
+	if(snap == NULL)
+		return -ENOMEM;
 	
 	switch(action) {
 	case VIRT_DEV_IOCTL_SUBSCRIBE_ACTION_SUBSCRIBE:
-		ret = event_dispatch_list_add(&mngdev->event_dispatch_list, vdev_des, event);
+		ret = event_dispatch_list_add(&snap->list, vdev_des, event);
 		break;
 	case VIRT_DEV_IOCTL_SUBSCRIBE_ACTION_UNSUBSCRIBE:
-		event_dispatch_list_remove(&mngdev->event_dispatch_list, vdev_des, event);
+		event_dispatch_list_remove(&snap->list, vdev_des, event);
 		break;
 	case VIRT_DEV_IOCTL_SUBSCRIBE_ACTION_CLEAR:
-		event_dispatch_list_remove_all(&mngdev->event_dispatch_list, vdev_des);
+		event_dispatch_list_remove_all(&snap->list, vdev_des);
 		break;
 	}
-	dev_spin_unlock(mngdev);
 	
-	if(ret)
+	if(ret) {
+		dispatch_update_abort(mngdev, snap);
 		return ret;
+	}
+	
+	ret = dispatch_update_commit(mngdev, snap, t0, vdev_des);
 	
-	ret = on_subscribe_change(mngdev);
+	if(action != VIRT_DEV_IOCTL_SUBSCRIBE_ACTION_SUBSCRIBE) {
+		/* The VIRT_DEV may have left the subscriptions, see mngdev_flush_wakeups. */
+		modac_vdev_flush_wakeup(vdev_des);
+	}
+	
+	return ret;
+}
+
+int modac_c_vdev_subscribe_bulk(struct modac_vdev_des *vdev_des, 
+					const struct event_list_type *events, 
+					u32 action)
+{
+	struct modac_mngdev_des *devdes = vdev_des->mngdev_des;
+	struct mngdev_data *mngdev = (struct mngdev_data *)devdes->priv;
+
+	struct mngdev_dispatch_snapshot *snap;
+	u64 t0;
+	int event;
+	int ret = 0;
+	
+	if(action != VIRT_DEV_IOCTL_SUBSCRIBE_BULK_REPLACE &&
+			action != VIRT_DEV_IOCTL_SUBSCRIBE_BULK_ADD &&
+			action != VIRT_DEV_IOCTL_SUBSCRIBE_BULK_REMOVE)
+		return -EINVAL;
+	
+	snap = dispatch_update_begin(mngdev, GFP_KERNEL, &t0);
+	if(snap == NULL)
+		return -ENOMEM;
+	
+	if(action == VIRT_DEV_IOCTL_SUBSCRIBE_BULK_REPLACE)
+		event_dispatch_list_remove_all(&snap->list, vdev_des);
+	
+	for_each_set_bit(event, events->mask, EVENT_LIST_TYPE_MAX_EVENTS) {
+		if(action == VIRT_DEV_IOCTL_SUBSCRIBE_BULK_REMOVE) {
+			event_dispatch_list_remove(&snap->list, vdev_des, event);
+		} else {
+			ret = event_dispatch_list_add(&snap->list, vdev_des, event);
+			if(ret)
+				break;
+		}
+	}
+	
+	if(ret) {
+		/* the published subscriptions were not touched */
+		dispatch_update_abort(mngdev, snap);
+		return ret;
+	}
+	
+	ret = dispatch_update_commit(mngdev, snap, t0, vdev_des);
+	
+	if(action != VIRT_DEV_IOCTL_SUBSCRIBE_BULK_ADD) {
+		/* The VIRT_DEV may have left the subscriptions, see mngdev_flush_wakeups. */
+		modac_vdev_flush_wakeup(vdev_des);
+	}
 	
 	return ret;
 }
@@ -1618,12 +2797,30 @@ int modac_mngdev_create(struct modac_mngdev_des *devdes)
 	
 	init_dev(mngdev);
 	
+	ret = dispatch_init(mngdev);
+	if(ret) {
+		cleanup(mngdev, CLEAN_PRIV);
+		return ret;
+	}
+	
+	ret = counters_init(mngdev);
+	if(ret) {
+		cleanup(mngdev, CLEAN_PRIV);
+		return ret;
+	}
+	
+	ret = staging_init(mngdev, devdes->name);
+	if(ret) {
+		cleanup(mngdev, CLEAN_COUNTERS);
+		return ret;
+	}
+	
 	/* init here, hw_support->init() will already need this: */
 	mngdev->hw_support_data.mngdev_des = devdes;
 	
 	ret = devdes->hw_support->init(&mngdev->hw_support_data);
 	if(ret) {
-		cleanup(mngdev, CLEAN_PRIV);
+		cleanup(mngdev, CLEAN_STAGING);
 		return ret;
 	}
 	
@@ -1648,6 +2845,13 @@ int modac_mngdev_create(struct modac_mngdev_des *devdes)
 		return ret;
 	}
 	
+	ret = device_create_bin_file(mngdev->dev, &bin_attr_events_bin);
+	if(ret) {
+		printk(KERN_ERR "%s <dev>: Failed to create the events_bin attribute!\n", devdes->name);
+		cleanup(mngdev, CLEAN_DEV);
+		return ret;
+	}
+	
 	/* Enter the newly bound device info into the table so that it can
 	 * be found by 'open'...
 	 */
@@ -1740,8 +2944,43 @@ void modac_mngdev_destroy(struct modac_mngdev_des *devdes)
 irqreturn_t modac_mngdev_isr(struct modac_mngdev_des *devdes, void *data)
 {
 	struct mngdev_data *mngdev = (struct mngdev_data *)devdes->priv;
+	irqreturn_t ret;
+	u64 t0 = stage_start(mngdev);
+	
+	if(mngdev->lat_enabled)
+		mngdev->lat_isr_stamp = lat_stamp();
 	
-	return mngdev->des->hw_support->isr(&mngdev->hw_support_data, data);
+	atomic_set(&mngdev->in_isr, 1);
+	
+	if(mngdev->dispatch_deferred) {
+		/* 
+		 * Only acknowledge the HW and stage the events. The thread is
+		 * woken once for all of them.
+		 */
+		ret = mngdev->des->hw_support->isr(&mngdev->hw_support_data, data);
+		atomic_set(&mngdev->in_isr, 0);
+		smp_mb();
+		if(modac_cb_available(&mngdev->staging))
+			mngdev_wake_dispatch(mngdev);
+	} else {
+		/* 
+		 * The events are dispatched in the hw_support->isr, the readers
+		 * are woken once for all of them.
+		 */
+		rcu_read_lock();
+		ret = mngdev->des->hw_support->isr(&mngdev->hw_support_data, data);
+		atomic_set(&mngdev->in_isr, 0);
+		smp_mb();
+		mngdev_flush_wakeups(&rcu_dereference(mngdev->dispatch)->list);
+		rcu_read_unlock();
+	}
+	
+	mngdev->lat_isr_stamp = 0;
+	
+	if(ret == IRQ_HANDLED)
+		stage_end(&mngdev->stats_isr, 0, t0);
+	
+	return ret;
 }
 
 
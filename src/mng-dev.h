@@ -21,6 +21,12 @@ struct modac_io_rw_plugin {
 	void (*write_u16)(struct modac_mngdev_des *devdes, u32 offset, u16 value);
 	u32 (*read_u32)(struct modac_mngdev_des *devdes, u32 offset);
 	void (*write_u32)(struct modac_mngdev_des *devdes, u32 offset, u32 value);
+	/* 
+	 * Optional. Reads 'count' consecutive u32 at once; gives the same values
+	 * as read_u32 would for each of them.
+	 */
+	void (*read_block_u32)(struct modac_mngdev_des *devdes, u32 offset, 
+						u32 *dest, int count);
 };
 
 
@@ -66,6 +72,9 @@ struct modac_mngdev_des {
 	/** Private data for dev. */
 	void *priv;
 	
+	/** Private data for the io_rw plugin. */
+	void *io_priv;
+	
 };
 
 /*****  General MNG_DEV functions, called from both MNG_DEV and VIRT_DEV *****/
@@ -74,9 +83,20 @@ int modac_mng_check_on_open(struct modac_mngdev_des *devdes, struct inode *inode
 
 /*****  MNG_DEV functions called from HW in IRQ context *****/
 
-/* The data length is limited to CBUF_EVENT_ENTRY_DATA_LENGTH (= 12 bytes). */
+/* 
+ * The data length is limited to CBUF_EVENT_ENTRY_DATA_LENGTH (= 12 bytes).
+ */
 void modac_mngdev_put_event(struct modac_mngdev_des *devdes, int event, void *data, int length);
 
+/* 
+ * The same as modac_mngdev_put_event for the events with more data for the
+ * VIRT_DEVs with the extended entries. The 'data' holds 'ext_length' bytes
+ * (up to CBUF_EVENT_ENTRY_DATA_LENGTH_EXT = 28) and the VIRT_DEVs with the 
+ * regular entries get only the first 'length' bytes of it.
+ */
+void modac_mngdev_put_event_ext(struct modac_mngdev_des *devdes, int event, 
+		void *data, int length, int ext_length);
+
 void modac_mngdev_notify(struct modac_mngdev_des *devdes, int event);
 
 
@@ -89,14 +109,20 @@ void modac_c_vdev_on_close(struct modac_vdev_des *vdev_des, struct inode *inode,
 int modac_c_vdev_devref_lock(struct modac_vdev_des *vdev_des);
 void modac_c_vdev_devref_unlock(struct modac_vdev_des *vdev_des);
 
-void modac_c_vdev_spin_lock(struct modac_vdev_des *vdev_des);
-void modac_c_vdev_spin_unlock(struct modac_vdev_des *vdev_des);
 
 int modac_c_vdev_do_ioctl(
 		struct modac_vdev_des *vdev_des,
 		struct mngdev_ioctl_hw_header_vres *vres,
 		unsigned int cmd, unsigned long arg);
 
+/* 
+ * Executes the operations of the VIRT_DEV_IOC_VECTOR. The ops are
+ * in the kernel memory, their 'arg' point to the user space.
+ */
+int modac_c_vdev_do_ioctl_vector(
+		struct modac_vdev_des *vdev_des,
+		struct vdev_ioctl_vector_op *ops, int count, u32 flags);
+
 int modac_c_vdev_do_direct_ioctl(
 		struct modac_vdev_des *vdev_des,
 		unsigned int cmd, unsigned long arg);
@@ -106,6 +132,15 @@ int modac_c_vdev_subscribe(struct modac_vdev_des *vdev_des,
 					// one of VIRT_DEV_IOCTL_SUBSCRIBE_ACTION_...
 					u8 action);
 
+/* 
+ * Alters the subscriptions to all the 'events' at once, with a single HW 
+ * reconfiguration. Either all the changes are done or none.
+ */
+int modac_c_vdev_subscribe_bulk(struct modac_vdev_des *vdev_des, 
+					const struct event_list_type *events, 
+					// one of VIRT_DEV_IOCTL_SUBSCRIBE_BULK_...
+					u32 action);
+
 /* 
  * Initialze the resources to the known state.
  * 
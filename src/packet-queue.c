@@ -16,36 +16,198 @@
 #include <linux/wait.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
 #include <linux/version.h>
 
 #include "internal.h"
 #include "packet-queue.h"
 #include "linux-modac.h"
- 
-void modac_cb_init(struct modac_circ_buf *cb)
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
+#define CB_READ_ONCE(x) ACCESS_ONCE(x)
+#define CB_WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#else
+#define CB_READ_ONCE(x) READ_ONCE(x)
+#define CB_WRITE_ONCE(x, val) WRITE_ONCE(x, val)
+#endif
+
+/*
+ * The ring memory is refcounted separately because an existing user space
+ * mapping must stay valid even if the VIRT_DEV is destroyed in the meantime.
+ */
+struct modac_cb_storage {
+	struct kref ref;
+	void *mem;
+	unsigned long size;
+};
+
+static void cb_storage_release(struct kref *ref)
+{
+	struct modac_cb_storage *storage = 
+			container_of(ref, struct modac_cb_storage, ref);
+	
+	vfree(storage->mem);
+	kfree(storage);
+}
+
+static struct modac_cb_storage *cb_storage_alloc(unsigned long size)
+{
+	struct modac_cb_storage *storage;
+	
+	storage = kmalloc(sizeof(struct modac_cb_storage), GFP_KERNEL);
+	if(storage == NULL)
+		return NULL;
+	
+	/* zeroed and prepared for remap_vmalloc_range */
+	storage->mem = vmalloc_user(size);
+	if(storage->mem == NULL) {
+		kfree(storage);
+		return NULL;
+	}
+	
+	kref_init(&storage->ref);
+	storage->size = size;
+	
+	return storage;
+}
+
+static inline unsigned long cb_tail(struct modac_circ_buf *cb)
 {
-	cb->cb_events.buf = (char *)cb->buf;
-	cb->cb_events.head = cb->cb_events.tail = 0;
+	/* The tail may have been written by the user space, never trust it. */
+	return CB_READ_ONCE(cb->hdr->tail) & (cb->count - 1);
+}
+
+static inline struct modac_circ_buf_entry *cb_entry(struct modac_circ_buf *cb, 
+		unsigned long index)
+{
+	return (struct modac_circ_buf_entry *)((u8 *)cb->buf + index * cb->entry_size);
+}
+
+int modac_cb_init(struct modac_circ_buf *cb, unsigned long count, int data_length)
+{
+	struct modac_cb_storage *storage;
+	/* Keep the entries 32-bit aligned. */
+	int entry_size = ALIGN(CBUF_ENTRY_SIZE(data_length), 4);
+	/* The header occupies the whole first page, the entries follow. */
+	unsigned long size = PAGE_ALIGN(PAGE_SIZE + count * entry_size);
+	
+	if(!is_power_of_2(count))
+		return -EINVAL;
+	
+	storage = cb_storage_alloc(size);
+	if(storage == NULL)
+		return -ENOMEM;
+	
+	cb->storage = storage;
+	cb->hdr = (struct modac_event_ring_header *)storage->mem;
+	cb->buf = (struct modac_circ_buf_entry *)((u8 *)storage->mem + PAGE_SIZE);
+	
+	cb->stamps = vzalloc(count * sizeof(u32));
+	if(cb->stamps == NULL) {
+		kref_put(&storage->ref, cb_storage_release);
+		cb->storage = NULL;
+		return -ENOMEM;
+	}
+	
+	cb->count = count;
+	cb->data_length = entry_size - sizeof(struct modac_circ_buf_entry);
+	cb->entry_size = entry_size;
+	cb->head = 0;
 	cb->overflow_written = 0;
+	memset(&cb->stats, 0, sizeof(cb->stats));
+	
+	cb->hdr->head = 0;
+	cb->hdr->tail = 0;
+	cb->hdr->count = count;
+	cb->hdr->entry_size = entry_size;
+	cb->hdr->entry_offset = PAGE_SIZE;
+	
+	return 0;
+}
+
+void modac_cb_fini(struct modac_circ_buf *cb)
+{
+	if(cb->storage == NULL)
+		return;
+	
+	kref_put(&cb->storage->ref, cb_storage_release);
+	vfree(cb->stamps);
+	
+	cb->storage = NULL;
+	cb->stamps = NULL;
+	cb->hdr = NULL;
+	cb->buf = NULL;
+}
+
+static void cb_vma_open(struct vm_area_struct *vma)
+{
+	struct modac_cb_storage *storage = vma->vm_private_data;
+	
+	kref_get(&storage->ref);
+}
+
+static void cb_vma_close(struct vm_area_struct *vma)
+{
+	struct modac_cb_storage *storage = vma->vm_private_data;
+	
+	kref_put(&storage->ref, cb_storage_release);
+}
+
+static struct vm_operations_struct cb_vm_ops = {
+	.open = cb_vma_open,
+	.close = cb_vma_close,
+};
+
+static int cb_storage_mmap(struct modac_cb_storage *storage, 
+						   struct vm_area_struct *vma)
+{
+	unsigned long vsize = vma->vm_end - vma->vm_start;
+	int ret;
+	
+	if(vsize > storage->size) {
+		return -EINVAL;
+	}
+	
+	ret = remap_vmalloc_range(vma, storage->mem, 0);
+	if(ret)
+		return ret;
+	
+	vma->vm_private_data = storage;
+	vma->vm_ops = &cb_vm_ops;
+	cb_vma_open(vma);
+	
+	return 0;
+}
+
+int modac_cb_mmap(struct modac_circ_buf *cb, struct vm_area_struct *vma)
+{
+	/* 
+	 * Writing is only allowed to advance the 'tail' and that must be
+	 * visible to the kernel, so no private (COW) writable mappings.
+	 */
+	if((vma->vm_flags & VM_WRITE) && !(vma->vm_flags & VM_SHARED)) {
+		return -EINVAL;
+	}
+	
+	return cb_storage_mmap(cb->storage, vma);
 }
 
 int modac_cb_put(struct modac_circ_buf *cb, int event, void *data, int length, 
-				   wait_queue_head_t *wait_queue_events)
+				   u32 stamp, wait_queue_head_t *wait_queue_events)
 {
-	unsigned long head = cb->cb_events.head;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
-	unsigned long tail = ACCESS_ONCE(cb->cb_events.tail);
-#else
-	unsigned long tail = READ_ONCE(cb->cb_events.tail);
-#endif
+	unsigned long head = cb->head;
+	unsigned long tail = cb_tail(cb);
+	struct modac_circ_buf_entry *entry = cb_entry(cb, head);
 	int space;
 	
-	if(length > CBUF_EVENT_ENTRY_DATA_LENGTH) {
+	if(length > cb->data_length) {
 		printk(KERN_ERR "Too long for the CB: %d\n", length);
 		return -ENOMEM;
 	}
 
-	space = CIRC_SPACE(head, tail, CBUF_EVENT_COUNT);
+	space = CIRC_SPACE(head, tail, cb->count);
 	
 	if(space >= 1) {
 
@@ -53,11 +215,16 @@ int modac_cb_put(struct modac_circ_buf *cb, int event, void *data, int length,
 		
 		if(space > 1) {
 			
-			cb->buf[head].event = event;
-			cb->buf[head].length = length;
-			memcpy(&cb->buf[head].data, data, length);
+			entry->event = event;
+			entry->length = length;
+			memcpy(entry->data, data, length);
+			cb->stamps[head] = stamp;
 			cb->overflow_written = 0;
 			
+			cb->stats.put ++;
+			if(cb->count - space > cb->stats.high_water)
+				cb->stats.high_water = cb->count - space;
+			
 		} else {
 			
 			/* 
@@ -67,67 +234,248 @@ int modac_cb_put(struct modac_circ_buf *cb, int event, void *data, int length,
 			 * The incoming event is discarded.
 			 */
 			
-			if(!cb->overflow_written) {
-				cb->buf[head].event = MODAC_EVENT_READ_OVERFLOW;
-				cb->buf[head].length = 0;
-				cb->overflow_written = 1;
+			cb->stats.dropped ++;
+			
+			if(cb->overflow_written) {
+				/* 
+				 * The marker is still in the queue. The head must not
+				 * move over the slot which holds an already read entry.
+				 */
+				return -ENOMEM;
 			}
+			
+			entry->event = MODAC_EVENT_READ_OVERFLOW;
+			entry->length = 0;
+			cb->stamps[head] = 0;
+			cb->overflow_written = 1;
+			cb->stats.overflows ++;
 		}
 
 		smp_wmb(); /* commit the item before incrementing the head */
 		
-		cb->cb_events.head = (head + 1) & (CBUF_EVENT_COUNT - 1);
+		cb->head = (head + 1) & (cb->count - 1);
+		CB_WRITE_ONCE(cb->hdr->head, cb->head);
 	
 		/* wake_up() will make sure that the head is committed before
 		* waking anyone up */
-		wake_up_interruptible(wait_queue_events);
+		if(wait_queue_events != NULL)
+			wake_up_interruptible(wait_queue_events);
 		return 0;
 	} else {
+		cb->stats.dropped ++;
 		return -ENOMEM;
 	}
 }
 
-int modac_cb_get(struct modac_circ_buf *cb, u8 *buf)
+int modac_cb_peek(struct modac_circ_buf *cb, int max, struct modac_cb_span spans[2])
 {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
-	unsigned long head = ACCESS_ONCE(cb->cb_events.head);
-#else
-	unsigned long head = READ_ONCE(cb->cb_events.head);
-#endif
-	unsigned long tail = cb->cb_events.tail;
+	unsigned long head = CB_READ_ONCE(cb->head);
+	unsigned long tail = cb_tail(cb);
+	int count = min_t(int, CIRC_CNT(head, tail, cb->count), max);
+	int count_to_end = min_t(int, count, cb->count - tail);
+	
+	/* read index before reading contents at that index */
+	smp_rmb();
+	
+	spans[0].entries = cb_entry(cb, tail);
+	spans[0].count = count_to_end;
+	spans[0].index = tail;
+	spans[1].entries = cb_entry(cb, 0);
+	spans[1].count = count - count_to_end;
+	spans[1].index = 0;
+	
+	return count;
+}
 
-	if(CIRC_CNT(head, tail, CBUF_EVENT_COUNT) > 0) {
-		
-		struct modac_circ_buf_entry *entry;
-		
-		/* read index before reading contents at that index */
-		smp_mb();
-		
-		entry = &cb->buf[tail];
-		memcpy(buf, &entry->event, 2);
-		memcpy(buf + 2, entry->data, entry->length);
-		
-		smp_mb(); /* finish reading descriptor before incrementing tail */
+void modac_cb_consume(struct modac_circ_buf *cb, int count)
+{
+	unsigned long tail = cb_tail(cb);
+	
+	smp_mb(); /* finish reading the entries before incrementing tail */
+	
+	CB_WRITE_ONCE(cb->hdr->tail, (tail + count) & (cb->count - 1));
+}
 
-		cb->cb_events.tail = (tail + 1) & (CBUF_EVENT_COUNT - 1);
-		
-		return 2 + entry->length;
+int modac_cb_available(struct modac_circ_buf *cb)
+{
+	unsigned long head = CB_READ_ONCE(cb->head);
+	unsigned long tail = cb_tail(cb);
+
+	return CIRC_CNT(head, tail, cb->count) > 0;
+}
+
+int modac_cb_count(struct modac_circ_buf *cb)
+{
+	unsigned long head = CB_READ_ONCE(cb->head);
+	unsigned long tail = cb_tail(cb);
+
+	return CIRC_CNT(head, tail, cb->count);
+}
+
+static inline struct modac_event_log_entry *log_entry(struct modac_event_log *log, 
+		u32 seq)
+{
+	return (struct modac_event_log_entry *)((u8 *)log->buf + 
+			(seq & (log->count - 1)) * log->entry_size);
+}
+
+int modac_log_init(struct modac_event_log *log, unsigned long count, int data_length)
+{
+	struct modac_cb_storage *storage;
+	/* Keep the entries 32-bit aligned. */
+	int entry_size = ALIGN(sizeof(struct modac_event_log_entry) + data_length, 4);
+	unsigned long i;
+	/* The header occupies the whole first page, the entries follow. */
+	unsigned long size = PAGE_ALIGN(PAGE_SIZE + count * entry_size);
+	
+	/* The writer's invalidation (see modac_log_put) needs at least 2. */
+	if(!is_power_of_2(count) || count < 2)
+		return -EINVAL;
+	
+	storage = cb_storage_alloc(size);
+	if(storage == NULL)
+		return -ENOMEM;
+	
+	log->storage = storage;
+	log->hdr = (struct modac_event_log_header *)storage->mem;
+	log->buf = (u8 *)storage->mem + PAGE_SIZE;
+	
+	log->stamps = vzalloc(count * sizeof(u32));
+	log->lengths = vzalloc(count * sizeof(u8));
+	if(log->stamps == NULL || log->lengths == NULL) {
+		vfree(log->stamps);
+		vfree(log->lengths);
+		kref_put(&storage->ref, cb_storage_release);
+		log->storage = NULL;
+		log->stamps = NULL;
+		log->lengths = NULL;
+		return -ENOMEM;
 	}
 	
+	log->count = count;
+	log->data_length = entry_size - sizeof(struct modac_event_log_entry);
+	log->entry_size = entry_size;
+	log->head = 0;
+	log->put = 0;
+	
+	/* 
+	 * No entry may look valid before it is written: the sequence number 
+	 * of the slot 'i' is initialized to one that belongs to a different
+	 * slot.
+	 */
+	for(i = 0; i < count; i ++)
+		log_entry(log, i)->seq = (u32)i + 1;
+	
+	log->hdr->head = 0;
+	log->hdr->count = count;
+	log->hdr->entry_size = entry_size;
+	log->hdr->entry_offset = PAGE_SIZE;
+	
 	return 0;
 }
 
-int modac_cb_available(struct modac_circ_buf *cb)
+void modac_log_fini(struct modac_event_log *log)
 {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
-	unsigned long head = ACCESS_ONCE(cb->cb_events.head);
+	if(log->storage == NULL)
+		return;
+	
+	kref_put(&log->storage->ref, cb_storage_release);
+	vfree(log->stamps);
+	vfree(log->lengths);
+	
+	log->storage = NULL;
+	log->stamps = NULL;
+	log->lengths = NULL;
+	log->hdr = NULL;
+	log->buf = NULL;
+}
+
+int modac_log_mmap(struct modac_event_log *log, struct vm_area_struct *vma)
+{
+	/* The log is shared by all the readers, nobody may write to it. */
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+	vm_flags_clear(vma, VM_MAYWRITE);
 #else
-	unsigned long head = READ_ONCE(cb->cb_events.head);
+	vma->vm_flags &= ~VM_MAYWRITE;
 #endif
-	unsigned long tail = cb->cb_events.tail;
-
-	return CIRC_CNT(head, tail, CBUF_EVENT_COUNT) > 0;
+	
+	return cb_storage_mmap(log->storage, vma);
 }
 
+void modac_log_put(struct modac_event_log *log, int event, void *data, int length, 
+				   int ext_length, u32 stamp)
+{
+	u32 seq = log->head;
+	struct modac_event_log_entry *entry = log_entry(log, seq);
+	
+	if(ext_length > log->data_length)
+		ext_length = log->data_length;
+	
+	/* 
+	 * Invalidate the slot first: the readers of the previous entry in the
+	 * slot (seq - count) must see that it is being overwritten. Any value
+	 * other than these two would do; seq - 1 belongs to a different slot.
+	 */
+	CB_WRITE_ONCE(entry->seq, seq - 1);
+	smp_wmb();
+	
+	entry->event = event;
+	entry->length = ext_length;
+	memcpy(entry->data, data, ext_length);
+	log->stamps[seq & (log->count - 1)] = stamp;
+	log->lengths[seq & (log->count - 1)] = length;
+	
+	smp_wmb(); /* commit the item before validating it */
+	CB_WRITE_ONCE(entry->seq, seq);
+	
+	smp_wmb(); /* validate the item before incrementing the head */
+	log->head = seq + 1;
+	CB_WRITE_ONCE(log->hdr->head, seq + 1);
+	
+	log->put ++;
+}
 
+u32 modac_log_head(struct modac_event_log *log)
+{
+	u32 head = CB_READ_ONCE(log->head);
+	
+	/* read the head before reading the entries */
+	smp_rmb();
+	
+	return head;
+}
 
+int modac_log_get(struct modac_event_log *log, u32 seq, 
+				  struct modac_circ_buf_entry *dst, int data_length, u32 *stamp)
+{
+	struct modac_event_log_entry *entry = log_entry(log, seq);
+	int length;
+	
+	if(CB_READ_ONCE(entry->seq) != seq)
+		return -EOVERFLOW;
+	
+	smp_rmb(); /* read the sequence number before the contents */
+	
+	if(data_length < log->data_length)
+		length = log->lengths[seq & (log->count - 1)];
+	else
+		length = CB_READ_ONCE(entry->length);
+	if(length > data_length)
+		length = data_length;
+	
+	dst->event = CB_READ_ONCE(entry->event);
+	dst->length = length;
+	memcpy(dst->data, entry->data, length);
+	if(stamp != NULL)
+		*stamp = log->stamps[seq & (log->count - 1)];
+	
+	smp_rmb(); /* read the contents before checking the sequence number again */
+	
+	if(CB_READ_ONCE(entry->seq) != seq)
+		return -EOVERFLOW;
+	
+	return 0;
+}
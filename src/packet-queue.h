@@ -10,39 +10,34 @@
 #ifndef PACKET_QUEUE_H_
 #define PACKET_QUEUE_H_
 
-#ifdef DBG_MEASURE_TIME_FROM_IRQ_TO_USER
-// TODO: temporarily, to set DBG_MEASURE_TIME_FROM_IRQ_TO_USER
-#include "linux-evrma.h"
-#warning **********************************************************************
-#warning **********************************************************************
-#warning **********************************************************************
-#warning Please, remove #include "linux-evrma.h" now that it is not needed anymore.
-#warning **********************************************************************
-#warning **********************************************************************
-#warning **********************************************************************
-#endif
-
 /*
  * NOTE: According to Documentation/circular-buffers.txt all of these functions
- * (except modac_cb_init) must be protected with a spin lock.
+ * (except modac_cb_init, modac_cb_fini and modac_cb_mmap) must be protected 
+ * with a spin lock.
+ * 
+ * The ring (header + entries) is allocated in the pages that can be mmap-ed
+ * to the user space (see struct modac_event_ring_header). The consumer in the
+ * user space advances the 'tail' in the shared header directly. The 'head' is
+ * kept in the kernel (the one in the shared header is just a published copy)
+ * and the 'tail' obtained from the shared header is always masked so the
+ * consumer can't corrupt the kernel side.
  */
 
-#define CBUF_EVENT_COUNT 1024 /* must be a power of 2 */
-
-#ifdef DBG_MEASURE_TIME_FROM_IRQ_TO_USER
-	
-#define CBUF_EVENT_ENTRY_DATA_LENGTH 28
-
-#else
-
 /* 
- * Up to 3 words of data allowed. Note that the struct modac_circ_buf_entry
- * will have 4 words in total.
+ * Up to 3 words of data allowed. Note that the entry will have 4 words 
+ * in total.
  */
 #define CBUF_EVENT_ENTRY_DATA_LENGTH 12
-	
-#endif
 
+/* 
+ * The data length of a queue with the extended entries, 8 words in total.
+ */
+#define CBUF_EVENT_ENTRY_DATA_LENGTH_EXT 28
+
+/*
+ * The layout must match the struct modac_event_ring_entry from linux-modac.h.
+ * The entries of a queue are modac_circ_buf.entry_size bytes apart.
+ */
 struct modac_circ_buf_entry {
 	/*
 	 * The event is stored as an int value throughout the system and
@@ -51,27 +46,180 @@ struct modac_circ_buf_entry {
 	 */
 	u16 event;
 	u16 length;
-	u8  data[CBUF_EVENT_ENTRY_DATA_LENGTH];
+	u8  data[];
+};
+
+#define CBUF_ENTRY_SIZE(data_length) \
+	(sizeof(struct modac_circ_buf_entry) + (data_length))
+
+struct modac_cb_storage;
+
+/* 
+ * The producer side statistics, updated by modac_cb_put (under the 
+ * caller's lock).
+ */
+struct modac_cb_stats {
+	/* the events stored */
+	u32 put;
+	/* the events discarded because the queue was full */
+	u32 dropped;
+	/* the MODAC_EVENT_READ_OVERFLOW markers inserted */
+	u32 overflows;
+	/* the max. number of the entries in the queue */
+	u32 high_water;
 };
 
 struct modac_circ_buf {
-	struct circ_buf               cb_events;
+	/* The number of entries, a power of 2 */
+	unsigned long                 count;
+	/* The max. data length of an entry and the size of the whole entry */
+	int                           data_length;
+	int                           entry_size;
+	/* The kernel's copy of the head, published to hdr->head. */
+	unsigned long                 head;
 	int                           overflow_written;
-	struct modac_circ_buf_entry   buf[CBUF_EVENT_COUNT];
+	struct modac_cb_stats         stats;
+	
+	struct modac_event_ring_header *hdr;
+	struct modac_circ_buf_entry   *buf;
+	/* 
+	 * The latency stamps (see lat_stamp) of the entries. Kept in the kernel 
+	 * only, not mmap-ed.
+	 */
+	u32                           *stamps;
+	
+	/* refcounted; outlives the modac_circ_buf while it is mmap-ed */
+	struct modac_cb_storage       *storage;
 };
 
-void modac_cb_init(struct modac_circ_buf *cb);
+/* 
+ * Allocates the ring for 'count' entries with up to 'data_length' bytes of
+ * data each. 'count' must be a power of 2.
+ * Return negative value on error.
+ */
+int modac_cb_init(struct modac_circ_buf *cb, unsigned long count, int data_length);
+void modac_cb_fini(struct modac_circ_buf *cb);
+
+/* Maps the ring (header + entries) to the user space. */
+int modac_cb_mmap(struct modac_circ_buf *cb, struct vm_area_struct *vma);
 
-/* Return negative value on error */
+/* 
+ * Return negative value on error. If 'wait_queue_events' is NULL nobody is
+ * woken up and the caller is responsible for that. The data longer than 
+ * the data_length of the queue is refused. The 'stamp' is kept along
+ * with the entry, 0 if none.
+ */
 int modac_cb_put(struct modac_circ_buf *cb, int event, void *data, int length, 
-				   wait_queue_head_t *wait_queue_events);
+				   u32 stamp, wait_queue_head_t *wait_queue_events);
+
+/* A contiguous part of the available entries. */
+struct modac_cb_span {
+	struct modac_circ_buf_entry *entries;
+	int count;
+	/* the ring index of the first entry */
+	unsigned long index;
+};
 
 /* 
- * Return number of message bytes. 'buf' must be able to accomodate
- * CBUF_EVENT_ENTRY_DATA_LENGTH + 2 bytes. 
+ * Reserves up to 'max' available entries without consuming them. They are
+ * returned in (at most) two contiguous spans, the second one being non-empty
+ * only if the entries wrap around the end of the ring. Returns the number 
+ * of the reserved entries. Only one reader may have the entries reserved
+ * at a time.
  */
-int modac_cb_get(struct modac_circ_buf *cb, u8 *buf);
+int modac_cb_peek(struct modac_circ_buf *cb, int max, struct modac_cb_span spans[2]);
+/* Return the i-th entry of the span. */
+static inline struct modac_circ_buf_entry *modac_cb_span_entry(
+		struct modac_circ_buf *cb, struct modac_cb_span *span, int i)
+{
+	return (struct modac_circ_buf_entry *)((u8 *)span->entries + i * cb->entry_size);
+}
+/* Return the stamp of the i-th entry of the span. */
+static inline u32 modac_cb_span_stamp(
+		struct modac_circ_buf *cb, struct modac_cb_span *span, int i)
+{
+	return cb->stamps[span->index + i];
+}
+
+/* Consumes 'count' entries previously reserved by modac_cb_peek. */
+void modac_cb_consume(struct modac_circ_buf *cb, int count);
+
 /* Return non-zero if data available. */
 int modac_cb_available(struct modac_circ_buf *cb);
 
+/* Return the number of the available entries. */
+int modac_cb_count(struct modac_circ_buf *cb);
+
+/*
+ * The event log: a ring that is written once and read by many readers, each
+ * with its own cursor (the sequence number of the next entry to read). The
+ * writer never waits for the readers, a reader that falls behind by more
+ * than 'count' entries finds them overwritten.
+ * 
+ * modac_log_put must be protected with a spin lock, the readers need no lock
+ * (modac_log_get detects an entry that is overwritten while being read).
+ * The layout is the struct modac_event_log_header from linux-modac.h
+ * followed by the entries.
+ */
+struct modac_event_log {
+	/* The number of entries, a power of 2 */
+	unsigned long                 count;
+	/* The max. data length of an entry and the size of the whole entry */
+	int                           data_length;
+	int                           entry_size;
+	/* 
+	 * The kernel's copy of the head (the sequence number of the next 
+	 * entry), published to hdr->head. 
+	 */
+	u32                           head;
+	/* the events stored */
+	u32                           put;
+	
+	struct modac_event_log_header *hdr;
+	u8                            *buf;
+	/* The latency stamps of the entries, kept in the kernel only. */
+	u32                           *stamps;
+	/* 
+	 * The data lengths of the entries for the readers with the regular 
+	 * (shorter) entries, kept in the kernel only.
+	 */
+	u8                            *lengths;
+	
+	/* refcounted; outlives the modac_event_log while it is mmap-ed */
+	struct modac_cb_storage       *storage;
+};
+
+/* 
+ * Allocates the log for 'count' entries with up to 'data_length' bytes of
+ * data each. 'count' must be a power of 2, at least 2.
+ * Return negative value on error.
+ */
+int modac_log_init(struct modac_event_log *log, unsigned long count, int data_length);
+void modac_log_fini(struct modac_event_log *log);
+
+/* Maps the log (header + entries) to the user space, read-only. */
+int modac_log_mmap(struct modac_event_log *log, struct vm_area_struct *vma);
+
+/* 
+ * Writes the event as the entry 'head', overwriting the oldest one. The
+ * 'data' holds 'ext_length' bytes, the readers with the regular entries get
+ * only the first 'length' bytes of it (see modac_mngdev_put_event_ext). The
+ * data longer than the data_length of the log is truncated.
+ */
+void modac_log_put(struct modac_event_log *log, int event, void *data, int length, 
+				   int ext_length, u32 stamp);
+
+/* Return the sequence number of the next entry to be written. */
+u32 modac_log_head(struct modac_event_log *log);
+
+/* 
+ * Copies the entry 'seq' to 'dst' with up to 'data_length' bytes of data and
+ * its latency stamp to 'stamp' (if not NULL). A 'data_length' shorter than
+ * the one of the log gets the regular 'length' given to modac_log_put.
+ * 'seq' must be before the head. Return -EOVERFLOW if the entry was 
+ * overwritten already (the contents of 'dst' are invalid then).
+ */
+int modac_log_get(struct modac_event_log *log, u32 seq, 
+				  struct modac_circ_buf_entry *dst, int data_length, u32 *stamp);
+
 #endif /* PACKET_QUEUE_H_ */
@@ -624,6 +624,27 @@ static u32 e_read_u32(struct modac_mngdev_des *devdes, u32 offset)
 	return ioread32(io_start + offset);
 }
 
+static void e_read_block_u32(struct modac_mngdev_des *devdes, u32 offset, 
+						u32 *dest, int count)
+{
+	void __iomem *io_start = (void __iomem *)devdes->io_start;
+	int i;
+	
+	// one 32-bit read per word, without the barriers of each ioread32
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,4,0)
+	__ioread32_copy(dest, io_start + offset, count);
+#else
+	for(i = 0; i < count; i ++) {
+		dest[i] = __raw_readl(io_start + offset + (i << 2));
+	}
+#endif
+	
+	// ioread32 is little endian; a no-op on x86
+	for(i = 0; i < count; i ++) {
+		le32_to_cpus(&dest[i]);
+	}
+}
+
 static void e_write_u32(struct modac_mngdev_des *devdes, u32 offset, u32 value)
 {
 	void __iomem *io_start = (void __iomem *)devdes->io_start;
@@ -647,6 +668,7 @@ static struct modac_io_rw_plugin pci_rw_io_plugin = {
 	read_u16: e_read_u16,
 	write_u32: e_write_u32,
 	read_u32: e_read_u32,
+	read_block_u32: e_read_block_u32,
 };
 
 static int sease_a_slot(void)
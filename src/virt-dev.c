@@ -17,13 +17,19 @@
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/mutex.h>
+#include <linux/rtmutex.h>
+#include <linux/rculist.h>
 #include <linux/version.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 #include "internal.h"
 #include "event-list.h"
 #include "mng-dev.h"
 #include "virt-dev.h"
 #include "packet-queue.h"
+#include "lat-hist.h"
 
 #ifndef RHEL_RELEASE_VERSION
 #define RHEL_RELEASE_VERSION(...) 0
@@ -31,6 +37,7 @@
 
 enum {
 	CLEAN_PRIV,
+	CLEAN_CB,
 	CLEAN_DEV,
 	CLEAN_ALL = CLEAN_DEV
 };
@@ -44,20 +51,154 @@ enum {
 };
 
 
+/*
+ * One event queue with its readers. The VIRT_DEV has the shared one, the
+ * open files that asked for it have their own (see 
+ * VIRT_DEV_IOC_PRIVATE_QUEUE).
+ */
+struct vdev_queue {
+	/* 
+	 * The producers of 'cb_events' and the 'notified_events' are protected
+	 * by the put_lock of the VIRT_DEV.
+	 */
+	struct event_list_type notified_events;
+	struct modac_circ_buf cb_events;
+	
+	/* 
+	 * Serializes the readers of 'cb_events'. It is taken once per read() and
+	 * is never used in the interrupts nor by the lower priority management 
+	 * threads. The readers of one queue may run at different priorities,
+	 * so it is an rt_mutex: a reader preempted while holding it inherits 
+	 * the priority of the waiting one. It is held only for copying at most
+	 * VIRT_DEV_READ_MAX_LEN bytes.
+	 */
+	struct rt_mutex cb_reader_mutex;
+	/* The blocked read()s wait exclusively, poll() does not. */
+	wait_queue_head_t wait_queue_events;
+	
+	/* 
+	 * VIRT_DEV_READ_FORMAT_..., changed under the cb_reader_mutex. A read()
+	 * takes it once and passes it on.
+	 */
+	int read_format;
+	
+	/* non-zero if events were put since the last wakeup */
+	atomic_t wake_pending;
+	/* 
+	 * The latency stamp of the first event put since the last wakeup,
+	 * protected by the put_lock.
+	 */
+	u32 wake_stamp;
+	
+	/* 
+	 * Only if the VIRT_DEV reads from the MNG_DEV's event log. The events
+	 * are not put to the 'cb_events' then (it only defines the entry 
+	 * format); the queue is just the sequence number of the next log 
+	 * entry to read, changed under the cb_reader_mutex. 'log_pending' 
+	 * counts the events logged for this queue since the reader took them 
+	 * over and 'log_first' is the sequence number of the first of them
+	 * (both changed under the put_lock). 'log_overrun' is set when the
+	 * producer found some of them overwritten (see queue_log_track).
+	 */
+	u32 log_cursor;
+	atomic_t log_pending;
+	u32 log_first;
+	atomic_t log_overrun;
+	
+	/* 
+	 * The delivery statistics, see also the cb_events.stats. Updated 
+	 * without locking, the values are informative only.
+	 */
+	u32 stats_wakeups;
+	u32 stats_reads;
+	u64 stats_events_read;
+	/* the max. observed log lag and the overruns of the log_cursor */
+	u32 stats_log_lag_max;
+	u32 stats_log_overruns;
+};
+
+struct vdev_data;
+
+/* The private data of an open VIRT_DEV file. */
+struct vdev_file {
+	struct vdev_data *vdev;
+	
+	/* 
+	 * The queue read by this file: the VIRT_DEV's shared queue or the
+	 * 'own_queue'. Changes only once, to the 'own_queue'.
+	 */
+	struct vdev_queue *queue;
+	
+	/* In the VIRT_DEV 'files' while the 'own_queue' is used. */
+	struct list_head item;
+	
+	/* If non-zero, only the events in the 'filter' are put to the 'own_queue'. */
+	int filtered;
+	struct event_list_type filter;
+	
+	struct vdev_queue own_queue;
+};
+
 struct vdev_data {
 	dev_t devt;
 	struct device *dev;
 	
 	struct modac_vdev_des *des;
 	
-	struct event_list_type notified_events;
-	struct modac_circ_buf cb_events;
+	/* 
+	 * Serializes the producers of all the queues of this VIRT_DEV and 
+	 * protects their 'notified_events'. The producers don't share any lock
+	 * with the other VIRT_DEVs.
+	 */
+	spinlock_t put_lock;
 	
-	/* This lock is not used in the interrupts. */
-	spinlock_t	cb_reader_lock;
-	wait_queue_head_t wait_queue_events;
+	/* The queue shared by all the open files without a private one. */
+	struct vdev_queue queue;
+	
+	/* 
+	 * The open files with a private queue. The producers walk the list
+	 * under RCU, it is changed under the files_mutex.
+	 */
+	struct list_head files;
+	struct mutex files_mutex;
+	int open_count;
+	int private_count;
+	/* 
+	 * Zero if all the open files have a private queue; the shared queue
+	 * is not filled then.
+	 */
+	int put_shared;
+	
+	/* 
+	 * The events read() takes from the event log (the subscriptions of the
+	 * VIRT_DEV), protected by the put_lock.
+	 */
+	struct event_list_type log_events;
+	
+	/* 
+	 * The wakeup policy (see struct vdev_ioctl_wakeup_policy) and state,
+	 * protected by the put_lock. The policy applies to all the queues.
+	 */
+	u32 wake_min_events;
+	u32 wake_max_latency_us;
+	struct event_list_type wake_urgent_events;
+	int wake_timer_armed;
+	struct hrtimer wake_timer;
 };
 
+/* 
+ * The VIRT_DEV_IOC_STATUS_GET as defined before the 'queue_depth' was added 
+ * to the struct vdev_ioctl_status. Still served for the old binaries.
+ */
+#define VIRT_DEV_IOC_STATUS_GET_V1	_IOC(_IOC_READ | _IOC_WRITE, \
+		VIRT_DEV_IOC_MAGIC, 2, offsetof(struct vdev_ioctl_status, queue_depth))
+
+/* 
+ * The number of events that are collected on the stack before calling
+ * copy_to_user in the VIRT_DEV_READ_FORMAT_PACKED format.
+ */
+#define READ_CHUNK_EVENTS 16
+
 struct vdev_table_item {
 	
 	/*
@@ -88,17 +229,240 @@ static struct vdev_table_item *vdev_table;
 static struct mutex    vdev_table_mutex;
 
 
-static void init_dev(struct vdev_data *vdev)
+static inline void vdev_put_lock(struct vdev_data *vdev, unsigned long *flags)
+{
+	if(!spin_trylock_irqsave(&vdev->put_lock, *flags)) {
+		spin_lock_irqsave(&vdev->put_lock, *flags);
+		vdev->des->put_lock_contended ++;
+	}
+}
+
+static inline void vdev_put_unlock(struct vdev_data *vdev, unsigned long flags)
+{
+	spin_unlock_irqrestore(&vdev->put_lock, flags);
+}
+
+/* 
+ * Must be called with the put_lock held when the readers of the 'queue' are
+ * to be woken up.
+ */
+static inline void queue_lat_wakeup(struct vdev_data *vdev, struct vdev_queue *queue)
+{
+	if(queue->wake_stamp != 0) {
+		lat_hist_add(&vdev->des->lat_wakeup, queue->wake_stamp, lat_stamp());
+		queue->wake_stamp = 0;
+	}
+}
+
+static inline void queue_wake(struct vdev_queue *queue)
+{
+	queue->stats_wakeups ++;
+	wake_up_interruptible(&queue->wait_queue_events);
+}
+
+/* 
+ * The number of the events waiting in the queue. In the event log only the
+ * events logged for this queue count, not the others in between.
+ */
+static inline u32 queue_count(struct vdev_data *vdev, struct vdev_queue *queue)
+{
+	struct modac_event_log *log = vdev->des->event_log;
+	
+	if(log != NULL)
+		return atomic_read(&queue->log_pending);
+	
+	return modac_cb_count(&queue->cb_events);
+}
+
+/* 
+ * How far the first event logged for the queue and not read yet is behind 
+ * the head of the event log, 0 if there is none. With the put_lock held.
+ */
+static inline u32 queue_log_lag(struct vdev_data *vdev, struct vdev_queue *queue)
+{
+	if(!atomic_read(&queue->log_pending))
+		return 0;
+	
+	return modac_log_head(vdev->des->event_log) - queue->log_first;
+}
+
+/* The max. number of the events that can wait in the queue. */
+static inline u32 queue_capacity(struct vdev_data *vdev, struct vdev_queue *queue)
+{
+	struct modac_event_log *log = vdev->des->event_log;
+	
+	if(log != NULL)
+		return log->count;
+	
+	return queue->cb_events.count - 1;
+}
+
+/* 
+ * With the put_lock held. Returns 1 if the readers of the 'queue' are to be
+ * woken up according to the wakeup policy, otherwise arms the wake_timer
+ * if the policy says so.
+ */
+static int queue_wakeup_due(struct vdev_data *vdev, struct vdev_queue *queue)
+{
+	if(!atomic_read(&queue->wake_pending)) {
+		/* woken up meanwhile */
+		return 0;
+	}
+	
+	/* A private queue can be shorter than the policy expects. */
+	if(queue_count(vdev, queue) >= 
+			min_t(u32, vdev->wake_min_events, queue_capacity(vdev, queue))) {
+		atomic_set(&queue->wake_pending, 0);
+		queue_lat_wakeup(vdev, queue);
+		return 1;
+	}
+	
+	if(vdev->wake_max_latency_us != 0 && !vdev->wake_timer_armed) {
+		vdev->wake_timer_armed = 1;
+		hrtimer_start(&vdev->wake_timer, 
+				ns_to_ktime((u64)vdev->wake_max_latency_us * NSEC_PER_USEC),
+				HRTIMER_MODE_REL);
+	}
+	
+	return 0;
+}
+
+/* The max_latency_us of the wakeup policy expired. */
+static enum hrtimer_restart wake_timer_fn(struct hrtimer *timer)
+{
+	struct vdev_data *vdev = container_of(timer, struct vdev_data, wake_timer);
+	struct vdev_file *file;
+	unsigned long flags;
+	int wake;
+	
+	vdev_put_lock(vdev, &flags);
+	vdev->wake_timer_armed = 0;
+	wake = atomic_xchg(&vdev->queue.wake_pending, 0);
+	if(wake)
+		queue_lat_wakeup(vdev, &vdev->queue);
+	vdev_put_unlock(vdev, flags);
+	
+	if(wake)
+		queue_wake(&vdev->queue);
+	
+	rcu_read_lock();
+	list_for_each_entry_rcu(file, &vdev->files, item) {
+		
+		vdev_put_lock(vdev, &flags);
+		wake = atomic_xchg(&file->own_queue.wake_pending, 0);
+		if(wake)
+			queue_lat_wakeup(vdev, &file->own_queue);
+		vdev_put_unlock(vdev, flags);
+		
+		if(wake)
+			queue_wake(&file->own_queue);
+	}
+	rcu_read_unlock();
+	
+	return HRTIMER_NORESTART;
+}
+
+static int queue_init(struct vdev_data *vdev, struct vdev_queue *queue, 
+		u32 depth, int read_format)
+{
+	struct modac_event_log *log = vdev->des->event_log;
+	int ret;
+	
+	/* The events are not stored in the queue if taken from the log. */
+	if(log != NULL)
+		depth = MODAC_VDEV_QUEUE_DEPTH_MIN;
+	
+	ret = modac_cb_init(&queue->cb_events, depth, vdev->des->entry_data_length);
+	if(ret)
+		return ret;
+	
+	/* Only the events logged from now on. */
+	queue->log_cursor = log != NULL ? modac_log_head(log) : 0;
+	atomic_set(&queue->log_pending, 0);
+	queue->log_first = 0;
+	atomic_set(&queue->log_overrun, 0);
+	
+	event_list_clear(&queue->notified_events);
+	rt_mutex_init(&queue->cb_reader_mutex);
+	init_waitqueue_head(&queue->wait_queue_events);
+	queue->read_format = read_format;
+	atomic_set(&queue->wake_pending, 0);
+	queue->wake_stamp = 0;
+	queue->stats_wakeups = 0;
+	queue->stats_reads = 0;
+	queue->stats_events_read = 0;
+	queue->stats_log_lag_max = 0;
+	queue->stats_log_overruns = 0;
+	
+	return 0;
+}
+
+static void queue_fini(struct vdev_queue *queue)
+{
+	modac_cb_fini(&queue->cb_events);
+}
+
+static void queue_reset_stats(struct vdev_data *vdev, struct vdev_queue *queue)
+{
+	unsigned long flags;
+	
+	vdev_put_lock(vdev, &flags);
+	memset(&queue->cb_events.stats, 0, sizeof(queue->cb_events.stats));
+	vdev_put_unlock(vdev, flags);
+	
+	queue->stats_wakeups = 0;
+	queue->stats_reads = 0;
+	queue->stats_events_read = 0;
+	queue->stats_log_lag_max = 0;
+	queue->stats_log_overruns = 0;
+}
+
+/* With the files_mutex held. */
+static void update_put_shared(struct vdev_data *vdev)
+{
+	WRITE_ONCE(vdev->put_shared, 
+			vdev->private_count == 0 || vdev->open_count > vdev->private_count);
+}
+
+static int init_dev(struct vdev_data *vdev)
 {
-	modac_cb_init(&vdev->cb_events);
-	spin_lock_init(&vdev->cb_reader_lock);
-	init_waitqueue_head(&vdev->wait_queue_events);
+	int ret;
+	
+	ret = queue_init(vdev, &vdev->queue, vdev->des->queue_depth, 
+			VIRT_DEV_READ_FORMAT_PACKED);
+	if(ret)
+		return ret;
+	
+	event_list_clear(&vdev->log_events);
+	
+	INIT_LIST_HEAD(&vdev->files);
+	mutex_init(&vdev->files_mutex);
+	vdev->open_count = 0;
+	vdev->private_count = 0;
+	vdev->put_shared = 1;
 	
 	spin_lock_init(&vdev->des->direct_access_spinlock);
 	vdev->des->direct_access_denied = 0;
 	vdev->des->direct_access_active_count = 0;
 	
-	event_list_clear(&vdev->notified_events);
+	spin_lock_init(&vdev->put_lock);
+	vdev->des->put_lock_contended = 0;
+	lat_hist_reset(&vdev->des->lat_enqueue);
+	lat_hist_reset(&vdev->des->lat_wakeup);
+	lat_hist_reset(&vdev->des->lat_copy);
+	
+	vdev->wake_min_events = 1;
+	vdev->wake_max_latency_us = 0;
+	event_list_clear(&vdev->wake_urgent_events);
+	vdev->wake_timer_armed = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,13,0)
+	hrtimer_setup(&vdev->wake_timer, wake_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&vdev->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	vdev->wake_timer.function = wake_timer_fn;
+#endif
+	
+	return 0;
 }
 
 static inline int dev_name_equal(struct device *dev, void *arg)
@@ -125,6 +489,9 @@ static void cleanup(struct vdev_data *vdev, int what)
 	switch(what) {
 	case CLEAN_DEV:
 		device_destroy(modac_vdev_class, vdev->devt);
+	case CLEAN_CB:
+		hrtimer_cancel(&vdev->wake_timer);
+		queue_fini(&vdev->queue);
 	case CLEAN_PRIV:
 		kfree(vdev);
 	}
@@ -153,6 +520,7 @@ static inline int calc_table_indices(int minor, int *imngdev, int *ivdev)
 static int vdev_open(struct inode *inode, struct file *filp)
 {
 	struct vdev_data *vdev;
+	struct vdev_file *file;
 	int ret = 0;
 	int imngdev, ivdev;
 	
@@ -160,6 +528,10 @@ static int vdev_open(struct inode *inode, struct file *filp)
 	if(ret)
 		return ret;
 	
+	file = kzalloc(sizeof(struct vdev_file), GFP_KERNEL);
+	if(file == NULL)
+		return -ENOMEM;
+	
 	/* Locate the device associated with the minor number.
 	 * Look it up in the table; if found then obtain a
 	 * reference (i.e., increment the reference count)
@@ -168,6 +540,7 @@ static int vdev_open(struct inode *inode, struct file *filp)
 	
 	if(vdev_table[imngdev].vdev[ivdev] == NULL) {
 		mutex_unlock(&vdev_table_mutex);
+		kfree(file);
 		return -ENODEV;
 	}
 	
@@ -176,11 +549,21 @@ static int vdev_open(struct inode *inode, struct file *filp)
 	ret = modac_c_vdev_on_open(vdev->des, inode);
 	if(ret) {
 		mutex_unlock(&vdev_table_mutex);
+		kfree(file);
 		printk(KERN_ERR "vdev_open fail: ret=%d, imngdev=%d, ivdev=%d\n", ret, imngdev, ivdev);
 		return ret;
 	}
 	
-	filp->private_data = (void *)vdev;
+	file->vdev = vdev;
+	file->queue = &vdev->queue;
+	INIT_LIST_HEAD(&file->item);
+	
+	mutex_lock(&vdev->files_mutex);
+	vdev->open_count ++;
+	update_put_shared(vdev);
+	mutex_unlock(&vdev->files_mutex);
+	
+	filp->private_data = (void *)file;
 	
 	mutex_unlock(&vdev_table_mutex);
 
@@ -189,13 +572,83 @@ static int vdev_open(struct inode *inode, struct file *filp)
 
 static int vdev_release(struct inode *inode, struct file *filp)
 {
-	struct vdev_data *vdev = (struct vdev_data *)filp->private_data;
+	struct vdev_file *file = (struct vdev_file *)filp->private_data;
+	struct vdev_data *vdev = file->vdev;
+	int own = file->queue == &file->own_queue;
+	
+	mutex_lock(&vdev->files_mutex);
+	if(own) {
+		list_del_rcu(&file->item);
+		vdev->private_count --;
+	}
+	vdev->open_count --;
+	update_put_shared(vdev);
+	mutex_unlock(&vdev->files_mutex);
+	
+	if(own) {
+		/* No producer (nor the wake_timer) can see the 'own_queue' anymore. */
+		synchronize_rcu();
+		queue_fini(&file->own_queue);
+	}
 	
+	/* Can destroy the VIRT_DEV. */
 	modac_c_vdev_on_close(vdev->des, inode, vdev->dev);
+	
+	kfree(file);
 
 	return 0;
 }
 
+/*
+ * Gives the open file its own queue. The events (and the notifications)
+ * the VIRT_DEV gets are put to it, too, filtered if requested. Called under
+ * the devref lock.
+ */
+static int vdev_file_set_private_queue(struct vdev_file *file, 
+		struct vdev_ioctl_private_queue *args)
+{
+	struct vdev_data *vdev = file->vdev;
+	u32 depth = args->queue_depth;
+	int ret;
+	
+	if(args->flags & ~VIRT_DEV_PRIVATE_QUEUE_FLAG_FILTER)
+		return -EINVAL;
+	
+	if(depth == 0) {
+		depth = vdev->des->queue_depth;
+	} else if(depth < MODAC_VDEV_QUEUE_DEPTH_MIN || 
+			depth > MODAC_VDEV_QUEUE_DEPTH_MAX || !is_power_of_2(depth)) {
+		return -EINVAL;
+	}
+	
+	mutex_lock(&vdev->files_mutex);
+	
+	if(file->queue == &file->own_queue) {
+		ret = -EBUSY;
+		goto bail;
+	}
+	
+	ret = queue_init(vdev, &file->own_queue, depth, vdev->queue.read_format);
+	if(ret)
+		goto bail;
+	
+	file->filtered = (args->flags & VIRT_DEV_PRIVATE_QUEUE_FLAG_FILTER) != 0;
+	event_list_from_u32(&file->filter, args->events, VIRT_DEV_EVENT_BITMAP_WORDS);
+	
+	/* The queue must be complete before the producers and readers see it. */
+	list_add_tail_rcu(&file->item, &vdev->files);
+	smp_store_release(&file->queue, &file->own_queue);
+	
+	vdev->private_count ++;
+	update_put_shared(vdev);
+	
+bail:
+
+	mutex_unlock(&vdev->files_mutex);
+	
+	return ret;
+}
+
 static inline void unlock_direct_call(struct modac_vdev_des *vdev_des)
 {
 	spin_lock(&vdev_des->direct_access_spinlock);
@@ -227,11 +680,34 @@ static inline int lock_direct_call(struct modac_vdev_des *vdev_des)
 }
 
 
-static int read_has_data(struct vdev_data *vdev);
+static int vdev_set_wakeup_policy(struct vdev_data *vdev, 
+		struct vdev_ioctl_wakeup_policy *policy)
+{
+	struct event_list_type urgent_events;
+	unsigned long flags;
+	
+	if(policy->min_events >= vdev->des->queue_depth)
+		return -EINVAL;
+	
+	event_list_from_u32(&urgent_events, policy->urgent_events, 
+			VIRT_DEV_EVENT_BITMAP_WORDS);
+	
+	vdev_put_lock(vdev, &flags);
+	vdev->wake_min_events = max_t(u32, policy->min_events, 1);
+	vdev->wake_max_latency_us = policy->max_latency_us;
+	vdev->wake_urgent_events = urgent_events;
+	vdev_put_unlock(vdev, flags);
+	
+	/* Don't leave the readers waiting for what the old policy promised. */
+	modac_vdev_flush_wakeup(vdev->des);
+	
+	return 0;
+}
 
 static long vdev_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	struct vdev_data *vdev = (struct vdev_data *)filp->private_data;
+	struct vdev_file *file = (struct vdev_file *)filp->private_data;
+	struct vdev_data *vdev = file->vdev;
 	int ret = 0;
 	
 	/* Check that cmd is valid */
@@ -327,17 +803,83 @@ static long vdev_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned lo
 		break;
 	}
 
+	case VIRT_DEV_IOC_SUBSCRIBE_BULK:
+	{
+		struct vdev_ioctl_subscribe_bulk bulk_args;
+		struct event_list_type events;
+		
+		if (copy_from_user(&bulk_args, (void *)arg, sizeof(struct vdev_ioctl_subscribe_bulk))) {
+			ret = -EFAULT;
+			goto bail;
+		}
+		
+		event_list_from_u32(&events, bulk_args.events, VIRT_DEV_EVENT_BITMAP_WORDS);
+		
+		ret = modac_c_vdev_subscribe_bulk(vdev->des, &events, bulk_args.action);
+
+		break;
+	}
+
+	case VIRT_DEV_IOC_VECTOR:
+	{
+		struct vdev_ioctl_vector vector_args;
+		struct vdev_ioctl_vector_op *ops;
+		size_t ops_size;
+		
+		if (copy_from_user(&vector_args, (void *)arg, sizeof(struct vdev_ioctl_vector))) {
+			ret = -EFAULT;
+			goto bail;
+		}
+		
+		if(vector_args.count > VIRT_DEV_IOC_VECTOR_MAX_OPS) {
+			ret = -EINVAL;
+			goto bail;
+		}
+		
+		if(vector_args.count == 0) {
+			ret = 0;
+			break;
+		}
+		
+		ops_size = vector_args.count * sizeof(struct vdev_ioctl_vector_op);
+		
+		ops = kmalloc(ops_size, GFP_KERNEL);
+		if(ops == NULL) {
+			ret = -ENOMEM;
+			goto bail;
+		}
+		
+		if (copy_from_user(ops, (void *)(unsigned long)vector_args.ops, ops_size)) {
+			ret = -EFAULT;
+		} else {
+			ret = modac_c_vdev_do_ioctl_vector(vdev->des, ops, 
+							vector_args.count, vector_args.flags);
+			
+			if(ret == 0 && copy_to_user((void *)(unsigned long)vector_args.ops, 
+							ops, ops_size)) {
+				ret = -EFAULT;
+			}
+		}
+		
+		kfree(ops);
+		
+		break;
+	}
+
 	case VIRT_DEV_IOC_STATUS_GET:
+	case VIRT_DEV_IOC_STATUS_GET_V1:
 	{
 		struct vdev_ioctl_status status;
 
 		status.major = vdev->des->major;
 		status.minor = vdev->des->minor;
 		strncpy(status.name, vdev->des->name, MODAC_DEVICE_MAX_NAME + 1);
+		status.queue_depth = vdev->des->queue_depth;
 		
 		ret = 0;
 		
-		if (copy_to_user((void *)arg, &status, sizeof(struct vdev_ioctl_status))) {
+		/* The old binaries get only the part they know of. */
+		if (copy_to_user((void *)arg, &status, _IOC_SIZE(cmd))) {
 			ret = -EFAULT;
 			goto bail;
 		}
@@ -365,170 +907,675 @@ static long vdev_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned lo
 		break;
 	}
 
-	} // switch
-
-bail:
-
-	modac_c_vdev_devref_unlock(vdev->des);
-	
-	return ret;
-}
-
-/* Return 0 or 1. */
-static inline int read_has_data(struct vdev_data *vdev)
-{
-	int ret = 0;
-	
-	spin_lock(&vdev->cb_reader_lock);
-	if(modac_cb_available(&vdev->cb_events)) {
-		ret = 1;
-	}
-	spin_unlock(&vdev->cb_reader_lock);
-	
-	if(ret)
-		return ret;
-	
-	
-	modac_c_vdev_spin_lock(vdev->des);
-	if(!event_list_is_empty(&vdev->notified_events)) {
-		ret = 1;
+	case VIRT_DEV_IOC_WAKEUP_POLICY_SET:
+	{
+		struct vdev_ioctl_wakeup_policy policy_arg;
+		
+		if (copy_from_user(&policy_arg, (void *)arg, sizeof(struct vdev_ioctl_wakeup_policy))) {
+			ret = -EFAULT;
+			goto bail;
+		}
+		
+		ret = vdev_set_wakeup_policy(vdev, &policy_arg);
+		
+		break;
 	}
-	modac_c_vdev_spin_unlock(vdev->des);	
-	
-	return ret;
-}
 
-/* 
- * Returns number of bytes read (put into 'buf').
- * 'buf' must be able to accomodate 
- * sizeof(u16) + CBUF_EVENT_ENTRY_DATA_LENGTH bytes.
- */
-static int read_get(struct vdev_data *vdev, u8 *buf)
-{
+	case VIRT_DEV_IOC_READ_FORMAT_SET:
+	{
+		struct vdev_ioctl_read_format read_format_arg;
+		struct vdev_queue *queue;
+		
+		if (copy_from_user(&read_format_arg, (void *)arg, sizeof(struct vdev_ioctl_read_format))) {
+			ret = -EFAULT;
+			goto bail;
+		}
+		
+		if(read_format_arg.format != VIRT_DEV_READ_FORMAT_PACKED &&
+				read_format_arg.format != VIRT_DEV_READ_FORMAT_RING_ENTRIES) {
+			ret = -EINVAL;
+			goto bail;
+		}
+		
+		queue = smp_load_acquire(&file->queue);
+		/* not in the middle of a read() */
+		rt_mutex_lock(&queue->cb_reader_mutex);
+		queue->read_format = read_format_arg.format;
+		rt_mutex_unlock(&queue->cb_reader_mutex);
+		read_format_arg.entry_size = queue->cb_events.entry_size;
+		
+		ret = 0;
+		
+		if (copy_to_user((void *)arg, &read_format_arg, sizeof(struct vdev_ioctl_read_format))) {
+			ret = -EFAULT;
+			goto bail;
+		}
+		
+		break;
+	}
+
+	case VIRT_DEV_IOC_PRIVATE_QUEUE:
+	{
+		struct vdev_ioctl_private_queue private_queue_arg;
+		
+		if (copy_from_user(&private_queue_arg, (void *)arg, sizeof(struct vdev_ioctl_private_queue))) {
+			ret = -EFAULT;
+			goto bail;
+		}
+		
+		ret = vdev_file_set_private_queue(file, &private_queue_arg);
+		
+		break;
+	}
+
+	} // switch
+
+bail:
+
+	modac_c_vdev_devref_unlock(vdev->des);
+	
+	return ret;
+}
+
+/* Return 0 or 1. */
+static inline int read_has_data(struct vdev_data *vdev, struct vdev_queue *queue)
+{
+	unsigned long flags;
 	int ret = 0;
-	int event;
 	
-	/*
-	 * First see if there's a notifying event available.
+	/* 
+	 * No reader lock needed, the result is only a hint and is rechecked 
+	 * when reading.
 	 */
-	modac_c_vdev_spin_lock(vdev->des);
+	if(vdev->des->event_log != NULL) {
+		if(atomic_read(&queue->log_pending) || atomic_read(&queue->log_overrun))
+			return 1;
+	} else if(modac_cb_available(&queue->cb_events)) {
+		return 1;
+	}
+	
+	vdev_put_lock(vdev, &flags);
+	if(!event_list_is_empty(&queue->notified_events)) {
+		ret = 1;
+	}
+	vdev_put_unlock(vdev, flags);
+	
+	return ret;
+}
+
+/* 
+ * Gets up to 'max' notifying events into 'events' without removing them
+ * (see read_ack_notified). Returns their number.
+ */
+static int read_get_notified(struct vdev_data *vdev, struct vdev_queue *queue,
+		int *events, int max)
+{
+	struct event_list_type notified;
+	unsigned long flags;
+	int n = 0;
+	
+	vdev_put_lock(vdev, &flags);
+	memcpy(&notified, &queue->notified_events, sizeof(notified));
+	vdev_put_unlock(vdev, flags);
 
-	event = event_list_extract_one(&vdev->notified_events);
-	if(event >= 0) {
-		event_list_remove(&vdev->notified_events, event);
+	while(n < max) {
+		int event = event_list_extract_one(&notified);
+		if(event < 0)
+			break;
+		
+		event_list_remove(&notified, event);
+		events[n ++] = event;
 	}
+	
+	return n;
+}
+
+/* 
+ * Removes the notifying events got by read_get_notified once they were
+ * copied to the user.
+ */
+static void read_ack_notified(struct vdev_data *vdev, struct vdev_queue *queue,
+		int *events, int n)
+{
+	unsigned long flags;
+	int i;
+	
+	if(n == 0)
+		return;
+	
+	vdev_put_lock(vdev, &flags);
+	for(i = 0; i < n; i ++)
+		event_list_remove(&queue->notified_events, events[i]);
+	vdev_put_unlock(vdev, flags);
+}
 
-	modac_c_vdev_spin_unlock(vdev->des);
+/* 
+ * Adds the latencies of the first 'n' entries of the 'spans' that were just 
+ * copied to the user. Only the stamped entries count.
+ */
+static void read_lat_account(struct vdev_data *vdev, struct vdev_queue *queue,
+		struct modac_cb_span spans[2], int n)
+{
+	u32 now = 0;
+	int i, j;
 	
-	if(event >= 0) {
-		u16 event16 = (u16)event;
-		memcpy(buf, &event16, sizeof(u16));
-		return sizeof(u16);
+	if(!READ_ONCE(vdev->des->lat_enabled))
+		return;
+	
+	for(j = 0; j < 2 && n > 0; j ++) {
+		for(i = 0; i < spans[j].count && n > 0; i ++, n --) {
+			
+			u32 stamp = modac_cb_span_stamp(&queue->cb_events, &spans[j], i);
+			
+			if(stamp == 0)
+				continue;
+			if(now == 0)
+				now = lat_stamp();
+			lat_hist_add(&vdev->des->lat_copy, stamp, now);
+		}
+	}
+}
+
+/* 
+ * Reads in the VIRT_DEV_READ_FORMAT_PACKED format. The events are packed on 
+ * the stack and copied to the user READ_CHUNK_EVENTS at a time.
+ * Returns the number of bytes read or a negative error. If copying fails 
+ * after some chunks were copied, only those are consumed and returned.
+ */
+static ssize_t read_packed(struct vdev_data *vdev, struct vdev_queue *queue,
+		char __user *buff, size_t buf_len)
+{
+	u8 chunk[READ_CHUNK_EVENTS * (sizeof(u16) + CBUF_EVENT_ENTRY_DATA_LENGTH_EXT)];
+	int events[READ_CHUNK_EVENTS];
+	struct modac_cb_span spans[2];
+	size_t count_read = 0;
+	size_t chunk_len = 0;
+	/* the entries in the chunk and the ones already copied to the user */
+	int pending = 0;
+	int consumed = 0;
+	int fault = 0;
+	int i, j, n;
+	
+	/* First the notifying events. They are only 16-bit each. */
+	n = read_get_notified(vdev, queue, events, 
+				min_t(int, READ_CHUNK_EVENTS, buf_len / sizeof(u16)));
+	for(i = 0; i < n; i ++) {
+		u16 event16 = (u16)events[i];
+		memcpy(chunk + chunk_len, &event16, sizeof(u16));
+		chunk_len += sizeof(u16);
 	}
 	
-	/* If no notifying event extract the normal event if any. */
-	spin_lock(&vdev->cb_reader_lock);
-	ret = modac_cb_get(&vdev->cb_events, buf);
-	spin_unlock(&vdev->cb_reader_lock);
+	/* 
+	 * The reserved entries can't be overwritten by the producer until
+	 * they are consumed.
+	 */
+	modac_cb_peek(&queue->cb_events, INT_MAX, spans);
 	
-	return ret;
+	for(j = 0; j < 2; j ++) {
+		for(i = 0; i < spans[j].count; i ++) {
+			
+			struct modac_circ_buf_entry *entry = 
+					modac_cb_span_entry(&queue->cb_events, &spans[j], i);
+			/* The entry is in the user space writable pages, too. */
+			size_t n_entry = sizeof(u16) + 
+					min_t(int, entry->length, queue->cb_events.data_length);
+			
+			if(count_read + chunk_len + n_entry > buf_len)
+				goto done;
+			
+			if(chunk_len + n_entry > sizeof(chunk)) {
+				if(copy_to_user(buff + count_read, chunk, chunk_len)) {
+					fault = 1;
+					goto done;
+				}
+				count_read += chunk_len;
+				chunk_len = 0;
+				consumed += pending;
+				pending = 0;
+			}
+			
+			memcpy(chunk + chunk_len, &entry->event, sizeof(u16));
+			memcpy(chunk + chunk_len + sizeof(u16), entry->data, 
+				   n_entry - sizeof(u16));
+
+			chunk_len += n_entry;
+			pending ++;
+		}
+	}
+	
+done:
+
+	if(!fault && chunk_len > 0) {
+		if(copy_to_user(buff + count_read, chunk, chunk_len)) {
+			fault = 1;
+		} else {
+			count_read += chunk_len;
+			consumed += pending;
+		}
+	}
+	
+	/* The notifying events were in the first chunk. */
+	if(count_read > 0)
+		read_ack_notified(vdev, queue, events, n);
+	else
+		n = 0;
+	
+	/* Consume only what was successfully copied. */
+	read_lat_account(vdev, queue, spans, consumed);
+	modac_cb_consume(&queue->cb_events, consumed);
+	queue->stats_events_read += n + consumed;
+	
+	if(fault && count_read == 0)
+		return -EFAULT;
+	
+	return count_read;
 }
 
+/* 
+ * Reads in the VIRT_DEV_READ_FORMAT_RING_ENTRIES format. The queued entries 
+ * are copied with (at most) two copy_to_user calls, one for each side of the
+ * ring wrap.
+ * Returns the number of bytes read or a negative error. If copying fails 
+ * after something was copied, only that is consumed and returned.
+ */
+static ssize_t read_entries(struct vdev_data *vdev, struct vdev_queue *queue,
+		char __user *buff, size_t buf_len)
+{
+	int entry_size = queue->cb_events.entry_size;
+	u8 notified[READ_CHUNK_EVENTS * CBUF_ENTRY_SIZE(CBUF_EVENT_ENTRY_DATA_LENGTH_EXT)];
+	int events[READ_CHUNK_EVENTS];
+	struct modac_cb_span spans[2];
+	int max = buf_len / entry_size;
+	size_t count_read = 0;
+	int i, n;
+	
+	n = read_get_notified(vdev, queue, events, min_t(int, READ_CHUNK_EVENTS, max));
+	if(n > 0) {
+		
+		memset(notified, 0, n * entry_size);
+		for(i = 0; i < n; i ++) {
+			((struct modac_circ_buf_entry *)(notified + i * entry_size))->event = 
+					(u16)events[i];
+		}
+		
+		if(copy_to_user(buff, notified, n * entry_size))
+			return -EFAULT;
+		count_read = n * entry_size;
+		read_ack_notified(vdev, queue, events, n);
+		
+		max -= n;
+	}
+	
+	modac_cb_peek(&queue->cb_events, max, spans);
+	
+	/* Only the spans copied successfully are consumed. */
+	n = 0;
+	for(i = 0; i < 2; i ++) {
+		
+		size_t span_len = spans[i].count * entry_size;
+		
+		if(span_len == 0)
+			continue;
+		
+		if(copy_to_user(buff + count_read, spans[i].entries, span_len))
+			break;
+		count_read += span_len;
+		n += spans[i].count;
+	}
+	
+	if(count_read == 0 && n < spans[0].count + spans[1].count)
+		return -EFAULT;
+	
+	read_lat_account(vdev, queue, spans, n);
+	modac_cb_consume(&queue->cb_events, n);
+	queue->stats_events_read += count_read / entry_size;
+	
+	return count_read;
+}
 
-static ssize_t vdev_read(struct file *filp, char __user *buff, size_t buf_len, loff_t *offp)
+/* Return the size of an event with 'length' bytes of data in the read format. */
+static inline size_t read_event_size(struct vdev_queue *queue, int format, 
+		int length)
 {
-	struct vdev_data *vdev = (struct vdev_data *)filp->private_data;
-	int count_read = 0;
-	int buf_still_free = buf_len;
-	int ret = 0;
+	if(format == VIRT_DEV_READ_FORMAT_RING_ENTRIES)
+		return queue->cb_events.entry_size;
+	
+	return sizeof(u16) + length;
+}
 
-	/*
-	 * The devref lock can not be used here. It uses a mutex which could make
-	 * this high priority thread block by lower priority threads. A different
-	 * lock is implemented instead to prevent running the code after the
-	 * VDEV destruction.
-	 */
-	if(!lock_direct_call(vdev->des)) {
-		return -ENODEV;
+/* Writes the event to 'dst' in the read format, read_event_size bytes. */
+static void read_event_format(struct vdev_queue *queue, int format, u8 *dst,
+		u16 event, const u8 *data, int length)
+{
+	if(format == VIRT_DEV_READ_FORMAT_RING_ENTRIES) {
+		
+		struct modac_circ_buf_entry *entry = (struct modac_circ_buf_entry *)dst;
+		
+		memset(dst, 0, queue->cb_events.entry_size);
+		entry->event = event;
+		entry->length = length;
+		memcpy(entry->data, data, length);
+	} else {
+		memcpy(dst, &event, sizeof(u16));
+		memcpy(dst + sizeof(u16), data, length);
+	}
+}
+
+/* 
+ * Reads from the MNG_DEV's event log, in either read format. The reading
+ * starts at the first event logged for the queue (the cursor jumps to the
+ * head if there is none) and the entries the queue is not interested in are
+ * skipped. If an event for the queue was overwritten, a 
+ * MODAC_EVENT_READ_OVERFLOW is returned and the reading continues at half 
+ * the log behind the head, to leave a margin for the writer.
+ * Returns the number of bytes read or a negative error. If copying fails 
+ * after some chunks were copied, the cursor is left after those and only 
+ * they are returned.
+ */
+static ssize_t read_log(struct vdev_data *vdev, struct vdev_queue *queue,
+		int format, char __user *buff, size_t buf_len)
+{
+	struct modac_event_log *log = vdev->des->event_log;
+	u8 chunk[READ_CHUNK_EVENTS * CBUF_ENTRY_SIZE(CBUF_EVENT_ENTRY_DATA_LENGTH_EXT)];
+	u32 entry_buf[CBUF_ENTRY_SIZE(CBUF_EVENT_ENTRY_DATA_LENGTH_EXT) / sizeof(u32)];
+	struct modac_circ_buf_entry *entry = (struct modac_circ_buf_entry *)entry_buf;
+	int data_length = queue->cb_events.data_length;
+	struct event_list_type events;
+	struct vdev_file *file = NULL;
+	int notified[READ_CHUNK_EVENTS];
+	size_t count_read = 0;
+	size_t chunk_len = 0;
+	unsigned long flags, log_flags;
+	int overrun, done = 0;
+	u32 pending, logged = 0;
+	u32 seq, first, head, stamp = 0, now = 0;
+	/* where the reading was when the chunk was started */
+	u32 chunk_seq, chunk_logged = 0;
+	int chunk_read = 0, chunk_overruns = 0;
+	int fault = 0;
+	/* the stamps are not even fetched while the measurement is off */
+	u32 *stamp_p = READ_ONCE(vdev->des->lat_enabled) ? &stamp : NULL;
+	int i, n, read = 0;
+	
+	if(queue != &vdev->queue) {
+		file = container_of(queue, struct vdev_file, own_queue);
+		if(!file->filtered)
+			file = NULL;
+	}
+	
+	vdev_put_lock(vdev, &flags);
+	memcpy(&events, &vdev->log_events, sizeof(events));
+	vdev_put_unlock(vdev, flags);
+	
+	/* First the notifying events. */
+	n = read_get_notified(vdev, queue, notified, 
+			min_t(int, READ_CHUNK_EVENTS, buf_len / read_event_size(queue, format, 0)));
+	for(i = 0; i < n; i ++) {
+		read_event_format(queue, format, chunk + chunk_len, (u16)notified[i], NULL, 0);
+		chunk_len += read_event_size(queue, format, 0);
 	}
 	
-	/* There must be a space for at least for one full event so it can be
-	 * returned if it exists.
+	/* 
+	 * Takes over the events logged for the queue so far. The MNG_DEV marks
+	 * the queue under the event_log_lock, so every event for the queue up
+	 * to this 'head' is counted in the 'pending'.
 	 */
-	if(buf_still_free < sizeof(u16) + CBUF_EVENT_ENTRY_DATA_LENGTH) {
-		ret = -EINVAL;
-		goto bail;
+	spin_lock_irqsave(vdev->des->event_log_lock, log_flags);
+	vdev_put_lock(vdev, &flags);
+	pending = atomic_xchg(&queue->log_pending, 0);
+	first = queue->log_first;
+	head = modac_log_head(log);
+	vdev_put_unlock(vdev, flags);
+	spin_unlock_irqrestore(vdev->des->event_log_lock, log_flags);
+	
+	overrun = atomic_xchg(&queue->log_overrun, 0);
+	seq = queue->log_cursor;
+	
+	if(pending == 0) {
+		/* Nothing for the queue, the other events need not be walked. */
+		seq = head;
+	} else if((s32)(first - seq) > 0) {
+		/* The events for the queue before the 'first' were read already. */
+		seq = first;
 	}
+	chunk_seq = seq;
 	
-	while(buf_still_free >= sizeof(u16) + CBUF_EVENT_ENTRY_DATA_LENGTH) {
+	for(;;) {
 		
-		u8 evbuf[sizeof(u16) + CBUF_EVENT_ENTRY_DATA_LENGTH];
+		size_t n_entry;
+		
+		/* Room for the largest entry, before anything is taken from the log. */
+		if(chunk_len + read_event_size(queue, format, data_length) > sizeof(chunk)) {
+			if(copy_to_user(buff + count_read, chunk, chunk_len)) {
+				fault = 1;
+				break;
+			}
+			count_read += chunk_len;
+			chunk_len = 0;
+			chunk_seq = seq;
+			chunk_logged = logged;
+			chunk_read = read;
+			chunk_overruns = 0;
+		}
 		
-		int n = read_get(vdev, evbuf);
+		if(!overrun && head - seq > log->count)
+			overrun = 1;
 		
-		if(n == 0) {
+		if(overrun) {
 			
-			/* If at least some data was already read return with it. */
-			if(count_read > 0) {
-				ret = count_read;
-				goto bail;
+			n_entry = read_event_size(queue, format, 0);
+			if(count_read + chunk_len + n_entry > buf_len) {
+				/* report it next time */
+				atomic_set(&queue->log_overrun, 1);
+				done = 1;
+				break;
 			}
 			
-			if (filp->f_flags & O_NONBLOCK) {
-				ret = -EAGAIN;
-				goto bail;
-			}
+			entry->event = MODAC_EVENT_READ_OVERFLOW;
+			entry->length = 0;
+			stamp = 0;
+			/* never back to the events that were read already */
+			if((s32)(head - log->count / 2 - seq) > 0)
+				seq = head - log->count / 2;
+			overrun = 0;
+			queue->stats_log_overruns ++;
+			chunk_overruns ++;
 			
-			/*
-			 * The process will sleep so the devref mechanism must be unlocked.
-			 */
-			unlock_direct_call(vdev->des);
+		} else if(seq == head) {
+			break;
+		} else if(modac_log_get(log, seq, entry, data_length, stamp_p) < 0) {
+			/* overwritten meanwhile */
+			overrun = 1;
+			head = modac_log_head(log);
+			continue;
+		} else {
 			
-			/*
-			 * The system is unlocked now and a close can happen while the read
-			 * is waiting to be woken up. If the close happens
-			 * and if it is about to destroy the MNG_DEV and all the VIRT_DEVs
-			 * there will be no problem. The vdev->wait_queue_events is not
-			 * referred at that point anymore. Namely, the close first
-			 * cancels the waiting thus releasing the vdev->wait_queue_events
-			 * which is then free to disappear.
-			 */
+			seq ++;
+			
+			if(!event_list_test(&events, entry->event))
+				continue;
+			if(file != NULL && !event_list_test(&file->filter, entry->event))
+				continue;
 			
-			if(wait_event_interruptible(vdev->wait_queue_events, 
-								read_has_data(vdev)
-										)) {
-				return -ERESTARTSYS;
+			n_entry = read_event_size(queue, format, entry->length);
+			if(count_read + chunk_len + n_entry > buf_len) {
+				seq --;
+				done = 1;
+				break;
 			}
+			logged ++;
+		}
+		
+		read_event_format(queue, format, chunk + chunk_len, entry->event, 
+				entry->data, entry->length);
+		chunk_len += n_entry;
+		read ++;
+		
+		if(stamp != 0) {
+			if(now == 0)
+				now = lat_stamp();
+			lat_hist_add(&vdev->des->lat_copy, stamp, now);
+		}
+	}
+	
+	if(!fault && chunk_len > 0) {
+		if(copy_to_user(buff + count_read, chunk, chunk_len))
+			fault = 1;
+		else
+			count_read += chunk_len;
+	}
+	
+	/* 
+	 * Back to the start of the chunk that was not copied. Its events for 
+	 * the queue are left pending and its overflow is reported again.
+	 */
+	if(fault) {
+		if(logged != chunk_logged)
+			done = 1;
+		seq = chunk_seq;
+		logged = chunk_logged;
+		read = chunk_read;
+		if(chunk_overruns > 0) {
+			atomic_set(&queue->log_overrun, 1);
+			queue->stats_log_overruns -= chunk_overruns;
+		}
+	}
+	
+	/* The notifying events were in the first chunk. */
+	if(count_read > 0)
+		read_ack_notified(vdev, queue, notified, n);
+	else
+		n = 0;
+	
+	queue->log_cursor = seq;
+	
+	/* 
+	 * The buffer is full or not all was copied, the rest is left pending 
+	 * from the 'seq' on (the events marked meanwhile are all after it).
+	 */
+	if(done) {
+		vdev_put_lock(vdev, &flags);
+		atomic_add(pending > logged ? pending - logged : 1, &queue->log_pending);
+		queue->log_first = seq;
+		vdev_put_unlock(vdev, flags);
+	}
+	
+	queue->stats_events_read += n + read;
+	
+	if(fault && count_read == 0)
+		return -EFAULT;
+	
+	return count_read;
+}
 
-			/* lock again */
-			if(!lock_direct_call(vdev->des)) {
-				return -ENODEV;
-			}
-		} else {
-			
-#ifdef DBG_MEASURE_TIME_FROM_IRQ_TO_USER
-	{
-		u32 t = mng_dbg_get_time(vdev->des);
-		// dbg_timestamp[2]  is at 2 + 2*4 + 2*4
-		memcpy(evbuf + 18, &t, 4);
+static ssize_t vdev_read(struct file *filp, char __user *buff, size_t buf_len, loff_t *offp)
+{
+	struct vdev_file *file = (struct vdev_file *)filp->private_data;
+	struct vdev_data *vdev = file->vdev;
+	struct vdev_queue *queue = smp_load_acquire(&file->queue);
+	size_t min_len;
+	ssize_t ret = 0;
+	int format;
+
+	/*
+	 * The devref lock can not be used here. It uses a mutex which could make
+	 * this high priority thread block by lower priority threads. A different
+	 * lock is implemented instead to prevent running the code after the
+	 * VDEV destruction.
+	 */
+	if(!lock_direct_call(vdev->des)) {
+		return -ENODEV;
 	}
-#endif
+	
+	/* Bounds the time the cb_reader_mutex is held. */
+	if(buf_len > VIRT_DEV_READ_MAX_LEN)
+		buf_len = VIRT_DEV_READ_MAX_LEN;
+	
+	for(;;) {
+		
+		/* 
+		 * Only the readers of this queue can hold this mutex and only
+		 * for the time of copying the data (see cb_reader_mutex).
+		 */
+		rt_mutex_lock(&queue->cb_reader_mutex);
+		
+		/* The format can't change until the mutex is released. */
+		format = queue->read_format;
+		
+		if(format == VIRT_DEV_READ_FORMAT_RING_ENTRIES) {
+			min_len = queue->cb_events.entry_size;
+		} else {
+			min_len = sizeof(u16) + queue->cb_events.data_length;
+		}
+		
+		/* There must be a space for at least for one full event so it can be
+		 * returned if it exists.
+		 */
+		if(buf_len < min_len) {
+			rt_mutex_unlock(&queue->cb_reader_mutex);
+			ret = -EINVAL;
+			goto bail;
+		}
+		
+		if(vdev->des->event_log != NULL) {
+			ret = read_log(vdev, queue, format, buff, buf_len);
+		} else if(format == VIRT_DEV_READ_FORMAT_RING_ENTRIES) {
+			ret = read_entries(vdev, queue, buff, buf_len);
+		} else {
+			ret = read_packed(vdev, queue, buff, buf_len);
+		}
+		
+		rt_mutex_unlock(&queue->cb_reader_mutex);
+		
+		if(ret < 0) {
+			printk(KERN_ERR 
+				"'copy_to_user' failed while reading the EVRMA data.\n");
+			goto bail;
+		}
+		
+		if(ret > 0) {
+			queue->stats_reads ++;
+			/* 
+			 * Only one of the blocked readers is woken up per wakeup. Pass
+			 * on what this one left.
+			 */
+			if(read_has_data(vdev, queue))
+				wake_up_interruptible(&queue->wait_queue_events);
+			goto bail;
+		}
+		
+		if (filp->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto bail;
+		}
+		
+		/*
+		 * The process will sleep so the devref mechanism must be unlocked.
+		 */
+		unlock_direct_call(vdev->des);
+		
+		/*
+		 * The system is unlocked now and a close can happen while the read
+		 * is waiting to be woken up. If the close happens
+		 * and if it is about to destroy the MNG_DEV and all the VIRT_DEVs
+		 * there will be no problem. The queue->wait_queue_events is not
+		 * referred at that point anymore. Namely, the close first
+		 * cancels the waiting thus releasing the queue->wait_queue_events
+		 * which is then free to disappear.
+		 */
+		
+		if(wait_event_interruptible_exclusive(queue->wait_queue_events, 
+							read_has_data(vdev, queue)
+									)) {
+			return -ERESTARTSYS;
+		}
 
-			if(copy_to_user(buff + count_read, evbuf, n)) {
-				printk(KERN_ERR 
-					"'copy_to_user' failed while reading the EVRMA data. "
-					"Some event data was lost.");
-				ret = -EFAULT;
-				goto bail;
-			}
-			
-			buf_still_free -= n;
-			count_read += n;
+		/* lock again */
+		if(!lock_direct_call(vdev->des)) {
+			return -ENODEV;
 		}
 	}
 	
-	ret = count_read;
-	
 bail:
 
 	unlock_direct_call(vdev->des);
@@ -538,7 +1585,9 @@ bail:
 
 static unsigned int vdev_poll(struct file *filp, poll_table *wait) 
 {
-	struct vdev_data *vdev = (struct vdev_data *)filp->private_data;
+	struct vdev_file *file = (struct vdev_file *)filp->private_data;
+	struct vdev_data *vdev = file->vdev;
+	struct vdev_queue *queue = smp_load_acquire(&file->queue);
 
 	int ret = 0;
 	
@@ -549,8 +1598,8 @@ static unsigned int vdev_poll(struct file *filp, poll_table *wait)
 		return -ENODEV;
 	}
 
-	poll_wait(filp, &vdev->wait_queue_events, wait);
-	if(read_has_data(vdev)) {
+	poll_wait(filp, &queue->wait_queue_events, wait);
+	if(read_has_data(vdev, queue)) {
 		ret = POLLIN | POLLRDNORM;
 	}
 	
@@ -589,9 +1638,10 @@ static struct vm_operations_struct vdev_vm_ops = {
 	.fault = vdev_vma_fault,
 };
 
-static int vdev_mmap_ro(struct file *filp, struct vm_area_struct *vma)
+static int vdev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	struct vdev_data *vdev = (struct vdev_data *)filp->private_data;
+	struct vdev_file *file = (struct vdev_file *)filp->private_data;
+	struct vdev_data *vdev = file->vdev;
 	
 	unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
 	unsigned long vsize = vma->vm_end - vma->vm_start;
@@ -603,6 +1653,29 @@ static int vdev_mmap_ro(struct file *filp, struct vm_area_struct *vma)
 		return ret;
 	}
 	
+	if(offset == VIRT_DEV_MMAP_OFFSET_EVENT_RING) {
+		/* 
+		 * The event ring is in the vmalloc-ed pages and can be writable
+		 * (the consumer writes the tail).
+		 */
+		if(vdev->des->event_log != NULL)
+			ret = -EINVAL;
+		else
+			ret = modac_cb_mmap(&smp_load_acquire(&file->queue)->cb_events, vma);
+		goto bail;
+	}
+	
+	if(offset == VIRT_DEV_MMAP_OFFSET_EVENT_LOG) {
+		/* The log is shared with all the other readers, read-only. */
+		if(vdev->des->event_log == NULL)
+			ret = -EINVAL;
+		else
+			ret = modac_log_mmap(vdev->des->event_log, vma);
+		goto bail;
+	}
+	
+	/* All the other offsets belong to the HW support. */
+	
 	/* It does not seem that the PAGE_READONLY has any effect when calling 
 	 * remap_pfn_range. So, prevent from continuing here.
 	 */
@@ -641,42 +1714,214 @@ static const struct file_operations vdev_fops = {
 	.read = vdev_read,
 	.poll = vdev_poll,
 	.unlocked_ioctl = vdev_unlocked_ioctl,
-	.mmap = vdev_mmap_ro,
+	.mmap = vdev_mmap,
 };
 
 
-/* Called from an IRQ in a spin-lock protected context. */
+/* 
+ * Called from an IRQ (or the dispatch thread) in the RCU read-side section.
+ * The notifications are rare and always wake up the readers immediately.
+ */
 void modac_vdev_notify(struct modac_vdev_des *vdev_des, int event)
 {
 	struct vdev_data *vdev = (struct vdev_data *)vdev_des->priv;
+	struct vdev_file *file;
+	unsigned long flags;
+	
+	vdev_put_lock(vdev, &flags);
+	event_list_add(&vdev->queue.notified_events, event);
+	vdev_put_unlock(vdev, flags);
 	
-	event_list_add(&vdev->notified_events, event);
+	queue_wake(&vdev->queue);
 	
-	wake_up_interruptible(&vdev->wait_queue_events);
+	list_for_each_entry_rcu(file, &vdev->files, item) {
+		
+		if(file->filtered && !event_list_test(&file->filter, event))
+			continue;
+		
+		vdev_put_lock(vdev, &flags);
+		event_list_add(&file->own_queue.notified_events, event);
+		vdev_put_unlock(vdev, flags);
+		
+		queue_wake(&file->own_queue);
+	}
 }
 
-/* Called from an IRQ in a spin-locked context. */
-void modac_vdev_put_cb(struct modac_vdev_des *vdev_des, int event, void *data, int length)
+/* 
+ * With the put_lock held. Returns -1 if nothing was put, 1 if the readers
+ * are to be woken up now, 0 if it is left to modac_vdev_flush_wakeup.
+ */
+static int queue_put(struct vdev_data *vdev, struct vdev_queue *queue, 
+		int event, void *data, int length, u32 stamp)
 {
-	struct vdev_data *vdev = (struct vdev_data *)vdev_des->priv;
+	int first = !atomic_read(&queue->wake_pending);
 	
-#ifdef DBG_MEASURE_TIME_FROM_IRQ_TO_USER
-	{
-		struct evr_data_fifo_event *et_data = data;
-		et_data->dbg_timestamp[1] = mng_dbg_get_time(vdev_des);
-	}
-#endif
-			
-	if(modac_cb_put(&vdev->cb_events, 
-			event, data, length, &vdev->wait_queue_events) < 0) {
-		
+	if(vdev->des->event_log != NULL) {
+		/* 
+		 * Already in the log as its last entry (the event_log_lock is 
+		 * held), the reader only has to look.
+		 */
+		if(atomic_inc_return(&queue->log_pending) == 1)
+			queue->log_first = modac_log_head(vdev->des->event_log) - 1;
+	} else if(modac_cb_put(&queue->cb_events, event, data, length, stamp, NULL) < 0) {
 		/* 
 		 * No event (not even the overflow event) was saved. Not waking up.
 		 */
+		return -1;
+	}
+	
+	if(stamp != 0) {
+		lat_hist_add(&vdev->des->lat_enqueue, stamp, lat_stamp());
+		if(first)
+			queue->wake_stamp = stamp;
+	}
+	
+	if(event_list_test(&vdev->wake_urgent_events, event)) {
+		atomic_set(&queue->wake_pending, 0);
+		queue_lat_wakeup(vdev, queue);
+		return 1;
+	}
+	
+	atomic_set(&queue->wake_pending, 1);
+	return 0;
+}
 
-	} else {
-		/* nothing to do here, wake up was already called */
-	} 
+/* 
+ * Called from an IRQ (or the dispatch thread) in the RCU read-side section.
+ * Only the urgent events wake up the readers here, the rest is left to
+ * modac_vdev_flush_wakeup. The event goes to the shared queue (unless all
+ * the open files have their own) and to each private queue that wants it.
+ * If the VIRT_DEV reads from the event log, the MNG_DEV has already written
+ * the event there and the queues are only marked.
+ */
+void modac_vdev_put_cb(struct modac_vdev_des *vdev_des, int event, void *data, int length,
+		u32 stamp)
+{
+	struct vdev_data *vdev = (struct vdev_data *)vdev_des->priv;
+	struct vdev_file *file;
+	unsigned long flags;
+	int put;
+	
+	if(READ_ONCE(vdev->put_shared)) {
+		
+		vdev_put_lock(vdev, &flags);
+		put = queue_put(vdev, &vdev->queue, event, data, length, stamp);
+		vdev_put_unlock(vdev, flags);
+		
+		if(put > 0)
+			queue_wake(&vdev->queue);
+	}
+	
+	list_for_each_entry_rcu(file, &vdev->files, item) {
+		
+		if(file->filtered && !event_list_test(&file->filter, event))
+			continue;
+		
+		vdev_put_lock(vdev, &flags);
+		put = queue_put(vdev, &file->own_queue, event, data, length, stamp);
+		vdev_put_unlock(vdev, flags);
+		
+		if(put > 0)
+			queue_wake(&file->own_queue);
+	}
+}
+
+/* 
+ * The producer side of the event log. Keeps the max. lag of the queue 
+ * (see queue_log_lag) and marks the queue overrun if an event logged for
+ * it was overwritten before being read; the reader is woken up then to 
+ * learn about it. The events the queue is not interested in don't count.
+ * The reader detects the overwritten entries by itself, too, this only
+ * makes it known before the reader gets to them.
+ */
+static void queue_log_track(struct vdev_data *vdev, struct vdev_queue *queue)
+{
+	struct modac_event_log *log = vdev->des->event_log;
+	unsigned long flags;
+	int wake = 0;
+	u32 lag;
+	
+	if(!atomic_read(&queue->log_pending))
+		return;
+	
+	vdev_put_lock(vdev, &flags);
+	
+	lag = queue_log_lag(vdev, queue);
+	if(lag > queue->stats_log_lag_max)
+		queue->stats_log_lag_max = lag;
+	
+	if(lag > log->count && !atomic_read(&queue->log_overrun)) {
+		atomic_set(&queue->log_overrun, 1);
+		wake = 1;
+	}
+	
+	vdev_put_unlock(vdev, flags);
+	
+	if(wake)
+		queue_wake(queue);
+}
+
+/* 
+ * Called after a batch of modac_vdev_put_cb calls (any context). Wakes up the
+ * readers of all the queues according to the wakeup policy.
+ */
+void modac_vdev_flush_wakeup(struct modac_vdev_des *vdev_des)
+{
+	struct vdev_data *vdev = (struct vdev_data *)vdev_des->priv;
+	struct vdev_file *file;
+	unsigned long flags;
+	int wake;
+	
+	if(vdev_des->event_log != NULL) {
+		
+		if(READ_ONCE(vdev->put_shared))
+			queue_log_track(vdev, &vdev->queue);
+		
+		rcu_read_lock();
+		list_for_each_entry_rcu(file, &vdev->files, item)
+			queue_log_track(vdev, &file->own_queue);
+		rcu_read_unlock();
+	}
+	
+	/* nothing put since the last wakeup (rechecked below) */
+	if(atomic_read(&vdev->queue.wake_pending)) {
+		
+		vdev_put_lock(vdev, &flags);
+		wake = queue_wakeup_due(vdev, &vdev->queue);
+		vdev_put_unlock(vdev, flags);
+		
+		if(wake)
+			queue_wake(&vdev->queue);
+	}
+	
+	rcu_read_lock();
+	
+	list_for_each_entry_rcu(file, &vdev->files, item) {
+		
+		if(!atomic_read(&file->own_queue.wake_pending))
+			continue;
+		
+		vdev_put_lock(vdev, &flags);
+		wake = queue_wakeup_due(vdev, &file->own_queue);
+		vdev_put_unlock(vdev, flags);
+		
+		if(wake)
+			queue_wake(&file->own_queue);
+	}
+	
+	rcu_read_unlock();
+}
+
+/* Called by the MNG_DEV after each change of the subscriptions. */
+void modac_vdev_set_log_events(struct modac_vdev_des *vdev_des, 
+		const struct event_list_type *events)
+{
+	struct vdev_data *vdev = (struct vdev_data *)vdev_des->priv;
+	unsigned long flags;
+	
+	vdev_put_lock(vdev, &flags);
+	memcpy(&vdev->log_events, events, sizeof(vdev->log_events));
+	vdev_put_unlock(vdev, flags);
 }
 
 static ssize_t show_config(struct device *dev, struct device_attribute *attr,
@@ -728,8 +1973,105 @@ static ssize_t store_config(struct device *dev, struct device_attribute *attr,
 	return count;
 }
 
+/* 
+ * The shared queue first (with a log_... line if the VIRT_DEV reads from 
+ * the event log), then one line per private queue:
+ * private[<I>]: enqueued=... (the same fields on one line).
+ */
+static ssize_t show_stats(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct vdev_data *vdev = dev_get_drvdata(dev);
+	struct vdev_queue *queue = &vdev->queue;
+	struct modac_cb_stats *cb_stats = &queue->cb_events.stats;
+	struct vdev_file *file;
+	ssize_t n = 0;
+	int i = 0;
+	
+	ssize_t ret = modac_c_vdev_devref_lock(vdev->des);
+	if(ret) {
+		return ret;
+	}
+	
+	n += scnprintf(buf + n, PAGE_SIZE - n, 
+			"enqueued=%u dropped=%u overflows=%u high_water=%u depth=%u\n",
+			cb_stats->put, cb_stats->dropped, cb_stats->overflows,
+			cb_stats->high_water, vdev->des->queue_depth);
+	n += scnprintf(buf + n, PAGE_SIZE - n, 
+			"wakeups=%u reads=%u events_read=%llu events_per_read=%llu\n",
+			queue->stats_wakeups, queue->stats_reads, queue->stats_events_read,
+			queue->stats_reads ? div_u64(queue->stats_events_read, queue->stats_reads) : 0);
+	if(vdev->des->event_log != NULL) {
+		n += scnprintf(buf + n, PAGE_SIZE - n, 
+				"log_depth=%lu log_lag=%u log_lag_max=%u log_overruns=%u\n",
+				vdev->des->event_log->count, queue_log_lag(vdev, queue),
+				queue->stats_log_lag_max, queue->stats_log_overruns);
+	}
+	
+	mutex_lock(&vdev->files_mutex);
+	
+	n += scnprintf(buf + n, PAGE_SIZE - n, "open=%d private=%d\n", 
+			vdev->open_count, vdev->private_count);
+	
+	list_for_each_entry(file, &vdev->files, item) {
+		
+		queue = &file->own_queue;
+		cb_stats = &queue->cb_events.stats;
+		
+		n += scnprintf(buf + n, PAGE_SIZE - n, 
+			"private[%d]: enqueued=%u dropped=%u overflows=%u high_water=%u "
+			"depth=%lu filtered=%d wakeups=%u reads=%u events_read=%llu",
+			i ++, cb_stats->put, cb_stats->dropped, cb_stats->overflows,
+			cb_stats->high_water, queue->cb_events.count, file->filtered,
+			queue->stats_wakeups, queue->stats_reads, queue->stats_events_read);
+		if(vdev->des->event_log != NULL) {
+			n += scnprintf(buf + n, PAGE_SIZE - n, 
+				" log_lag=%u log_lag_max=%u log_overruns=%u",
+				queue_log_lag(vdev, queue), queue->stats_log_lag_max, 
+				queue->stats_log_overruns);
+		}
+		n += scnprintf(buf + n, PAGE_SIZE - n, "\n");
+	}
+	
+	mutex_unlock(&vdev->files_mutex);
+	
+	modac_c_vdev_devref_unlock(vdev->des);
+	return n;
+}
+
+/* Writing "reset" clears the statistics (of all the queues). */
+static ssize_t store_stats(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count)
+{
+	struct vdev_data *vdev = dev_get_drvdata(dev);
+	struct vdev_file *file;
+	ssize_t ret;
+	
+	if(!sysfs_streq(buf, "reset"))
+		return -EINVAL;
+	
+	ret = modac_c_vdev_devref_lock(vdev->des);
+	if(ret)
+		return ret;
+	
+	queue_reset_stats(vdev, &vdev->queue);
+	
+	mutex_lock(&vdev->files_mutex);
+	list_for_each_entry(file, &vdev->files, item)
+		queue_reset_stats(vdev, &file->own_queue);
+	mutex_unlock(&vdev->files_mutex);
+	
+	modac_c_vdev_devref_unlock(vdev->des);
+		
+	return count;
+}
+
+/*
+ * NOTE: when this table is changed, the attrs_misc must be changed as well
+ */
 static struct device_attribute dev_attr_misc[] = {
 	__ATTR(config, 0660, show_config, store_config),
+	__ATTR(stats, 0660, show_stats, store_stats),
 
 	__ATTR_NULL
 };
@@ -737,6 +2079,7 @@ static struct device_attribute dev_attr_misc[] = {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,12,00)
 static struct attribute *attrs_misc[] = {
 	&dev_attr_misc[0].attr,
+	&dev_attr_misc[1].attr,
 	NULL
 };
 
@@ -772,7 +2115,11 @@ int modac_vdev_create(struct modac_vdev_des *vdev_des)
 	
 	vdev->des = vdev_des;
 	
-	init_dev(vdev);
+	ret = init_dev(vdev);
+	if(ret) {
+		cleanup(vdev, CLEAN_PRIV);
+		return ret;
+	}
 	
 	vdev->devt = MKDEV(vdev_des->major, vdev_des->minor);
 
@@ -787,7 +2134,7 @@ int modac_vdev_create(struct modac_vdev_des *vdev_des)
 		printk(KERN_WARNING "Warning: "
 			"The name for the virtual device '%s' already used for some other MNG_DEV'\n", 
 					vdev_des->name);
-		cleanup(vdev, CLEAN_PRIV);
+		cleanup(vdev, CLEAN_CB);
 		return ret;
 	}
 	
@@ -795,7 +2142,7 @@ int modac_vdev_create(struct modac_vdev_des *vdev_des)
 	if (IS_ERR(vdev->dev)) {
 		printk(KERN_ERR "%s <dev>: Failed to create device!\n", vdev_des->name);
 		ret = PTR_ERR(vdev->dev);
-		cleanup(vdev, CLEAN_PRIV);
+		cleanup(vdev, CLEAN_CB);
 		return ret;
 	}
 
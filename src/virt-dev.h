@@ -11,6 +11,7 @@
 #define MODAC_VIRT_DEV_H_
 
 #include "rm.h"
+#include "lat-hist.h"
 
 /**
  * The maximal possible number of allocated resources for one type in the VIRT_DEV. 
@@ -18,6 +19,9 @@
  */
 #define MODAC_RES_PER_VIRT_DEV_MAX_COUNT 32
 
+struct modac_event_log;
+struct event_list_type;
+
 struct modac_vdev_des {
 	
 	u8 id;
@@ -63,6 +67,47 @@ struct modac_vdev_des {
 	 * If non-zero the HW will not be cleared after the last VIRT_DEV close().
 	 */
 	int leave_res_set_on_last_close;
+	
+	/*
+	 * The number of entries in the event queue, a power of 2. Set by the 
+	 * MNG_DEV before modac_vdev_create is called.
+	 */
+	u32 queue_depth;
+	/*
+	 * The max. data length of the queue entries, CBUF_EVENT_ENTRY_DATA_LENGTH
+	 * or CBUF_EVENT_ENTRY_DATA_LENGTH_EXT. Set by the MNG_DEV before 
+	 * modac_vdev_create is called.
+	 */
+	int entry_data_length;
+	/*
+	 * The MNG_DEV's event log if the VIRT_DEV reads the events from it 
+	 * (MNG_DEV_VDEV_CREATE_FLAG_EVENT_LOG), NULL otherwise. Set by the 
+	 * MNG_DEV before modac_vdev_create is called; the log lives as long 
+	 * as the MNG_DEV.
+	 */
+	struct modac_event_log *event_log;
+	/*
+	 * Held by the MNG_DEV while writing an event to the 'event_log' and 
+	 * marking the subscribed VIRT_DEVs (see modac_vdev_put_cb).
+	 */
+	spinlock_t *event_log_lock;
+	
+	/*
+	 * The number of times the event producers had to wait for each other
+	 * when putting to this VIRT_DEV.
+	 */
+	u32 put_lock_contended;
+	
+	/*
+	 * The latencies from the MNG_DEV stamp (see struct mngdev_data) until
+	 * the event was put to the queue, until the readers were woken up and 
+	 * until it was copied to the user by read(). Updated only while the 
+	 * measurement is on, i.e. 'lat_enabled' is set (by the MNG_DEV).
+	 */
+	int lat_enabled;
+	struct lat_hist lat_enqueue;
+	struct lat_hist lat_wakeup;
+	struct lat_hist lat_copy;
 
 	/** Private data for dev. */
 	void *priv;
@@ -77,7 +122,17 @@ int modac_vdev_create(
 void modac_vdev_destroy(struct modac_vdev_des *vdev_des);
 
 void modac_vdev_notify(struct modac_vdev_des *vdev_des, int event);
-void modac_vdev_put_cb(struct modac_vdev_des *vdev_des, int event, void *data, int length);
+/* The 'stamp' is the latency stamp (see lat_stamp) of the event, 0 if none. */
+void modac_vdev_put_cb(struct modac_vdev_des *vdev_des, int event, void *data, int length,
+		u32 stamp);
+/* Must be called after a batch of modac_vdev_put_cb calls. */
+void modac_vdev_flush_wakeup(struct modac_vdev_des *vdev_des);
+/* 
+ * Sets the events the read() takes from the event log, i.e. the current 
+ * subscriptions of a VIRT_DEV with the 'event_log'.
+ */
+void modac_vdev_set_log_events(struct modac_vdev_des *vdev_des, 
+		const struct event_list_type *events);
 
 void modac_vdev_table_reset(int mngdev_minor);
 
@@ -0,0 +1,1031 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'evrmaDriver'.
+// It is subject to the license terms in the LICENSE.txt file found in the
+// top-level directory of this distribution and at:
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+// No part of 'evrmaDriver', including this file,
+// may be copied, modified, propagated, or distributed except according to
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * The end-to-end benchmark of the event delivery: from the EVR interrupt to
+ * the user space reader.
+ *
+ * Creates N VIRT_DEVs on a MNG_DEV, subscribes them to the given events,
+ * drives the load with the simulator's event generator and reads the events
+ * from M threads. The latency of each Event FIFO event is the
+ * CLOCK_MONOTONIC time after the read() returned minus the 'irq_ktime_ns'
+ * of its struct evr_data_fifo_event_ext (the VIRT_DEVs are created with
+ * MNG_DEV_VDEV_CREATE_FLAG_EXT_DATA). The results are printed as JSON.
+ *
+ * See usage() for the options.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+
+#include "linux-modac.h"
+#include "linux-evrma.h"
+
+#define BENCH_MAX_VDEVS 31
+#define BENCH_MAX_THREADS BENCH_MAX_VDEVS
+#define BENCH_MAX_SETS 8
+#define BENCH_MAX_STREAMS 8
+#define BENCH_EVENT_CODES (VIRT_DEV_EVENT_BITMAP_WORDS * 32)
+
+#define BENCH_DEFAULT_MNGDEV "/dev/evr-sim-mng"
+#define BENCH_DEFAULT_PREFIX "bench"
+#define BENCH_DEFAULT_DURATION_S 10
+#define BENCH_DEFAULT_RATE_HZ 1000
+#define BENCH_DEFAULT_READ_ENTRIES 256
+
+/* How long to wait for udev to create the VIRT_DEV node. */
+#define BENCH_DEVNODE_WAIT_MS 5000
+
+#define SYSFS_MNG_CLASS "/sys/class/modac-mng"
+#define SYSFS_VIRT_CLASS "/sys/class/modac-virt"
+
+/*
+ * The latency histogram: the values below HIST_LINEAR ns have their own
+ * buckets, each higher power of 2 is split into 2^HIST_SUB_BITS buckets
+ * (the resolution is ~3%).
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_LINEAR (2 * HIST_SUB)
+#define HIST_BUCKETS (HIST_LINEAR + (64 - HIST_SUB_BITS - 1) * HIST_SUB)
+
+enum {
+	MODE_POLL,
+	MODE_READ
+};
+
+struct hist {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+struct vdev {
+	char name[MODAC_ID_MAX_NAME + 1];
+	int id;
+	int fd;
+	int set;
+
+	uint32_t entry_size;
+
+	/* counted by the reader */
+	uint64_t events;
+	uint64_t fifo_events;
+	uint64_t unstamped;
+	uint64_t overflow_markers;
+	uint64_t reads;
+
+	/* from the sysfs 'stats' at the end */
+	int have_stats;
+	uint64_t enqueued;
+	uint64_t dropped;
+	uint64_t overflows;
+	uint64_t high_water;
+};
+
+struct reader {
+	pthread_t thread;
+	int index;
+	struct vdev *vdevs[BENCH_MAX_VDEVS];
+	int vdev_count;
+	struct hist hist;
+	int error;
+};
+
+static struct {
+	const char *mngdev;
+	const char *prefix;
+	const char *output;
+	int vdev_count;
+	int thread_count;
+	int duration_s;
+	uint32_t queue_depth;
+	int event_log;
+	int mode;
+	int read_entries;
+	int no_gen;
+	int rate_hz;
+
+	uint32_t sets[BENCH_MAX_SETS][VIRT_DEV_EVENT_BITMAP_WORDS];
+	char set_specs[BENCH_MAX_SETS][128];
+	int set_count;
+
+	char streams[BENCH_MAX_STREAMS][64];
+	int stream_count;
+	uint32_t jitter_ns;
+} cfg = {
+	.mngdev = BENCH_DEFAULT_MNGDEV,
+	.prefix = BENCH_DEFAULT_PREFIX,
+	.vdev_count = 1,
+	.duration_s = BENCH_DEFAULT_DURATION_S,
+	.mode = MODE_POLL,
+	.read_entries = BENCH_DEFAULT_READ_ENTRIES,
+	.rate_hz = BENCH_DEFAULT_RATE_HZ,
+};
+
+static struct vdev vdevs[BENCH_MAX_VDEVS];
+static struct reader readers[BENCH_MAX_THREADS];
+static int mng_fd = -1;
+static char mng_name[MODAC_ID_MAX_NAME + 1];
+
+static volatile int stop;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -m MNGDEV       the MNG_DEV (default %s)\n"
+		"  -n N            the number of VIRT_DEVs, 1..%d (default 1)\n"
+		"  -t M            the number of reader threads (default N)\n"
+		"  -e EVENTS       an event set, e.g. '1,40-45'; repeat for more sets,\n"
+		"                  VIRT_DEV i is subscribed to the set i %% count\n"
+		"                  (default 1)\n"
+		"  -g STREAM       a generator stream CODE:RATE_HZ[:BURST[:DBUF_BYTES]],\n"
+		"                  up to %d (default: each subscribed code at -R Hz)\n"
+		"  -R RATE_HZ      the rate of the default streams (default %d)\n"
+		"  -j NS           the generator jitter\n"
+		"  -G              don't drive the generator (real HW or external load)\n"
+		"  -d SECONDS      the duration (default %d)\n"
+		"  -q DEPTH        the VIRT_DEV queue depth (default: the driver's)\n"
+		"  -L              read from the MNG_DEV's event log instead of the\n"
+		"                  VIRT_DEV queues (MNG_DEV_VDEV_CREATE_FLAG_EVENT_LOG)\n"
+		"  -r poll|read    poll() all the VIRT_DEVs of a thread, or a blocking\n"
+		"                  read() (one VIRT_DEV per thread) (default poll)\n"
+		"  -b ENTRIES      the max. entries per read() (default %d)\n"
+		"  -p PREFIX       the VIRT_DEV name prefix (default %s)\n"
+		"  -o FILE         the JSON output (default stdout)\n",
+		prog, BENCH_DEFAULT_MNGDEV, BENCH_MAX_VDEVS, BENCH_MAX_STREAMS,
+		BENCH_DEFAULT_RATE_HZ, BENCH_DEFAULT_DURATION_S,
+		BENCH_DEFAULT_READ_ENTRIES, BENCH_DEFAULT_PREFIX);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ------ histogram -----------------------------------------------------------
+
+static int hist_index(uint64_t ns)
+{
+	int e;
+
+	if(ns < HIST_LINEAR)
+		return (int)ns;
+
+	e = 63 - __builtin_clzll(ns);
+	return HIST_LINEAR + (e - HIST_SUB_BITS - 1) * HIST_SUB +
+			(int)((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* The highest value counted in the bucket. */
+static uint64_t hist_bucket_top(int i)
+{
+	int e, s;
+
+	if(i < HIST_LINEAR)
+		return i;
+
+	e = (i - HIST_LINEAR) / HIST_SUB + HIST_SUB_BITS + 1;
+	s = (i - HIST_LINEAR) % HIST_SUB;
+	return ((uint64_t)(HIST_SUB + s + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_add(struct hist *hist, uint64_t ns)
+{
+	if(hist->count == 0 || ns < hist->min_ns)
+		hist->min_ns = ns;
+	if(ns > hist->max_ns)
+		hist->max_ns = ns;
+	hist->count ++;
+	hist->total_ns += ns;
+	hist->buckets[hist_index(ns)] ++;
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+	int i;
+
+	if(src->count == 0)
+		return;
+
+	if(dst->count == 0 || src->min_ns < dst->min_ns)
+		dst->min_ns = src->min_ns;
+	if(src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+	dst->count += src->count;
+	dst->total_ns += src->total_ns;
+	for(i = 0; i < HIST_BUCKETS; i ++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+/* The percentile as the top of its bucket, but not above the max. */
+static uint64_t hist_percentile(const struct hist *hist, double p)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if(hist->count == 0)
+		return 0;
+
+	rank = (uint64_t)(p / 100.0 * hist->count + 0.5);
+	if(rank == 0)
+		rank = 1;
+
+	for(i = 0; i < HIST_BUCKETS; i ++) {
+		seen += hist->buckets[i];
+		if(seen >= rank) {
+			uint64_t top = hist_bucket_top(i);
+			return top < hist->max_ns ? top : hist->max_ns;
+		}
+	}
+
+	return hist->max_ns;
+}
+
+// ------ options -------------------------------------------------------------
+
+/* Parses '1,40-45,140' into the event bitmap. */
+static int parse_event_set(const char *spec, uint32_t *bitmap)
+{
+	const char *p = spec;
+
+	memset(bitmap, 0, VIRT_DEV_EVENT_BITMAP_WORDS * sizeof(uint32_t));
+
+	while(*p) {
+		char *end;
+		long first, last, e;
+
+		first = strtol(p, &end, 0);
+		if(end == p)
+			return -EINVAL;
+		last = first;
+		p = end;
+
+		if(*p == '-') {
+			p ++;
+			last = strtol(p, &end, 0);
+			if(end == p)
+				return -EINVAL;
+			p = end;
+		}
+
+		if(first < 0 || last < first || last >= BENCH_EVENT_CODES)
+			return -EINVAL;
+
+		for(e = first; e <= last; e ++)
+			bitmap[e / 32] |= 1U << (e % 32);
+
+		if(*p == ',')
+			p ++;
+		else if(*p != 0)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* CODE:RATE_HZ[:BURST[:DBUF_BYTES]] into the generator's 'add' arguments. */
+static int parse_stream(const char *spec, char *add, size_t len)
+{
+	unsigned int code, rate_hz, burst = 1, dbuf_bytes = 0;
+
+	if(sscanf(spec, "%u:%u:%u:%u", &code, &rate_hz, &burst, &dbuf_bytes) < 2)
+		return -EINVAL;
+
+	snprintf(add, len, "%u %u %u %u", code, rate_hz, burst, dbuf_bytes);
+	return 0;
+}
+
+static int parse_args(int argc, char **argv)
+{
+	int opt;
+
+	while((opt = getopt(argc, argv, "m:n:t:e:g:R:j:Gd:q:Lr:b:p:o:h")) != -1) {
+		switch(opt) {
+		case 'm':
+			cfg.mngdev = optarg;
+			break;
+		case 'n':
+			cfg.vdev_count = atoi(optarg);
+			break;
+		case 't':
+			cfg.thread_count = atoi(optarg);
+			break;
+		case 'e':
+			if(cfg.set_count >= BENCH_MAX_SETS ||
+					parse_event_set(optarg, cfg.sets[cfg.set_count]) < 0) {
+				fprintf(stderr, "Invalid event set '%s'\n", optarg);
+				return -EINVAL;
+			}
+			snprintf(cfg.set_specs[cfg.set_count],
+					sizeof(cfg.set_specs[0]), "%s", optarg);
+			cfg.set_count ++;
+			break;
+		case 'g':
+			if(cfg.stream_count >= BENCH_MAX_STREAMS ||
+					parse_stream(optarg, cfg.streams[cfg.stream_count],
+								sizeof(cfg.streams[0])) < 0) {
+				fprintf(stderr, "Invalid stream '%s'\n", optarg);
+				return -EINVAL;
+			}
+			cfg.stream_count ++;
+			break;
+		case 'R':
+			cfg.rate_hz = atoi(optarg);
+			break;
+		case 'j':
+			cfg.jitter_ns = strtoul(optarg, NULL, 0);
+			break;
+		case 'G':
+			cfg.no_gen = 1;
+			break;
+		case 'd':
+			cfg.duration_s = atoi(optarg);
+			break;
+		case 'q':
+			cfg.queue_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			cfg.event_log = 1;
+			break;
+		case 'r':
+			if(strcmp(optarg, "poll") == 0) {
+				cfg.mode = MODE_POLL;
+			} else if(strcmp(optarg, "read") == 0) {
+				cfg.mode = MODE_READ;
+			} else {
+				fprintf(stderr, "Invalid read mode '%s'\n", optarg);
+				return -EINVAL;
+			}
+			break;
+		case 'b':
+			cfg.read_entries = atoi(optarg);
+			break;
+		case 'p':
+			cfg.prefix = optarg;
+			break;
+		case 'o':
+			cfg.output = optarg;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	if(cfg.set_count == 0) {
+		parse_event_set("1", cfg.sets[0]);
+		strcpy(cfg.set_specs[0], "1");
+		cfg.set_count = 1;
+	}
+
+	if(cfg.thread_count == 0)
+		cfg.thread_count = cfg.vdev_count;
+
+	if(cfg.vdev_count < 1 || cfg.vdev_count > BENCH_MAX_VDEVS ||
+			cfg.thread_count < 1 || cfg.thread_count > cfg.vdev_count ||
+			cfg.duration_s < 1 || cfg.read_entries < 1 || cfg.rate_hz < 1) {
+		fprintf(stderr, "Invalid arguments\n");
+		return -EINVAL;
+	}
+
+	if(cfg.mode == MODE_READ && cfg.thread_count != cfg.vdev_count) {
+		fprintf(stderr, "The read mode needs one thread per VIRT_DEV\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+// ------ sysfs ---------------------------------------------------------------
+
+static int sysfs_write(const char *path, const char *value)
+{
+	int fd = open(path, O_WRONLY);
+	int ret = 0;
+
+	if(fd < 0)
+		return -errno;
+
+	if(write(fd, value, strlen(value)) < 0)
+		ret = -errno;
+
+	close(fd);
+	return ret;
+}
+
+static int sysfs_read(const char *path, char *buf, size_t len)
+{
+	int fd = open(path, O_RDONLY);
+	ssize_t n;
+
+	if(fd < 0)
+		return -errno;
+
+	n = read(fd, buf, len - 1);
+	close(fd);
+
+	if(n < 0)
+		return -errno;
+
+	buf[n] = 0;
+	return 0;
+}
+
+static int gen_cmd(const char *cmd)
+{
+	char path[256];
+	char line[128];
+	int ret;
+
+	snprintf(path, sizeof(path), SYSFS_MNG_CLASS "/%s/dbg", mng_name);
+	snprintf(line, sizeof(line), "gen %s", cmd);
+
+	ret = sysfs_write(path, line);
+	if(ret < 0)
+		fprintf(stderr, "'%s' to %s failed: %s\n", line, path, strerror(-ret));
+
+	return ret;
+}
+
+/* Reads the 'Generator:' line of the simulation's dbg attribute. */
+static int gen_counters(uint64_t *events, uint64_t *unmapped, uint64_t *fifo_drops)
+{
+	char path[256];
+	char buf[4096];
+	unsigned long long ev, un;
+	unsigned int fd;
+	char *line;
+
+	snprintf(path, sizeof(path), SYSFS_MNG_CLASS "/%s/dbg", mng_name);
+	if(sysfs_read(path, buf, sizeof(buf)) < 0)
+		return -EIO;
+
+	line = strstr(buf, "Generator:");
+	if(line == NULL)
+		return -ENOENT;
+
+	line = strstr(line, "events=");
+	if(line == NULL ||
+			sscanf(line, "events=%llu unmapped=%llu fifo_drops=%u",
+				&ev, &un, &fd) != 3)
+		return -EINVAL;
+
+	*events = ev;
+	*unmapped = un;
+	*fifo_drops = fd;
+	return 0;
+}
+
+static void vdev_read_stats(struct vdev *vdev)
+{
+	char path[sizeof(SYSFS_VIRT_CLASS) + sizeof(vdev->name) + 8];
+	char buf[512];
+	unsigned int put, dropped, overflows, high_water;
+
+	snprintf(path, sizeof(path), SYSFS_VIRT_CLASS "/%.*s/stats",
+			MODAC_ID_MAX_NAME, vdev->name);
+	if(sysfs_read(path, buf, sizeof(buf)) < 0)
+		return;
+
+	if(sscanf(buf, "enqueued=%u dropped=%u overflows=%u high_water=%u",
+			&put, &dropped, &overflows, &high_water) != 4)
+		return;
+
+	vdev->enqueued = put;
+	vdev->dropped = dropped;
+	vdev->overflows = overflows;
+	vdev->high_water = high_water;
+	vdev->have_stats = 1;
+}
+
+// ------ VIRT_DEVs -----------------------------------------------------------
+
+static int vdev_open(struct vdev *vdev)
+{
+	char path[sizeof(vdev->name) + 8];
+	int waited;
+
+	snprintf(path, sizeof(path), "/dev/%.*s", MODAC_ID_MAX_NAME, vdev->name);
+
+	for(waited = 0; ; waited += 10) {
+		vdev->fd = open(path, O_RDWR | (cfg.mode == MODE_POLL ? O_NONBLOCK : 0));
+		if(vdev->fd >= 0)
+			return 0;
+		if(errno != ENOENT || waited >= BENCH_DEVNODE_WAIT_MS)
+			break;
+		usleep(10000);
+	}
+
+	fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+	return -errno;
+}
+
+static int vdev_create(struct vdev *vdev)
+{
+	struct mngdev_ioctl_vdev_create create_args;
+	struct mngdev_ioctl_vdev_ids ids;
+	struct vdev_ioctl_read_format read_format;
+	struct vdev_ioctl_subscribe_bulk bulk;
+	int ret;
+
+	memset(&create_args, 0, sizeof(create_args));
+	memcpy(create_args.name, vdev->name, sizeof(create_args.name));
+	create_args.queue_depth = cfg.queue_depth;
+	create_args.flags = MNG_DEV_VDEV_CREATE_FLAG_EXT_DATA;
+	if(cfg.event_log)
+		create_args.flags |= MNG_DEV_VDEV_CREATE_FLAG_EVENT_LOG;
+
+	if(ioctl(mng_fd, MNG_DEV_IOC_CREATE_EXT, &create_args) < 0) {
+		fprintf(stderr, "Can't create %s: %s\n", vdev->name, strerror(errno));
+		return -errno;
+	}
+
+	memset(&ids, 0, sizeof(ids));
+	memcpy(ids.name, vdev->name, sizeof(ids.name));
+	if(ioctl(mng_fd, MNG_DEV_IOC_VIRT_DEV_FIND, &ids) < 0 || ids.id == 0) {
+		fprintf(stderr, "Can't find %s\n", vdev->name);
+		return -ENODEV;
+	}
+	vdev->id = ids.id;
+
+	ret = vdev_open(vdev);
+	if(ret < 0)
+		return ret;
+
+	memset(&read_format, 0, sizeof(read_format));
+	read_format.format = VIRT_DEV_READ_FORMAT_RING_ENTRIES;
+	if(ioctl(vdev->fd, VIRT_DEV_IOC_READ_FORMAT_SET, &read_format) < 0) {
+		fprintf(stderr, "%s: read format: %s\n", vdev->name, strerror(errno));
+		return -errno;
+	}
+	vdev->entry_size = read_format.entry_size;
+
+	memset(&bulk, 0, sizeof(bulk));
+	bulk.action = VIRT_DEV_IOCTL_SUBSCRIBE_BULK_REPLACE;
+	memcpy(bulk.events, cfg.sets[vdev->set], sizeof(bulk.events));
+	if(ioctl(vdev->fd, VIRT_DEV_IOC_SUBSCRIBE_BULK, &bulk) < 0) {
+		fprintf(stderr, "%s: subscribe: %s\n", vdev->name, strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void vdev_destroy(struct vdev *vdev)
+{
+	struct mngdev_ioctl_destroy destroy_args;
+
+	if(vdev->fd >= 0) {
+		close(vdev->fd);
+		vdev->fd = -1;
+	}
+
+	if(vdev->id > 0) {
+		memset(&destroy_args, 0, sizeof(destroy_args));
+		destroy_args.id = vdev->id;
+		if(ioctl(mng_fd, MNG_DEV_IOC_DESTROY, &destroy_args) < 0)
+			fprintf(stderr, "Can't destroy %s: %s\n", vdev->name, strerror(errno));
+		vdev->id = 0;
+	}
+}
+
+// ------ readers -------------------------------------------------------------
+
+/* Accounts the entries of one read() returned at 'now'. */
+static void account_entries(struct reader *reader, struct vdev *vdev,
+		const uint8_t *buf, ssize_t len, uint64_t now)
+{
+	ssize_t off;
+
+	vdev->reads ++;
+
+	for(off = 0; off + vdev->entry_size <= len; off += vdev->entry_size) {
+
+		const struct modac_event_ring_entry *entry =
+				(const struct modac_event_ring_entry *)(buf + off);
+		struct evr_data_fifo_event_ext ext;
+
+		vdev->events ++;
+
+		if(entry->event == MODAC_EVENT_READ_OVERFLOW) {
+			vdev->overflow_markers ++;
+			continue;
+		}
+
+		if(entry->event > EVRMA_FIFO_MAX_EVENT_CODE)
+			continue;
+
+		vdev->fifo_events ++;
+
+		if(entry->length < sizeof(ext)) {
+			vdev->unstamped ++;
+			continue;
+		}
+
+		/* the data is not aligned for the 64-bit fields */
+		memcpy(&ext, entry->data, sizeof(ext));
+		if(ext.irq_ktime_ns == 0 || ext.irq_ktime_ns > now) {
+			vdev->unstamped ++;
+			continue;
+		}
+
+		hist_add(&reader->hist, now - ext.irq_ktime_ns);
+	}
+}
+
+static void *reader_main(void *arg)
+{
+	struct reader *reader = (struct reader *)arg;
+	struct pollfd pfds[BENCH_MAX_VDEVS];
+	size_t buf_len = (size_t)cfg.read_entries *
+			reader->vdevs[0]->entry_size;
+	uint8_t *buf = malloc(buf_len);
+	int i;
+
+	if(buf == NULL) {
+		reader->error = -ENOMEM;
+		return NULL;
+	}
+
+	for(i = 0; i < reader->vdev_count; i ++) {
+		pfds[i].fd = reader->vdevs[i]->fd;
+		pfds[i].events = POLLIN;
+	}
+
+	while(!stop) {
+
+		if(cfg.mode == MODE_READ) {
+
+			struct vdev *vdev = reader->vdevs[0];
+			ssize_t n = read(vdev->fd, buf, buf_len);
+
+			if(n < 0) {
+				if(errno == EINTR)
+					continue;
+				reader->error = -errno;
+				break;
+			}
+			account_entries(reader, vdev, buf, n, now_ns());
+
+		} else {
+
+			int ret = poll(pfds, reader->vdev_count, 100);
+
+			if(ret < 0) {
+				if(errno == EINTR)
+					continue;
+				reader->error = -errno;
+				break;
+			}
+
+			for(i = 0; i < reader->vdev_count && ret > 0; i ++) {
+
+				struct vdev *vdev = reader->vdevs[i];
+				ssize_t n;
+
+				if(!(pfds[i].revents & POLLIN))
+					continue;
+
+				n = read(vdev->fd, buf, buf_len);
+				if(n < 0) {
+					if(errno == EAGAIN || errno == EINTR)
+						continue;
+					reader->error = -errno;
+					goto done;
+				}
+				account_entries(reader, vdev, buf, n, now_ns());
+			}
+		}
+	}
+
+done:
+	free(buf);
+	return NULL;
+}
+
+/* Only to interrupt the blocking read()s. */
+static void on_signal(int sig)
+{
+}
+
+// ------ output --------------------------------------------------------------
+
+static void print_hist(FILE *f, const char *indent, const struct hist *hist)
+{
+	fprintf(f, "{\n");
+	fprintf(f, "%s  \"count\": %llu,\n", indent, (unsigned long long)hist->count);
+	fprintf(f, "%s  \"min\": %llu,\n", indent, (unsigned long long)hist->min_ns);
+	fprintf(f, "%s  \"mean\": %llu,\n", indent, (unsigned long long)
+			(hist->count ? hist->total_ns / hist->count : 0));
+	fprintf(f, "%s  \"p50\": %llu,\n", indent,
+			(unsigned long long)hist_percentile(hist, 50));
+	fprintf(f, "%s  \"p90\": %llu,\n", indent,
+			(unsigned long long)hist_percentile(hist, 90));
+	fprintf(f, "%s  \"p99\": %llu,\n", indent,
+			(unsigned long long)hist_percentile(hist, 99));
+	fprintf(f, "%s  \"p99_9\": %llu,\n", indent,
+			(unsigned long long)hist_percentile(hist, 99.9));
+	fprintf(f, "%s  \"p99_99\": %llu,\n", indent,
+			(unsigned long long)hist_percentile(hist, 99.99));
+	fprintf(f, "%s  \"max\": %llu\n", indent, (unsigned long long)hist->max_ns);
+	fprintf(f, "%s}", indent);
+}
+
+static double ratio(uint64_t a, uint64_t b)
+{
+	return b ? (double)a / b : 0.0;
+}
+
+static void print_results(FILE *f, double elapsed_s, int have_gen,
+		uint64_t gen_events, uint64_t gen_unmapped, uint64_t gen_fifo_drops)
+{
+	struct hist *total = calloc(1, sizeof(*total));
+	uint64_t events = 0, markers = 0, enqueued = 0, dropped = 0;
+	struct utsname uts;
+	int i;
+
+	for(i = 0; i < cfg.thread_count; i ++)
+		hist_merge(total, &readers[i].hist);
+
+	for(i = 0; i < cfg.vdev_count; i ++) {
+		events += vdevs[i].events;
+		markers += vdevs[i].overflow_markers;
+		enqueued += vdevs[i].enqueued;
+		dropped += vdevs[i].dropped;
+	}
+
+	uname(&uts);
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"system\": { \"kernel\": \"%s\", \"machine\": \"%s\" },\n",
+			uts.release, uts.machine);
+
+	fprintf(f, "  \"config\": {\n");
+	fprintf(f, "    \"mngdev\": \"%s\",\n", cfg.mngdev);
+	fprintf(f, "    \"vdevs\": %d,\n", cfg.vdev_count);
+	fprintf(f, "    \"threads\": %d,\n", cfg.thread_count);
+	fprintf(f, "    \"mode\": \"%s\",\n", cfg.mode == MODE_READ ? "read" : "poll");
+	fprintf(f, "    \"read_entries\": %d,\n", cfg.read_entries);
+	fprintf(f, "    \"queue_depth\": %u,\n", cfg.queue_depth);
+	fprintf(f, "    \"event_log\": %s,\n", cfg.event_log ? "true" : "false");
+	fprintf(f, "    \"duration_s\": %d,\n", cfg.duration_s);
+	fprintf(f, "    \"event_sets\": [");
+	for(i = 0; i < cfg.set_count; i ++)
+		fprintf(f, "%s\"%s\"", i ? ", " : "", cfg.set_specs[i]);
+	fprintf(f, "],\n");
+	fprintf(f, "    \"generator\": [");
+	for(i = 0; i < (cfg.no_gen ? 0 : cfg.stream_count); i ++) {
+		unsigned int code, rate_hz, burst, dbuf_bytes;
+
+		sscanf(cfg.streams[i], "%u %u %u %u", &code, &rate_hz, &burst, &dbuf_bytes);
+		fprintf(f, "%s{ \"code\": %u, \"rate_hz\": %u, \"burst\": %u, "
+				"\"dbuf_bytes\": %u }", i ? ", " : "", code, rate_hz, burst,
+				dbuf_bytes);
+	}
+	fprintf(f, "],\n");
+	fprintf(f, "    \"jitter_ns\": %u\n", cfg.jitter_ns);
+	fprintf(f, "  },\n");
+
+	fprintf(f, "  \"elapsed_s\": %.3f,\n", elapsed_s);
+	if(have_gen) {
+		fprintf(f, "  \"generated\": { \"events\": %llu, \"unmapped\": %llu, "
+				"\"fifo_drops\": %llu },\n", (unsigned long long)gen_events,
+				(unsigned long long)gen_unmapped,
+				(unsigned long long)gen_fifo_drops);
+	}
+	fprintf(f, "  \"delivered\": %llu,\n", (unsigned long long)events);
+	fprintf(f, "  \"throughput_eps\": %.1f,\n", events / elapsed_s);
+	fprintf(f, "  \"overflow_markers\": %llu,\n", (unsigned long long)markers);
+	fprintf(f, "  \"dropped\": %llu,\n", (unsigned long long)dropped);
+	fprintf(f, "  \"drop_rate\": %.6f,\n", ratio(dropped, enqueued + dropped));
+	fprintf(f, "  \"latency_ns\": ");
+	print_hist(f, "  ", total);
+	fprintf(f, ",\n");
+
+	fprintf(f, "  \"vdevs\": [\n");
+	for(i = 0; i < cfg.vdev_count; i ++) {
+		struct vdev *vdev = &vdevs[i];
+
+		fprintf(f, "    { \"name\": \"%s\", \"set\": %d, \"events\": %llu, "
+				"\"fifo_events\": %llu, \"unstamped\": %llu, "
+				"\"overflow_markers\": %llu, \"reads\": %llu, "
+				"\"events_per_read\": %.2f",
+				vdev->name, vdev->set,
+				(unsigned long long)vdev->events,
+				(unsigned long long)vdev->fifo_events,
+				(unsigned long long)vdev->unstamped,
+				(unsigned long long)vdev->overflow_markers,
+				(unsigned long long)vdev->reads,
+				ratio(vdev->events, vdev->reads));
+		if(vdev->have_stats) {
+			fprintf(f, ", \"enqueued\": %llu, \"dropped\": %llu, "
+					"\"overflows\": %llu, \"high_water\": %llu",
+					(unsigned long long)vdev->enqueued,
+					(unsigned long long)vdev->dropped,
+					(unsigned long long)vdev->overflows,
+					(unsigned long long)vdev->high_water);
+		}
+		fprintf(f, " }%s\n", i + 1 < cfg.vdev_count ? "," : "");
+	}
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+
+	free(total);
+}
+
+// ------ main ----------------------------------------------------------------
+
+/* Without the -g, one stream per subscribed Event FIFO code. */
+static int default_streams(void)
+{
+	int e, i;
+
+	for(e = EVRMA_FIFO_MIN_EVENT_CODE + 1; e <= EVRMA_FIFO_MAX_EVENT_CODE; e ++) {
+
+		int used = 0;
+
+		for(i = 0; i < cfg.set_count; i ++)
+			used |= (cfg.sets[i][e / 32] >> (e % 32)) & 1;
+		if(!used)
+			continue;
+
+		if(cfg.stream_count >= BENCH_MAX_STREAMS) {
+			fprintf(stderr, "More than %d codes subscribed, use -g\n",
+					BENCH_MAX_STREAMS);
+			return -EINVAL;
+		}
+
+		snprintf(cfg.streams[cfg.stream_count], sizeof(cfg.streams[0]),
+				"%d %d 1 0", e, cfg.rate_hz);
+		cfg.stream_count ++;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char mngdev_path[256];
+	struct sigaction sa;
+	uint64_t gen_events = 0, gen_unmapped = 0, gen_fifo_drops = 0;
+	uint64_t t_start = 0, t_end = 0;
+	struct timespec duration;
+	int have_gen = 0;
+	int ret = 1;
+	int created = 0;
+	int started = 0;
+	int i;
+	FILE *f = stdout;
+
+	if(parse_args(argc, argv) < 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	if(!cfg.no_gen && cfg.stream_count == 0 && default_streams() < 0)
+		return 2;
+
+	snprintf(mngdev_path, sizeof(mngdev_path), "%s", cfg.mngdev);
+	snprintf(mng_name, sizeof(mng_name), "%s", basename(mngdev_path));
+
+	mng_fd = open(cfg.mngdev, O_RDWR);
+	if(mng_fd < 0) {
+		fprintf(stderr, "Can't open %s: %s\n", cfg.mngdev, strerror(errno));
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	for(i = 0; i < cfg.vdev_count; i ++) {
+		vdevs[i].fd = -1;
+		vdevs[i].set = i % cfg.set_count;
+		snprintf(vdevs[i].name, sizeof(vdevs[i].name), "%s%d", cfg.prefix, i);
+	}
+
+	for(created = 0; created < cfg.vdev_count; created ++) {
+		if(vdev_create(&vdevs[created]) < 0)
+			goto bail;
+	}
+
+	if(!cfg.no_gen) {
+		if(gen_cmd("stop") < 0 || gen_cmd("clear") < 0)
+			goto bail;
+		if(cfg.jitter_ns) {
+			char cmd[64];
+			snprintf(cmd, sizeof(cmd), "jitter %u", cfg.jitter_ns);
+			if(gen_cmd(cmd) < 0)
+				goto bail;
+		}
+		for(i = 0; i < cfg.stream_count; i ++) {
+			char cmd[80];
+			snprintf(cmd, sizeof(cmd), "add %s", cfg.streams[i]);
+			if(gen_cmd(cmd) < 0)
+				goto bail;
+		}
+	}
+
+	/* the VIRT_DEVs round robin to the threads */
+	for(i = 0; i < cfg.vdev_count; i ++) {
+		struct reader *reader = &readers[i % cfg.thread_count];
+		reader->vdevs[reader->vdev_count ++] = &vdevs[i];
+	}
+
+	for(started = 0; started < cfg.thread_count; started ++) {
+		readers[started].index = started;
+		if(pthread_create(&readers[started].thread, NULL, reader_main,
+						&readers[started]) != 0) {
+			fprintf(stderr, "Can't start the reader thread\n");
+			goto bail_threads;
+		}
+	}
+
+	t_start = now_ns();
+
+	if(!cfg.no_gen && gen_cmd("start") < 0)
+		goto bail_threads;
+
+	duration.tv_sec = cfg.duration_s;
+	duration.tv_nsec = 0;
+	while(nanosleep(&duration, &duration) < 0 && errno == EINTR)
+		;
+
+	if(!cfg.no_gen) {
+		gen_cmd("stop");
+		have_gen = gen_counters(&gen_events, &gen_unmapped, &gen_fifo_drops) == 0;
+	}
+
+	t_end = now_ns();
+	ret = 0;
+
+bail_threads:
+
+	stop = 1;
+	for(i = 0; i < started; i ++) {
+		pthread_kill(readers[i].thread, SIGUSR1);
+		pthread_join(readers[i].thread, NULL);
+		if(readers[i].error) {
+			fprintf(stderr, "Reader %d failed: %s\n", i,
+					strerror(-readers[i].error));
+			ret = 1;
+		}
+	}
+
+	if(ret == 0) {
+
+		for(i = 0; i < cfg.vdev_count; i ++)
+			vdev_read_stats(&vdevs[i]);
+
+		if(cfg.output != NULL) {
+			f = fopen(cfg.output, "w");
+			if(f == NULL) {
+				fprintf(stderr, "Can't open %s: %s\n", cfg.output, strerror(errno));
+				ret = 1;
+			}
+		}
+
+		if(f != NULL) {
+			print_results(f, (t_end - t_start) / 1e9, have_gen,
+					gen_events, gen_unmapped, gen_fifo_drops);
+			if(f != stdout)
+				fclose(f);
+		}
+	}
+
+bail:
+
+	for(i = 0; i < created; i ++)
+		vdev_destroy(&vdevs[i]);
+	if(created < cfg.vdev_count)
+		vdev_destroy(&vdevs[created]);
+
+	close(mng_fd);
+
+	return ret;
+}
@@ -0,0 +1,281 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'evrmaDriver'.
+// It is subject to the license terms in the LICENSE.txt file found in the
+// top-level directory of this distribution and at:
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+// No part of 'evrmaDriver', including this file,
+// may be copied, modified, propagated, or distributed except according to
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+#ifndef UBENCH_KSHIM_H_
+#define UBENCH_KSHIM_H_
+
+/*
+ * The part of the kernel API used by the EVR independent core (rm.c,
+ * event-list.c, packet-queue.c), implemented in the user space. Every
+ * <linux/...> header these files include is generated by the Makefile and
+ * includes just this file.
+ *
+ * Only single threaded use is intended: the barriers are real, but there
+ * is no sleeping and nobody to wake up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+// ------ types ---------------------------------------------------------------
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef unsigned int gfp_t;
+typedef int irqreturn_t;
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE KERNEL_VERSION(5, 0, 0)
+
+// ------ general -------------------------------------------------------------
+
+#define KERN_ERR ""
+#define KERN_WARNING ""
+#define KERN_INFO ""
+#define KERN_DEBUG ""
+
+/* The core prints on init only; that goes to stderr not to spoil the results. */
+#define printk(...) fprintf(stderr, __VA_ARGS__)
+
+#define BUILD_BUG_ON(cond) ((void)sizeof(char[1 - 2 * !!(cond)]))
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b) ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((typeof(x))(a) - 1))
+
+#define PAGE_SIZE 4096UL
+#define PAGE_ALIGN(x) ALIGN((unsigned long)(x), PAGE_SIZE)
+
+static inline int is_power_of_2(unsigned long n)
+{
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+static inline int scnprintf(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	if(size == 0)
+		return 0;
+
+	va_start(args, fmt);
+	n = vsnprintf(buf, size, fmt, args);
+	va_end(args);
+
+	if(n < 0)
+		return 0;
+
+	return (size_t)n >= size ? (int)(size - 1) : n;
+}
+
+// ------ memory --------------------------------------------------------------
+
+static inline void *kmalloc(size_t size, gfp_t flags)
+{
+	return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+	return calloc(1, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+static inline void *vzalloc(unsigned long size)
+{
+	return calloc(1, size);
+}
+
+static inline void *vmalloc_user(unsigned long size)
+{
+	return calloc(1, size);
+}
+
+static inline void vfree(const void *p)
+{
+	free((void *)p);
+}
+
+// ------ barriers and the once accessors -------------------------------------
+
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define smp_rmb() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb() __atomic_thread_fence(__ATOMIC_RELEASE)
+
+#define READ_ONCE(x) (*(const volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile typeof(x) *)&(x) = (val))
+
+// ------ circ_buf ------------------------------------------------------------
+
+#define CIRC_CNT(head, tail, size) (((head) - (tail)) & ((size) - 1))
+#define CIRC_SPACE(head, tail, size) CIRC_CNT((tail), ((head) + 1), (size))
+
+// ------ bitmaps -------------------------------------------------------------
+
+#define BITS_PER_LONG (8 * (int)sizeof(long))
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define BIT_WORD(nr) ((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr) (1UL << ((nr) % BITS_PER_LONG))
+
+static inline void set_bit(int nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void __set_bit(int nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void clear_bit(int nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline int test_bit(int nr, const unsigned long *addr)
+{
+	return (addr[BIT_WORD(nr)] & BIT_MASK(nr)) != 0;
+}
+
+static inline unsigned long __ffs(unsigned long word)
+{
+	return __builtin_ctzl(word);
+}
+
+static inline void bitmap_zero(unsigned long *dst, int nbits)
+{
+	memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(long));
+}
+
+static inline void bitmap_fill(unsigned long *dst, int nbits)
+{
+	memset(dst, 0xff, BITS_TO_LONGS(nbits) * sizeof(long));
+}
+
+static inline int bitmap_empty(const unsigned long *src, int nbits)
+{
+	int i;
+
+	for(i = 0; i < BITS_TO_LONGS(nbits); i ++) {
+		if(src[i] != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+static inline void bitmap_or(unsigned long *dst, const unsigned long *src1,
+		const unsigned long *src2, int nbits)
+{
+	int i;
+
+	for(i = 0; i < BITS_TO_LONGS(nbits); i ++)
+		dst[i] = src1[i] | src2[i];
+}
+
+static inline unsigned long find_first_bit(const unsigned long *addr,
+		unsigned long size)
+{
+	unsigned long i;
+
+	for(i = 0; i < (unsigned long)BITS_TO_LONGS(size); i ++) {
+		if(addr[i] != 0) {
+			unsigned long bit = i * BITS_PER_LONG + __ffs(addr[i]);
+			return bit < size ? bit : size;
+		}
+	}
+
+	return size;
+}
+
+// ------ kref ----------------------------------------------------------------
+
+struct kref {
+	int refcount;
+};
+
+static inline void kref_init(struct kref *kref)
+{
+	kref->refcount = 1;
+}
+
+static inline void kref_get(struct kref *kref)
+{
+	kref->refcount ++;
+}
+
+static inline int kref_put(struct kref *kref, void (*release)(struct kref *kref))
+{
+	if(-- kref->refcount == 0) {
+		release(kref);
+		return 1;
+	}
+
+	return 0;
+}
+
+// ------ wait queues and mmap (not used by the benchmarks) -------------------
+
+typedef struct {
+	int unused;
+} wait_queue_head_t;
+
+#define wake_up_interruptible(wq) ((void)(wq))
+
+#define VM_WRITE 0x2
+#define VM_SHARED 0x8
+#define VM_MAYWRITE 0x20
+
+struct vm_area_struct;
+
+struct vm_operations_struct {
+	void (*open)(struct vm_area_struct *vma);
+	void (*close)(struct vm_area_struct *vma);
+};
+
+struct vm_area_struct {
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_flags;
+	void *vm_private_data;
+	const struct vm_operations_struct *vm_ops;
+};
+
+static inline int remap_vmalloc_range(struct vm_area_struct *vma, void *addr,
+		unsigned long pgoff)
+{
+	return -ENOSYS;
+}
+
+#endif /* UBENCH_KSHIM_H_ */
@@ -0,0 +1,654 @@
+//////////////////////////////////////////////////////////////////////////////
+// This file is part of 'evrmaDriver'.
+// It is subject to the license terms in the LICENSE.txt file found in the
+// top-level directory of this distribution and at:
+//    https://confluence.slac.stanford.edu/display/ppareg/LICENSE.html.
+// No part of 'evrmaDriver', including this file,
+// may be copied, modified, propagated, or distributed except according to
+// the terms contained in the LICENSE.txt file.
+//////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Microbenchmarks of the EVR independent core in the user space.
+ *
+ * Usage: ubench [-s SCALE] [-r REPEAT] [-f FILTER]
+ *
+ * -s multiplies the number of the operations (default 1), -r is the number
+ * of the runs of each case of which the fastest is printed (default 5), -f
+ * runs only the cases whose name contains FILTER.
+ *
+ * One line per case: the name, the parameter and the ns per operation.
+ * The exit code is 1 if a behaviour check failed.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "kshim.h"
+#include "linux-modac.h"
+#include "packet-queue.h"
+#include "event-list.h"
+#include "rm.h"
+
+#define UBENCH_DEFAULT_REPEAT 5
+
+#define CB_COUNT 1024
+#define CB_BATCH 64
+
+#define DISPATCH_EVENT 40
+
+#define RM_PULSEGEN_COUNT 16
+#define RM_OUTPUT_COUNT 32
+
+static unsigned long scale = 1;
+static int repeat = UBENCH_DEFAULT_REPEAT;
+static const char *filter = NULL;
+static int failed = 0;
+
+/* the results are summed here so that the work can't be optimized away */
+static volatile u64 sink;
+
+typedef u64 (*bench_fn)(u64 ops, void *arg);
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Runs the case 'repeat' times and prints the fastest run. */
+static void run(const char *name, const char *param, bench_fn fn, void *arg,
+				u64 ops)
+{
+	u64 best = ~0ULL;
+	int i;
+
+	if(filter != NULL && strstr(name, filter) == NULL)
+		return;
+
+	ops *= scale;
+
+	for(i = 0; i < repeat; i ++) {
+		u64 ns = fn(ops, arg);
+		if(ns < best)
+			best = ns;
+	}
+
+	printf("%-24s %-14s %10.2f ns/op  (%llu ops)\n", name, param,
+		   (double)best / ops, (unsigned long long)ops);
+}
+
+static void check(const char *name, const char *param, int ok)
+{
+	if(filter != NULL && strstr(name, filter) == NULL)
+		return;
+
+	printf("%-24s %-14s %10s\n", name, param, ok ? "ok" : "FAILED");
+	if(!ok)
+		failed = 1;
+}
+
+// ------ packet queue --------------------------------------------------------
+
+struct cb_arg {
+	int data_length;
+};
+
+/* One put and one get (peek + consume) per operation. */
+static u64 bench_cb_put_get(u64 ops, void *arg)
+{
+	struct cb_arg *cb_arg = (struct cb_arg *)arg;
+	struct modac_circ_buf cb;
+	struct modac_cb_span spans[2];
+	u8 data[CBUF_EVENT_ENTRY_DATA_LENGTH_EXT] = { 0 };
+	u64 t0, t1, i;
+
+	if(modac_cb_init(&cb, CB_COUNT, cb_arg->data_length) < 0) {
+		fprintf(stderr, "modac_cb_init failed\n");
+		exit(2);
+	}
+
+	t0 = now_ns();
+	for(i = 0; i < ops; i ++) {
+		modac_cb_put(&cb, (int)(i & 0xFF), data, cb_arg->data_length, 0, NULL);
+		if(modac_cb_peek(&cb, 1, spans) == 1)
+			sink += spans[0].entries->event;
+		modac_cb_consume(&cb, 1);
+	}
+	t1 = now_ns();
+
+	modac_cb_fini(&cb);
+	return t1 - t0;
+}
+
+/* CB_BATCH puts, then all of them got at once; one event per operation. */
+static u64 bench_cb_put_get_batch(u64 ops, void *arg)
+{
+	struct cb_arg *cb_arg = (struct cb_arg *)arg;
+	struct modac_circ_buf cb;
+	struct modac_cb_span spans[2];
+	u8 data[CBUF_EVENT_ENTRY_DATA_LENGTH_EXT] = { 0 };
+	u64 t0, t1, i;
+
+	if(modac_cb_init(&cb, CB_COUNT, cb_arg->data_length) < 0) {
+		fprintf(stderr, "modac_cb_init failed\n");
+		exit(2);
+	}
+
+	t0 = now_ns();
+	for(i = 0; i < ops; i += CB_BATCH) {
+		int j, n, is;
+
+		for(j = 0; j < CB_BATCH; j ++)
+			modac_cb_put(&cb, j, data, cb_arg->data_length, 0, NULL);
+
+		n = modac_cb_peek(&cb, CB_BATCH, spans);
+		for(is = 0; is < 2; is ++) {
+			for(j = 0; j < spans[is].count; j ++)
+				sink += modac_cb_span_entry(&cb, &spans[is], j)->event;
+		}
+		modac_cb_consume(&cb, n);
+	}
+	t1 = now_ns();
+
+	modac_cb_fini(&cb);
+	return t1 - t0;
+}
+
+/* The puts to a full queue, i.e. the overflow path. */
+static u64 bench_cb_put_full(u64 ops, void *arg)
+{
+	struct cb_arg *cb_arg = (struct cb_arg *)arg;
+	struct modac_circ_buf cb;
+	u8 data[CBUF_EVENT_ENTRY_DATA_LENGTH_EXT] = { 0 };
+	u64 t0, t1, i;
+
+	if(modac_cb_init(&cb, CB_COUNT, cb_arg->data_length) < 0) {
+		fprintf(stderr, "modac_cb_init failed\n");
+		exit(2);
+	}
+
+	for(i = 0; i < CB_COUNT; i ++)
+		modac_cb_put(&cb, 1, data, cb_arg->data_length, 0, NULL);
+
+	t0 = now_ns();
+	for(i = 0; i < ops; i ++)
+		sink += modac_cb_put(&cb, 1, data, cb_arg->data_length, 0, NULL);
+	t1 = now_ns();
+
+	modac_cb_fini(&cb);
+	return t1 - t0;
+}
+
+/*
+ * A full queue keeps CB_COUNT - 2 events followed by one overflow marker;
+ * the rest is dropped. While the marker is not read, no other entry is
+ * added (the slot freed by the reader must not be reused); after that a new
+ * overflow gets a new marker.
+ */
+static int check_cb_overflow(void)
+{
+	struct modac_circ_buf cb;
+	struct modac_cb_span spans[2], *last;
+	u8 data[CBUF_EVENT_ENTRY_DATA_LENGTH] = { 0 };
+	int puts = CB_COUNT + 100;
+	int ok = 1;
+	int i, n;
+
+	if(modac_cb_init(&cb, CB_COUNT, CBUF_EVENT_ENTRY_DATA_LENGTH) < 0)
+		return 0;
+
+	for(i = 0; i < puts; i ++)
+		modac_cb_put(&cb, i & 0xFF, data, sizeof(data), 0, NULL);
+
+	ok &= modac_cb_count(&cb) == CB_COUNT - 1;
+	ok &= cb.stats.put == CB_COUNT - 2;
+	ok &= cb.stats.overflows == 1;
+	ok &= cb.stats.dropped == puts - (CB_COUNT - 2);
+	ok &= cb.stats.high_water == CB_COUNT - 2;
+
+	n = modac_cb_peek(&cb, CB_COUNT, spans);
+	ok &= n == CB_COUNT - 1 && spans[1].count == 0;
+	ok &= modac_cb_span_entry(&cb, &spans[0], 0)->event == 0;
+	ok &= modac_cb_span_entry(&cb, &spans[0], n - 1)->event ==
+			MODAC_EVENT_READ_OVERFLOW;
+
+	/* one read; the marker is still there, so nothing is added */
+	modac_cb_consume(&cb, 1);
+	for(i = 0; i < 3; i ++)
+		ok &= modac_cb_put(&cb, 1, data, sizeof(data), 0, NULL) < 0;
+	ok &= modac_cb_count(&cb) == CB_COUNT - 2;
+	ok &= cb.stats.overflows == 1;
+
+	/* all read; the next overflow gets a new marker */
+	n = modac_cb_peek(&cb, CB_COUNT, spans);
+	modac_cb_consume(&cb, n);
+	for(i = 0; i < puts; i ++)
+		modac_cb_put(&cb, 2, data, sizeof(data), 0, NULL);
+	ok &= modac_cb_count(&cb) == CB_COUNT - 1;
+	ok &= cb.stats.overflows == 2;
+
+	n = modac_cb_peek(&cb, CB_COUNT, spans);
+	ok &= n == CB_COUNT - 1;
+	last = spans[1].count > 0 ? &spans[1] : &spans[0];
+	ok &= modac_cb_span_entry(&cb, last, last->count - 1)->event ==
+			MODAC_EVENT_READ_OVERFLOW;
+
+	modac_cb_fini(&cb);
+	return ok;
+}
+
+// ------ event log -----------------------------------------------------------
+
+/*
+ * One event delivered to 'readers' readers per operation: either copied to 
+ * a queue of each reader or written once to the event log and got by each
+ * reader with its own cursor.
+ */
+static u64 bench_cb_fanout(u64 ops, void *arg)
+{
+	int readers = *(const int *)arg;
+	struct modac_circ_buf cb[16];
+	struct modac_cb_span spans[2];
+	u8 data[CBUF_EVENT_ENTRY_DATA_LENGTH] = { 0 };
+	u64 t0, t1, i;
+	int r;
+
+	for(r = 0; r < readers; r ++) {
+		if(modac_cb_init(&cb[r], CB_COUNT, CBUF_EVENT_ENTRY_DATA_LENGTH) < 0) {
+			fprintf(stderr, "modac_cb_init failed\n");
+			exit(2);
+		}
+	}
+
+	t0 = now_ns();
+	for(i = 0; i < ops; i ++) {
+		for(r = 0; r < readers; r ++)
+			modac_cb_put(&cb[r], (int)(i & 0xFF), data, sizeof(data), 0, NULL);
+		for(r = 0; r < readers; r ++) {
+			if(modac_cb_peek(&cb[r], 1, spans) == 1)
+				sink += spans[0].entries->event;
+			modac_cb_consume(&cb[r], 1);
+		}
+	}
+	t1 = now_ns();
+
+	for(r = 0; r < readers; r ++)
+		modac_cb_fini(&cb[r]);
+	return t1 - t0;
+}
+
+static u64 bench_log_fanout(u64 ops, void *arg)
+{
+	int readers = *(const int *)arg;
+	struct modac_event_log log;
+	u32 cursor[16] = { 0 };
+	u32 entry_buf[CBUF_ENTRY_SIZE(CBUF_EVENT_ENTRY_DATA_LENGTH_EXT) / sizeof(u32)];
+	struct modac_circ_buf_entry *entry = (struct modac_circ_buf_entry *)entry_buf;
+	u8 data[CBUF_EVENT_ENTRY_DATA_LENGTH] = { 0 };
+	u64 t0, t1, i;
+	int r;
+
+	if(modac_log_init(&log, CB_COUNT, CBUF_EVENT_ENTRY_DATA_LENGTH_EXT) < 0) {
+		fprintf(stderr, "modac_log_init failed\n");
+		exit(2);
+	}
+
+	t0 = now_ns();
+	for(i = 0; i < ops; i ++) {
+		modac_log_put(&log, (int)(i & 0xFF), data, sizeof(data), sizeof(data), 0);
+		for(r = 0; r < readers; r ++) {
+			if(modac_log_get(&log, cursor[r], entry, CBUF_EVENT_ENTRY_DATA_LENGTH, 
+					NULL) == 0)
+				sink += entry->event;
+			cursor[r] ++;
+		}
+	}
+	t1 = now_ns();
+
+	modac_log_fini(&log);
+	return t1 - t0;
+}
+
+/*
+ * The entries stay readable until the writer gets a whole log ahead; then
+ * they are reported as overwritten. Also the entries that were never 
+ * written must not look valid. The readers with the regular entries get
+ * only the regular part of the extended data (8 bytes here, as the EVR
+ * FIFO events).
+ */
+static int check_log_overrun(void)
+{
+	struct modac_event_log log;
+	u32 entry_buf[CBUF_ENTRY_SIZE(CBUF_EVENT_ENTRY_DATA_LENGTH_EXT) / sizeof(u32)];
+	struct modac_circ_buf_entry *entry = (struct modac_circ_buf_entry *)entry_buf;
+	u8 data[CBUF_EVENT_ENTRY_DATA_LENGTH_EXT];
+	u32 seq;
+	int ok = 1;
+
+	if(modac_log_init(&log, CB_COUNT, CBUF_EVENT_ENTRY_DATA_LENGTH_EXT) < 0)
+		return 0;
+
+	for(seq = 0; seq < CB_COUNT; seq ++)
+		ok &= modac_log_get(&log, seq, entry, sizeof(data), NULL) < 0;
+
+	memset(data, 0xAB, sizeof(data));
+	for(seq = 0; seq < CB_COUNT; seq ++)
+		modac_log_put(&log, seq & 0xFF, data, 8, sizeof(data), seq + 1);
+
+	ok &= modac_log_head(&log) == CB_COUNT && log.hdr->head == CB_COUNT;
+	for(seq = 0; seq < CB_COUNT; seq ++) {
+		u32 stamp = 0;
+		ok &= modac_log_get(&log, seq, entry, CBUF_EVENT_ENTRY_DATA_LENGTH, 
+				&stamp) == 0;
+		ok &= entry->event == (seq & 0xFF) && stamp == seq + 1;
+		ok &= entry->length == 8 && entry->data[7] == 0xAB;
+	}
+
+	/* one more: the oldest one is gone, the next is still there */
+	modac_log_put(&log, 1, data, 8, sizeof(data), 0);
+	ok &= modac_log_get(&log, 0, entry, sizeof(data), NULL) < 0;
+	ok &= modac_log_get(&log, 1, entry, sizeof(data), NULL) == 0;
+	ok &= modac_log_get(&log, CB_COUNT, entry, sizeof(data), NULL) == 0;
+	ok &= entry->length == sizeof(data);
+
+	modac_log_fini(&log);
+	return ok;
+}
+
+// ------ event dispatch ------------------------------------------------------
+
+struct subscriber {
+	u64 events;
+};
+
+static struct subscriber subscribers[EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS];
+
+static void count_event(void *subscriber, void *arg)
+{
+	((struct subscriber *)subscriber)->events ++;
+}
+
+/* One dispatch of an event with 'subs' subscribers per operation. */
+static u64 bench_dispatch_fanout(u64 ops, void *arg)
+{
+	int subs = *(int *)arg;
+	struct event_dispatch_list *list = calloc(1, sizeof(*list));
+	u64 t0, t1, i;
+	int s;
+
+	event_dispatch_list_init(list);
+	for(s = 0; s < subs; s ++)
+		event_dispatch_list_add(list, &subscribers[s], DISPATCH_EVENT);
+
+	t0 = now_ns();
+	for(i = 0; i < ops; i ++)
+		event_dispatch_list_for_all_subscribers(list, DISPATCH_EVENT,
+												count_event, NULL);
+	t1 = now_ns();
+
+	for(s = 0; s < subs; s ++)
+		sink += subscribers[s].events;
+
+	free(list);
+	return t1 - t0;
+}
+
+/*
+ * All the subscriber slots taken, 8 events each; one subscribe plus one
+ * unsubscribe of a changing subscriber and event per operation.
+ */
+static u64 bench_subscribe_churn(u64 ops, void *arg)
+{
+	struct event_dispatch_list *list = calloc(1, sizeof(*list));
+	u64 t0, t1, i;
+	int s, e;
+
+	event_dispatch_list_init(list);
+	for(s = 0; s < EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS; s ++) {
+		for(e = 0; e < 8; e ++)
+			event_dispatch_list_add(list, &subscribers[s], 1 + s * 8 + e);
+	}
+
+	t0 = now_ns();
+	for(i = 0; i < ops; i ++) {
+		struct subscriber *sub = &subscribers[i % EVENT_DISPATCH_LIST_MAX_SUBSCRIBERS];
+		int event = 256 + (int)((i * 7) % 256);
+
+		event_dispatch_list_add(list, sub, event);
+		event_dispatch_list_remove(list, sub, event);
+	}
+	t1 = now_ns();
+
+	free(list);
+	return t1 - t0;
+}
+
+/*
+ * One subscriber subscribing to 'events' events and then unsubscribing
+ * from all of them (as on close) per operation.
+ */
+static u64 bench_subscribe_remove_all(u64 ops, void *arg)
+{
+	int events = *(int *)arg;
+	struct event_dispatch_list *list = calloc(1, sizeof(*list));
+	u64 t0, t1, i;
+	int e;
+
+	event_dispatch_list_init(list);
+
+	t0 = now_ns();
+	for(i = 0; i < ops; i ++) {
+		for(e = 0; e < events; e ++)
+			event_dispatch_list_add(list, &subscribers[0], e * 2);
+		event_dispatch_list_remove_all(list, &subscribers[0]);
+	}
+	t1 = now_ns();
+
+	free(list);
+	return t1 - t0;
+}
+
+// ------ resource manager ----------------------------------------------------
+
+/* The same rule as the EVR uses: the shortest fitting prescaler wins. */
+static int pulsegen_suits(struct modac_rm_data *rm_data, int index, int *arg_filters)
+{
+	static const int prescaler_bits[RM_PULSEGEN_COUNT] = {
+		16, 16, 32, 32, 8, 8, 8, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+	};
+
+	if(prescaler_bits[index] < arg_filters[0])
+		return 0;
+
+	return 32 + arg_filters[0] - prescaler_bits[index] + 1;
+}
+
+static int output_suits(struct modac_rm_data *rm_data, int index, int *arg_filters)
+{
+	return 0;
+}
+
+static struct modac_hw_res_def rm_res_defs[2] = {
+	{
+		.name = "pulsegen",
+		.count = RM_PULSEGEN_COUNT,
+		.flags = MODAC_RES_FLAG_EXCLUSIVE,
+		.suits = pulsegen_suits,
+	},
+	{
+		.name = "output",
+		.count = RM_OUTPUT_COUNT,
+		.flags = MODAC_RES_FLAG_EXCLUSIVE,
+		.suits = output_suits,
+	},
+};
+
+static struct modac_hw_support_data rm_hw_support_data = {
+	.hw_res_def_count = 2,
+	.hw_res_defs = rm_res_defs,
+};
+
+/*
+ * All the pulsegens allocated from the pool (asking for different
+ * prescalers) and freed by the owner; one allocation per operation.
+ */
+static u64 bench_rm_alloc_pool(u64 ops, void *arg)
+{
+	struct modac_rm_data *rm_data = (struct modac_rm_data *)arg;
+	struct modac_rm_vres_desc vres_desc;
+	u64 t0, t1, i;
+
+	t0 = now_ns();
+	for(i = 0; i < ops; i += RM_PULSEGEN_COUNT) {
+		int j;
+
+		for(j = 0; j < RM_PULSEGEN_COUNT; j ++) {
+			int arg_filters[1] = { (j & 3) * 8 };
+			sink += modac_rm_alloc(rm_data, 1, "pulsegen",
+					MODAC_RM_ALLOC_FROM_POOL, arg_filters, &vres_desc);
+		}
+		modac_rm_free_owner(rm_data, 1);
+	}
+	t1 = now_ns();
+
+	return t1 - t0;
+}
+
+/* All the outputs allocated by the index and freed by the owner. */
+static u64 bench_rm_alloc_fixed(u64 ops, void *arg)
+{
+	struct modac_rm_data *rm_data = (struct modac_rm_data *)arg;
+	struct modac_rm_vres_desc vres_desc;
+	u64 t0, t1, i;
+
+	t0 = now_ns();
+	for(i = 0; i < ops; i += RM_OUTPUT_COUNT) {
+		int j;
+
+		for(j = 0; j < RM_OUTPUT_COUNT; j ++)
+			sink += modac_rm_alloc(rm_data, 1, "output", j, NULL, &vres_desc);
+		modac_rm_free_owner(rm_data, 1);
+	}
+	t1 = now_ns();
+
+	return t1 - t0;
+}
+
+/* The pool allocation takes the best fit and fails when exhausted. */
+static int check_rm_alloc(struct modac_rm_data *rm_data)
+{
+	struct modac_rm_vres_desc vres_desc;
+	int arg_filters[1] = { 8 };
+	int ok = 1;
+	int i;
+
+	// the 8-bit ones first
+	for(i = 0; i < 4; i ++) {
+		ok &= modac_rm_alloc(rm_data, 1, "pulsegen", MODAC_RM_ALLOC_FROM_POOL,
+				arg_filters, &vres_desc) >= 0;
+		ok &= vres_desc.index >= 4 && vres_desc.index < 8;
+	}
+
+	// then the 16-bit
+	ok &= modac_rm_alloc(rm_data, 1, "pulsegen", MODAC_RM_ALLOC_FROM_POOL,
+			arg_filters, &vres_desc) >= 0;
+	ok &= vres_desc.index == 0 || vres_desc.index == 1;
+
+	// no 33-bit ones
+	arg_filters[0] = 33;
+	ok &= modac_rm_alloc(rm_data, 1, "pulsegen", MODAC_RM_ALLOC_FROM_POOL,
+			arg_filters, &vres_desc) == -EACCES;
+
+	ok &= modac_rm_alloc(rm_data, 2, "output", 3, NULL, &vres_desc) >= 0;
+	ok &= modac_rm_alloc(rm_data, 1, "output", 3, NULL, &vres_desc) == -EADDRINUSE;
+	ok &= modac_rm_get_owner(rm_data, &vres_desc) == 2;
+
+	modac_rm_free_owner(rm_data, 1);
+	modac_rm_free_owner(rm_data, 2);
+	ok &= modac_rm_get_owner(rm_data, &vres_desc) == -EACCES;
+
+	return ok;
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+	static const int fanout_subs[] = { 1, 2, 4, 8, 16, 24, 31 };
+	static const int remove_all_events[] = { 1, 16, 64 };
+	static const int fanout_readers[] = { 1, 4, 16 };
+	struct cb_arg cb_regular = { CBUF_EVENT_ENTRY_DATA_LENGTH };
+	struct cb_arg cb_ext = { CBUF_EVENT_ENTRY_DATA_LENGTH_EXT };
+	struct modac_rm_data rm_data;
+	char param[32];
+	int opt;
+	int i;
+
+	while((opt = getopt(argc, argv, "s:r:f:")) != -1) {
+		switch(opt) {
+		case 's':
+			scale = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s SCALE] [-r REPEAT] [-f FILTER]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if(scale < 1)
+		scale = 1;
+	if(repeat < 1)
+		repeat = 1;
+
+	run("cb_put_get", "data=12", bench_cb_put_get, &cb_regular, 1000000);
+	run("cb_put_get", "data=28", bench_cb_put_get, &cb_ext, 1000000);
+	run("cb_put_get_batch", "data=12", bench_cb_put_get_batch, &cb_regular, 1000000);
+	run("cb_put_get_batch", "data=28", bench_cb_put_get_batch, &cb_ext, 1000000);
+	run("cb_put_full", "data=12", bench_cb_put_full, &cb_regular, 1000000);
+	check("cb_overflow", "count=1024", check_cb_overflow());
+
+	for(i = 0; i < sizeof(fanout_readers) / sizeof(fanout_readers[0]); i ++) {
+		snprintf(param, sizeof(param), "readers=%d", fanout_readers[i]);
+		run("cb_fanout", param, bench_cb_fanout, (void *)&fanout_readers[i], 
+			1000000);
+		run("log_fanout", param, bench_log_fanout, (void *)&fanout_readers[i], 
+			1000000);
+	}
+	check("log_overrun", "count=1024", check_log_overrun());
+
+	for(i = 0; i < sizeof(fanout_subs) / sizeof(fanout_subs[0]); i ++) {
+		snprintf(param, sizeof(param), "subs=%d", fanout_subs[i]);
+		run("dispatch_fanout", param, bench_dispatch_fanout,
+			(void *)&fanout_subs[i], 1000000);
+	}
+
+	run("subscribe_churn", "subs=31", bench_subscribe_churn, NULL, 1000000);
+
+	for(i = 0; i < sizeof(remove_all_events) / sizeof(remove_all_events[0]); i ++) {
+		snprintf(param, sizeof(param), "events=%d", remove_all_events[i]);
+		run("subscribe_remove_all", param, bench_subscribe_remove_all,
+			(void *)&remove_all_events[i], 20000);
+	}
+
+	if(modac_rm_init(&rm_hw_support_data, &rm_data) < 0) {
+		fprintf(stderr, "modac_rm_init failed\n");
+		return 2;
+	}
+
+	run("rm_alloc_pool", "pulsegen=16", bench_rm_alloc_pool, &rm_data, 160000);
+	run("rm_alloc_fixed", "output=32", bench_rm_alloc_fixed, &rm_data, 320000);
+	check("rm_alloc", "best_fit", check_rm_alloc(&rm_data));
+
+	modac_rm_end(&rm_data);
+
+	return failed;
+}